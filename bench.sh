@@ -0,0 +1,24 @@
+#!/bin/sh
+# Usage: bench.sh [baseline.tsv]
+# Assembles the listings, runs the decoder benchmarks and writes the results
+# to build/bench_results.tsv, compared to baseline.tsv when given.
+
+if [ ! -d listings ]; then
+    echo Error: listings/ directory not found.
+    exit 1
+fi
+
+./build.sh || exit 1
+
+binaries=""
+for listing in listings/*.asm; do
+    binary=build/$(basename "$listing" .asm)
+    nasm -o "$binary" "$listing" || exit 1
+    binaries="$binaries $binary"
+done
+
+if [ -n "$1" ]; then
+    ./build/bench --baseline "$1" --out build/bench_results.tsv $binaries
+else
+    ./build/bench --out build/bench_results.tsv $binaries
+fi
@@ -4,7 +4,14 @@ echo Building...
 call vcvars.bat
 if not exist build mkdir build
 pushd build
-cl -MT -nologo -Gm- -GR- -EHa- -Od -Oi -W0 -FC -Z7 ..\src\main.cpp
+cl -MT -nologo -Gm- -GR- -EHa- -Od -Oi -W0 -FC -Z7 -c ..\src\decode.cpp
+lib -nologo decode.obj -OUT:decoder.lib
+cl -MT -nologo -Gm- -GR- -EHa- -Od -Oi -W0 -FC -Z7 ..\src\main.cpp decoder.lib
+cl -MT -nologo -Gm- -GR- -EHa- -Od -Oi -W0 -FC -Z7 -DSIMULATOR_EAGER_FLAGS -Femain_eager.exe ..\src\main.cpp decoder.lib
+cl -MT -nologo -Gm- -GR- -EHa- -O2 -Oi -W0 -FC -Z7 ..\src\bench.cpp
+cl -MT -nologo -Gm- -GR- -EHa- -O2 -Oi -W0 -FC -Z7 ..\src\fuzz.cpp
+cl -MT -nologo -Gm- -GR- -EHa- -O2 -Oi -W0 -FC -Z7 -arch:AVX2 ..\src\sim_bench.cpp
+cl -MT -nologo -Gm- -GR- -EHa- -Od -Oi -W0 -FC -Z7 ..\src\bin2asm.cpp decoder.lib
 popd
 
 exit /b 0
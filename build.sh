@@ -0,0 +1,13 @@
+#!/bin/sh
+
+echo Building...
+mkdir -p build
+cd build
+g++ -O0 -g -w -c -o decode.o ../src/decode.cpp
+ar rcs libdecoder.a decode.o
+g++ -O0 -g -w -pthread -o main ../src/main.cpp libdecoder.a
+g++ -O0 -g -w -pthread -DSIMULATOR_EAGER_FLAGS -o main_eager ../src/main.cpp libdecoder.a
+g++ -O2 -g -w -o bench ../src/bench.cpp
+g++ -O2 -g -w -o fuzz ../src/fuzz.cpp
+g++ -O0 -g -w -o bin2asm ../src/bin2asm.cpp libdecoder.a
+g++ -O2 -g -w -mavx2 -mpopcnt -o sim_bench ../src/sim_bench.cpp
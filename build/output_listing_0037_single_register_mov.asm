@@ -0,0 +1,3 @@
+; build/listing_0037_single_register_mov
+bits 16
+mov cx, bx
@@ -0,0 +1,13 @@
+; build/listing_0040_challenge_movs
+bits 16
+mov ax, [bx+di+-37]
+mov [si+-300], cx
+mov dx, [bx+-32]
+mov byte [bp+di], 7
+mov word [di+901], 347
+mov bp, [5]
+mov bx, [3458]
+mov ax, [2555]
+mov ax, [16]
+mov [2554], ax
+mov [15], ax
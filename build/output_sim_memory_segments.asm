@@ -0,0 +1,32 @@
+; build/sim_memory_segments
+bits 16
+mov ax, 4096
+mov ds, ax
+mov word [0], 4660
+mov ax, 8192
+mov ss, ax
+mov bp, 0
+mov word [bp+2], 22136
+mov bx, -1
+mov word [bx], -21555
+mov ax, -1
+mov ds, ax
+mov word [1024], 16962
+mov cx, [1024]
+mov ax, 0
+mov ds, ax
+mov di, [1008]
+mov si, [bp+2]
+add di, si
+mov bp, 2000
+mov dx, 200
+mov si, 0
+mov [bp+si], si
+add [bp+si], dx
+mov ax, [bp+si]
+add bx, ax
+add si, 2
+cmp si, 1000
+jne $+0-15
+sub dx, 1
+jne $+0-23
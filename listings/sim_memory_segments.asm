@@ -0,0 +1,42 @@
+; ========================================================================
+; Simulator check: word stores and loads through ds, ss and bp, with a ds
+; of 0xffff whose addresses wrap past 1MB, both loads summed in di. Then a
+; loop that sums memory written through [bp+si] in the ss segment. The
+; final registers are in listings/exec/sim_memory_segments.txt.
+; ========================================================================
+
+bits 16
+
+mov ax, 4096
+mov ds, ax
+mov word [0], 4660
+mov ax, 8192
+mov ss, ax
+mov bp, 0
+mov word [bp+2], 22136
+mov bx, 65535
+mov word [bx], 43981
+mov ax, 65535
+mov ds, ax
+mov word [1024], 16962
+mov cx, [1024]
+mov ax, 0
+mov ds, ax
+mov di, [1008]
+mov si, [bp+2]
+add di, si
+
+mov bp, 2000
+mov dx, 200
+outer:
+mov si, 0
+inner:
+mov [bp+si], si
+add [bp+si], dx
+mov ax, [bp+si]
+add bx, ax
+add si, 2
+cmp si, 1000
+jnz inner
+sub dx, 1
+jnz outer
@@ -0,0 +1,315 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include <atomic>
+#include <thread>
+
+// Disassembles many files in one process.
+//
+// Files are sorted by size and dealt round robin, so every worker starts
+// with a contiguous run of tasks of about the same total size, largest
+// first. A worker takes tasks from the front of its own run and, once it is
+// empty, steals from the back of the others', where the smallest tasks are.
+// Each run is a [begin, end) pair packed in one atomic word, so both ends
+// are claimed with a single compare-and-swap.
+//
+// With an output directory each file is written to <directory>/<name>.asm
+// through the worker's reusable buffer. Without one, every file is rendered
+// in memory and written to stdout in input order.
+
+#define BATCH_MAX_THREADS 64
+
+struct BatchTask {
+  char *input_path;
+  uint64_t size;
+
+  OutputBuffer text;
+  bool success;
+};
+
+struct TaskSize {
+  uint64_t size;
+  uint32_t task_idx;
+};
+
+struct WorkQueue {
+  alignas(64) std::atomic<uint64_t> range;
+};
+
+struct Batch {
+  Decoder const *decoder;
+  char const *output_directory;
+
+  BatchTask *tasks;
+  std::atomic<uint32_t> *is_done;
+  uint32_t task_count;
+  // Task indices, one contiguous run per worker.
+  uint32_t *order;
+
+  WorkQueue queues[BATCH_MAX_THREADS];
+  uint32_t worker_count;
+
+  std::atomic<uint32_t> failure_count;
+};
+
+static uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return (uint64_t)end << 32 | begin;
+}
+
+static bool PopFront(WorkQueue *queue, uint32_t *position) {
+  uint64_t range = queue->range.load(std::memory_order_relaxed);
+  for (;;) {
+    uint32_t begin = (uint32_t)range;
+    uint32_t end = (uint32_t)(range >> 32);
+    if (begin == end) {
+      return false;
+    }
+    if (queue->range.compare_exchange_weak(range, PackRange(begin + 1, end))) {
+      *position = begin;
+      return true;
+    }
+  }
+}
+
+static bool StealBack(WorkQueue *queue, uint32_t *position) {
+  uint64_t range = queue->range.load(std::memory_order_relaxed);
+  for (;;) {
+    uint32_t begin = (uint32_t)range;
+    uint32_t end = (uint32_t)(range >> 32);
+    if (begin == end) {
+      return false;
+    }
+    if (queue->range.compare_exchange_weak(range, PackRange(begin, end - 1))) {
+      *position = end - 1;
+      return true;
+    }
+  }
+}
+
+static bool GetNextTask(Batch *batch, uint32_t worker_idx, uint32_t *task_idx) {
+  uint32_t position;
+  bool found = PopFront(&batch->queues[worker_idx], &position);
+  for (uint32_t victim_offset = 1;
+       !found && victim_offset < batch->worker_count; ++victim_offset) {
+    uint32_t victim = (worker_idx + victim_offset) % batch->worker_count;
+    found = StealBack(&batch->queues[victim], &position);
+  }
+
+  if (found) {
+    *task_idx = batch->order[position];
+  }
+  return found;
+}
+
+static char const *GetBaseName(char const *path) {
+  char const *result = path;
+  for (char const *c = path; *c; ++c) {
+    if (*c == '/' || *c == '\\') {
+      result = c + 1;
+    }
+  }
+
+  return result;
+}
+
+static void RunBatchTask(Batch *batch, uint32_t task_idx, OutputBuffer *out) {
+  BatchTask *task = &batch->tasks[task_idx];
+  MappedFile image = {};
+  FILE *file = 0;
+  task->success = MapFile(task->input_path, &image);
+  if (!task->success) {
+    fprintf(stderr, "ERROR: Unable to open %s.\n", task->input_path);
+  } else if (batch->output_directory) {
+    char output_path[4096];
+    snprintf(output_path, sizeof(output_path), "%s/%s.asm",
+             batch->output_directory, GetBaseName(task->input_path));
+    file = fopen(output_path, "wb");
+    task->success = file != 0;
+    if (!task->success) {
+      fprintf(stderr, "ERROR: Unable to create %s.\n", output_path);
+    }
+  } else {
+    task->text = CreateOutputBuffer(0, 64 * 1024);
+    out = &task->text;
+  }
+
+  if (task->success) {
+    out->file = file;
+    PrintHeader(out, task->input_path);
+
+    uint64_t error_address;
+    task->success = DisassembleImage(batch->decoder, image.data, image.size, out,
+                                     &error_address);
+    if (!task->success) {
+      uint8_t byte = image.data[error_address];
+      char message[64];
+      snprintf(message, sizeof(message),
+               "\n" BYTE_TO_BINARY_PATTERN " - INSTRUCTION NOT IMPLEMENTED\n",
+               BYTE_TO_BINARY(byte));
+      WriteOutput(out, (uint8_t const *)message, strlen(message));
+      fprintf(stderr, "ERROR: %s: unknown instruction at byte %llu.\n",
+              task->input_path, (unsigned long long)error_address);
+    }
+
+    if (file) {
+      FlushOutput(out);
+      fclose(file);
+      out->file = 0;
+    }
+  }
+
+  if (!task->success) {
+    ++batch->failure_count;
+  }
+  UnmapFile(&image);
+  batch->is_done[task_idx].store(1, std::memory_order_release);
+}
+
+static void RunBatchWorker(Batch *batch, uint32_t worker_idx) {
+  // Only used with an output directory: one buffer reused for every file.
+  OutputBuffer out = {};
+  if (batch->output_directory) {
+    out = CreateOutputBuffer(0);
+  }
+
+  uint32_t task_idx;
+  while (GetNextTask(batch, worker_idx, &task_idx)) {
+    RunBatchTask(batch, task_idx, &out);
+  }
+
+  if (batch->output_directory) {
+    DestroyOutputBuffer(&out);
+  }
+}
+
+static int CompareTaskSizes(void const *a, void const *b) {
+  uint64_t size_a = ((TaskSize const *)a)->size;
+  uint64_t size_b = ((TaskSize const *)b)->size;
+  return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+// Builds the per-worker runs described above.
+static void DistributeTasks(Batch *batch) {
+  TaskSize *by_size =
+      (TaskSize *)malloc(batch->task_count * sizeof(TaskSize) + 1);
+  for (uint32_t task_idx = 0; task_idx < batch->task_count; ++task_idx) {
+    by_size[task_idx].size = batch->tasks[task_idx].size;
+    by_size[task_idx].task_idx = task_idx;
+  }
+  qsort(by_size, batch->task_count, sizeof(TaskSize), CompareTaskSizes);
+
+  uint32_t position = 0;
+  for (uint32_t worker_idx = 0; worker_idx < batch->worker_count;
+       ++worker_idx) {
+    uint32_t begin = position;
+    for (uint32_t sorted_idx = worker_idx; sorted_idx < batch->task_count;
+         sorted_idx += batch->worker_count) {
+      batch->order[position++] = by_size[sorted_idx].task_idx;
+    }
+    batch->queues[worker_idx].range.store(PackRange(begin, position));
+  }
+
+  free(by_size);
+}
+
+// `size` only orders the work, 0 if it could not be read.
+static void AddBatchInput(Batch *batch, uint32_t *capacity, char const *path,
+                          uint64_t size) {
+  if (batch->task_count == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 1024;
+    batch->tasks =
+        (BatchTask *)realloc(batch->tasks, *capacity * sizeof(BatchTask));
+  }
+
+  BatchTask *task = &batch->tasks[batch->task_count++];
+  *task = {};
+  task->input_path = strdup(path);
+  task->size = size;
+}
+
+static int CompareInputPaths(void const *a, void const *b) {
+  return strcmp(((BatchTask const *)a)->input_path,
+                ((BatchTask const *)b)->input_path);
+}
+
+// Inputs are files or directories, whose files are taken in name order.
+// Returns the number of files that failed.
+uint32_t DisassembleBatch(Decoder const *decoder, char **inputs,
+                          uint32_t input_count, char const *output_directory,
+                          uint32_t thread_count) {
+  Batch *batch = new Batch();
+  batch->decoder = decoder;
+  batch->output_directory = output_directory;
+
+  uint32_t capacity = 0;
+  for (uint32_t input_idx = 0; input_idx < input_count; ++input_idx) {
+    if (IsDirectory(inputs[input_idx])) {
+      uint32_t first_task = batch->task_count;
+      ListDirectory(inputs[input_idx], [&](char const *path, uint64_t size) {
+        AddBatchInput(batch, &capacity, path, size);
+      });
+      qsort(batch->tasks + first_task, batch->task_count - first_task,
+            sizeof(BatchTask), CompareInputPaths);
+    } else {
+      AddBatchInput(batch, &capacity, inputs[input_idx],
+                    GetPathSize(inputs[input_idx]));
+    }
+  }
+
+  batch->worker_count = thread_count;
+  if (batch->worker_count > BATCH_MAX_THREADS) {
+    batch->worker_count = BATCH_MAX_THREADS;
+  }
+  if (batch->worker_count > batch->task_count) {
+    batch->worker_count = batch->task_count ? batch->task_count : 1;
+  }
+  batch->order = (uint32_t *)malloc(batch->task_count * sizeof(uint32_t) + 1);
+  batch->is_done = new std::atomic<uint32_t>[batch->task_count + 1]();
+  DistributeTasks(batch);
+
+  std::thread threads[BATCH_MAX_THREADS];
+  for (uint32_t worker_idx = 1; worker_idx < batch->worker_count;
+       ++worker_idx) {
+    threads[worker_idx] = std::thread(RunBatchWorker, batch, worker_idx);
+  }
+
+  if (output_directory) {
+    RunBatchWorker(batch, 0);
+  } else {
+    // The main thread is the in-order writer; worker 0's run is shared out
+    // by stealing.
+    OutputBuffer out = CreateOutputBuffer(stdout);
+    for (uint32_t task_idx = 0; task_idx < batch->task_count; ++task_idx) {
+      BatchTask *task = &batch->tasks[task_idx];
+      while (!batch->is_done[task_idx].load(std::memory_order_acquire)) {
+        uint32_t other_idx;
+        if (GetNextTask(batch, 0, &other_idx)) {
+          RunBatchTask(batch, other_idx, 0);
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      WriteOutput(&out, task->text.data, task->text.size);
+      DestroyOutputBuffer(&task->text);
+    }
+    DestroyOutputBuffer(&out);
+  }
+
+  for (uint32_t worker_idx = 1; worker_idx < batch->worker_count;
+       ++worker_idx) {
+    threads[worker_idx].join();
+  }
+
+  uint32_t result = batch->failure_count.load();
+  for (uint32_t task_idx = 0; task_idx < batch->task_count; ++task_idx) {
+    free(batch->tasks[task_idx].input_path);
+  }
+  delete[] batch->is_done;
+  free(batch->order);
+  free(batch->tasks);
+  delete batch;
+
+  return result;
+}
@@ -0,0 +1,450 @@
+#include "assert.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "decode.cpp"
+#include "generate.cpp"
+#include "print.cpp"
+#include "cfg.cpp"
+#include "platform_metrics.cpp"
+#include "platform_perf.cpp"
+
+// Decoder throughput over fixed corpora:
+// - listings: whole copies of the given assembled listings, back to back;
+// - generated: valid instructions from the generator, every encoding equally
+//   likely;
+// - random: pseudo-random bytes from a fixed seed, most of which decode to
+//   something and the rest to db.
+// The generator itself is timed on the generated corpus, and the control
+// flow graph on each corpus decoded beforehand. Each benchmark
+// keeps the fastest of BENCH_REPETITIONS runs and reports bytes/s,
+// instructions/s and rdtsc cycles per instruction, plus IPC, branch and
+// cache misses where the OS provides hardware counters. Results can be
+// written as tab separated values and compared to a previous file.
+
+#define BENCH_BUFFER_SIZE (16 * 1024 * 1024)
+#define BENCH_REPETITIONS 4
+#define BENCH_RANDOM_SEED 0x8086
+#define BENCH_MAX_BASELINE 64
+
+typedef Instruction ParseFunction(InstructionTable const *table,
+                                  MemoryAccess *memory_idx);
+
+struct BenchCorpus {
+  char const *name;
+  uint8_t *data;
+  uint64_t size;
+  // Whether every instruction decodes, which the raw parse loops need.
+  bool is_valid;
+  // As counted by BenchDecode.
+  uint64_t instruction_count;
+  // The whole corpus decoded, for the analysis passes.
+  Instruction *instructions;
+};
+
+struct BenchBaseline {
+  char name[32];
+  char corpus[32];
+  double instructions_per_second;
+};
+
+struct BenchContext {
+  Decoder decoder;
+  PerfCounters counters;
+  // Sink for the disassembly text.
+  FILE *null_file;
+  FILE *results;
+  InstructionGenerator generator;
+
+  BenchBaseline baseline[BENCH_MAX_BASELINE];
+  uint32_t baseline_count;
+};
+
+// Returns the number of instructions decoded, 0 on failure.
+typedef uint64_t BenchFunction(BenchContext *context, BenchCorpus *corpus);
+
+static Instruction ParseLinear(InstructionTable const *table,
+                               MemoryAccess *memory_idx) {
+  return ParseInstructionLinear(memory_idx);
+}
+
+static uint64_t ParseAll(ParseFunction *parse, InstructionTable const *table,
+                         BenchCorpus *corpus) {
+  uint64_t instruction_count = 0;
+  MemoryAccess memory_idx = {};
+  memory_idx.base = corpus->data;
+  while (memory_idx.address < corpus->size) {
+    Instruction instruction = parse(table, &memory_idx);
+    if (!instruction.op) {
+      fprintf(stderr, "ERROR: failed to decode at byte %llu.\n",
+              (unsigned long long)memory_idx.address);
+      return 0;
+    }
+    memory_idx.offset = instruction.size;
+    AdvanceMemory(&memory_idx);
+    ++instruction_count;
+  }
+
+  return instruction_count;
+}
+
+static uint64_t BenchLinear(BenchContext *context, BenchCorpus *corpus) {
+  return ParseAll(ParseLinear, &context->decoder.table, corpus);
+}
+
+static uint64_t BenchTable(BenchContext *context, BenchCorpus *corpus) {
+  return ParseAll(ParseInstruction, &context->decoder.table, corpus);
+}
+
+// DecodeInstructions in batches, as the disassembler does.
+static uint64_t BenchDecode(BenchContext *context, BenchCorpus *corpus) {
+  Instruction instructions[DISASSEMBLE_BATCH_SIZE];
+  uint64_t instruction_count = 0;
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < corpus->size) {
+    uint32_t count;
+    uint64_t consumed;
+    status = DecodeInstructions(&context->decoder, corpus->data + address,
+                                corpus->size - address, address, instructions,
+                                DISASSEMBLE_BATCH_SIZE, &count, &consumed);
+    instruction_count += count;
+    address += consumed;
+  }
+
+  return status == Decode_Ok ? instruction_count : 0;
+}
+
+// The whole single threaded disassembly of main, text included.
+static uint64_t BenchDisassemble(BenchContext *context, BenchCorpus *corpus) {
+  OutputBuffer out = CreateOutputBuffer(context->null_file);
+  uint64_t error_address;
+  bool success = DisassembleImage(&context->decoder, corpus->data,
+                                  corpus->size, &out, &error_address);
+  DestroyOutputBuffer(&out);
+
+  return success ? corpus->instruction_count : 0;
+}
+
+// DecodeInstructions, then every instruction encoded back and compared,
+// as main --verify does.
+static uint64_t BenchRoundTrip(BenchContext *context, BenchCorpus *corpus) {
+  Instruction instructions[DISASSEMBLE_BATCH_SIZE];
+  uint64_t instruction_count = 0;
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < corpus->size) {
+    uint32_t count;
+    uint64_t consumed;
+    status = DecodeInstructions(&context->decoder, corpus->data + address,
+                                corpus->size - address, address, instructions,
+                                DISASSEMBLE_BATCH_SIZE, &count, &consumed);
+    for (uint32_t instruction_idx = 0; instruction_idx < count;
+         ++instruction_idx) {
+      Instruction *instruction = &instructions[instruction_idx];
+      uint8_t *bytes = corpus->data + instruction->address;
+      uint8_t encoded[MAX_INSTRUCTION_SIZE];
+      uint32_t size = EncodeInstruction(instruction, encoded, sizeof(encoded));
+      if (size != instruction->size || memcmp(encoded, bytes, size) != 0) {
+        fprintf(stderr, "ERROR: %llu does not encode back.\n",
+                (unsigned long long)instruction->address);
+        return 0;
+      }
+    }
+    instruction_count += count;
+    address += consumed;
+  }
+
+  return status == Decode_Ok ? instruction_count : 0;
+}
+
+static uint64_t BenchCfg(BenchContext *context, BenchCorpus *corpus) {
+  ControlFlowGraph cfg;
+  BuildControlFlowGraph(&cfg, corpus->instructions,
+                        corpus->instruction_count, corpus->size);
+  uint32_t block_count = cfg.block_count;
+  DestroyControlFlowGraph(&cfg);
+
+  return block_count ? corpus->instruction_count : 0;
+}
+
+// Generates the corpus again, from the same seed.
+static uint64_t BenchGenerate(BenchContext *context, BenchCorpus *corpus) {
+  InstructionGenerator *generator = &context->generator;
+  InitGenerator(generator, BENCH_RANDOM_SEED);
+  uint64_t size =
+      GenerateInstructions(generator, corpus->data, BENCH_BUFFER_SIZE);
+  return size == corpus->size ? corpus->instruction_count : 0;
+}
+
+static void PrintPerfCount(char const *label, uint64_t value) {
+  if (value != PERF_UNAVAILABLE) {
+    printf(", %llu %s", (unsigned long long)value, label);
+  }
+}
+
+static void WritePerfCount(FILE *file, uint64_t value) {
+  if (value == PERF_UNAVAILABLE) {
+    fprintf(file, "\t-1");
+  } else {
+    fprintf(file, "\t%llu", (unsigned long long)value);
+  }
+}
+
+static BenchBaseline *FindBaseline(BenchContext *context, char const *name,
+                                   char const *corpus) {
+  for (uint32_t baseline_idx = 0; baseline_idx < context->baseline_count;
+       ++baseline_idx) {
+    BenchBaseline *baseline = &context->baseline[baseline_idx];
+    if (strcmp(baseline->name, name) == 0 &&
+        strcmp(baseline->corpus, corpus) == 0) {
+      return baseline;
+    }
+  }
+
+  return 0;
+}
+
+static void RunBench(BenchContext *context, char const *name,
+                     BenchFunction *function, BenchCorpus *corpus) {
+  double best_seconds = 0;
+  uint64_t best_cycles = 0;
+  PerfCounts best_counts = {};
+  uint64_t instruction_count = 0;
+  for (uint32_t repetition = 0; repetition < BENCH_REPETITIONS; ++repetition) {
+    StartPerfCounters(&context->counters);
+    uint64_t start = ReadOSTimer();
+    uint64_t start_cycles = ReadCPUTimer();
+    instruction_count = function(context, corpus);
+    uint64_t cycles = ReadCPUTimer() - start_cycles;
+    double seconds = SecondsElapsed(start, ReadOSTimer());
+    PerfCounts counts = StopPerfCounters(&context->counters);
+    if (!instruction_count) {
+      fprintf(stderr, "ERROR: %s failed on %s.\n", name, corpus->name);
+      return;
+    }
+
+    if (repetition == 0 || seconds < best_seconds) {
+      best_seconds = seconds;
+      best_cycles = cycles;
+      best_counts = counts;
+    }
+  }
+
+  double bytes_per_second = corpus->size / best_seconds;
+  double instructions_per_second = instruction_count / best_seconds;
+  double cycles_per_instruction = (double)best_cycles / instruction_count;
+  uint64_t *values = best_counts.values;
+  bool has_ipc = values[Perf_Cycles] != PERF_UNAVAILABLE &&
+                 values[Perf_Instructions] != PERF_UNAVAILABLE &&
+                 values[Perf_Cycles] != 0;
+
+  printf("%-12s %-10s %10llu instructions: %8.2f MB/s, %8.2f M "
+         "instructions/s, %6.2f cycles/instruction",
+         name, corpus->name, (unsigned long long)instruction_count,
+         bytes_per_second / 1000000.0, instructions_per_second / 1000000.0,
+         cycles_per_instruction);
+  if (has_ipc) {
+    printf(", IPC %.2f",
+           (double)values[Perf_Instructions] / values[Perf_Cycles]);
+  }
+  PrintPerfCount("branch misses", values[Perf_BranchMisses]);
+  PrintPerfCount("cache misses", values[Perf_CacheMisses]);
+  BenchBaseline *baseline = FindBaseline(context, name, corpus->name);
+  if (baseline) {
+    printf(" (%.2fx baseline)",
+           instructions_per_second / baseline->instructions_per_second);
+  }
+  printf("\n");
+
+  if (context->results) {
+    fprintf(context->results, "%s\t%s\t%llu\t%llu\t%.6f\t%.0f\t%.0f\t%.3f",
+            name, corpus->name, (unsigned long long)corpus->size,
+            (unsigned long long)instruction_count, best_seconds,
+            bytes_per_second, instructions_per_second,
+            cycles_per_instruction);
+    for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+      WritePerfCount(context->results, values[counter]);
+    }
+    fprintf(context->results, "\n");
+  }
+}
+
+static char const results_header[] =
+    "benchmark\tcorpus\tbytes\tinstructions\tseconds\tbytes_per_second\t"
+    "instructions_per_second\tcycles_per_instruction\tcycles\t"
+    "instructions_retired\tbranch_misses\tcache_misses\n";
+
+// Reads the instructions/s of each benchmark from a results file.
+static bool LoadBaseline(BenchContext *context, char const *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), file) &&
+         context->baseline_count < BENCH_MAX_BASELINE) {
+    BenchBaseline *baseline = &context->baseline[context->baseline_count];
+    if (sscanf(line, "%31s %31s %*s %*s %*s %*s %lf", baseline->name,
+               baseline->corpus, &baseline->instructions_per_second) == 3) {
+      ++context->baseline_count;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+// Whole copies of each input are packed back to back so that every copy
+// starts on an instruction boundary.
+static bool LoadListings(BenchCorpus *corpus, char **paths,
+                         uint32_t path_count) {
+  *corpus = {};
+  corpus->name = "listings";
+  corpus->data = (uint8_t *)malloc(BENCH_BUFFER_SIZE);
+  corpus->is_valid = true;
+  bool added = true;
+  while (added) {
+    added = false;
+    for (uint32_t path_idx = 0; path_idx < path_count; ++path_idx) {
+      FILE *file = fopen(paths[path_idx], "rb");
+      if (!file) {
+        fprintf(stderr, "ERROR: Unable to open %s.\n", paths[path_idx]);
+        return false;
+      }
+      fseek(file, 0, SEEK_END);
+      uint64_t file_size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+      if (corpus->size + file_size <= BENCH_BUFFER_SIZE) {
+        corpus->size += fread(corpus->data + corpus->size, 1, file_size, file);
+        added = file_size != 0;
+      }
+      fclose(file);
+    }
+  }
+
+  return true;
+}
+
+static void MakeGeneratedCorpus(BenchContext *context, BenchCorpus *corpus) {
+  *corpus = {};
+  corpus->name = "generated";
+  corpus->data = (uint8_t *)malloc(BENCH_BUFFER_SIZE);
+  corpus->is_valid = true;
+
+  InstructionGenerator *generator = &context->generator;
+  InitGenerator(generator, BENCH_RANDOM_SEED);
+  corpus->size =
+      GenerateInstructions(generator, corpus->data, BENCH_BUFFER_SIZE);
+}
+
+static void MakeRandomCorpus(BenchCorpus *corpus) {
+  *corpus = {};
+  corpus->name = "random";
+  corpus->data = (uint8_t *)malloc(BENCH_BUFFER_SIZE);
+  corpus->size = BENCH_BUFFER_SIZE;
+
+  // xorshift64
+  uint64_t state = BENCH_RANDOM_SEED;
+  for (uint64_t offset = 0; offset < corpus->size; offset += 8) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    memcpy(corpus->data + offset, &state, 8);
+  }
+}
+
+static void RunCorpus(BenchContext *context, BenchCorpus *corpus) {
+  printf("%s: %llu bytes\n", corpus->name,
+         (unsigned long long)corpus->size);
+  // DisassembleImage does not count its instructions.
+  corpus->instruction_count = BenchDecode(context, corpus);
+  if (corpus->is_valid) {
+    RunBench(context, "linear", BenchLinear, corpus);
+    RunBench(context, "table", BenchTable, corpus);
+  }
+  RunBench(context, "decode", BenchDecode, corpus);
+  RunBench(context, "disassemble", BenchDisassemble, corpus);
+
+  uint64_t instruction_count;
+  uint64_t error_address;
+  if (DecodeImage(&context->decoder, corpus->data, corpus->size,
+                  &corpus->instructions, &instruction_count, &error_address)) {
+    RunBench(context, "cfg", BenchCfg, corpus);
+  }
+  free(corpus->instructions);
+  corpus->instructions = 0;
+}
+
+int main(int argc, char *argv[]) {
+  char const *results_path = 0;
+  char const *baseline_path = 0;
+  char **inputs = (char **)malloc(argc * sizeof(char *));
+  uint32_t input_count = 0;
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    if (strcmp(argv[arg_idx], "--out") == 0 && arg_idx + 1 < argc) {
+      results_path = argv[++arg_idx];
+    } else if (strcmp(argv[arg_idx], "--baseline") == 0 &&
+               arg_idx + 1 < argc) {
+      baseline_path = argv[++arg_idx];
+    } else if (argv[arg_idx][0] == '-') {
+      input_count = 0;
+      break;
+    } else {
+      inputs[input_count++] = argv[arg_idx];
+    }
+  }
+
+  if (input_count == 0) {
+    printf("usage: bench [--out results.tsv] [--baseline results.tsv] "
+           "<assembled listing>...\n");
+    return -1;
+  }
+
+  BenchContext *context = (BenchContext *)calloc(1, sizeof(BenchContext));
+  InitDecoder(&context->decoder, Decoder_EmitData);
+  InitPerfCounters(&context->counters);
+#if _WIN32
+  context->null_file = fopen("NUL", "wb");
+#else
+  context->null_file = fopen("/dev/null", "wb");
+#endif
+  if (baseline_path && !LoadBaseline(context, baseline_path)) {
+    fprintf(stderr, "ERROR: Unable to open %s.\n", baseline_path);
+    return -1;
+  }
+  if (results_path) {
+    context->results = fopen(results_path, "wb");
+    if (!context->results) {
+      fprintf(stderr, "ERROR: Unable to create %s.\n", results_path);
+      return -1;
+    }
+    fputs(results_header, context->results);
+  }
+  if (!HasPerfCounters(&context->counters)) {
+    printf("Hardware counters unavailable, timing only.\n");
+  }
+
+  BenchCorpus listings;
+  if (!LoadListings(&listings, inputs, input_count)) {
+    return -1;
+  }
+  BenchCorpus generated;
+  MakeGeneratedCorpus(context, &generated);
+  BenchCorpus random;
+  MakeRandomCorpus(&random);
+
+  RunCorpus(context, &listings);
+  RunCorpus(context, &generated);
+  RunBench(context, "generate", BenchGenerate, &generated);
+  RunBench(context, "roundtrip", BenchRoundTrip, &generated);
+  RunCorpus(context, &random);
+
+  if (context->results) {
+    fclose(context->results);
+  }
+  DestroyPerfCounters(&context->counters);
+  return 0;
+}
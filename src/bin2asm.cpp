@@ -0,0 +1,70 @@
+#include "assert.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "decoder.h"
+#include "print.cpp"
+#include "platform_file.cpp"
+
+#include "instruction_file.cpp"
+
+// Converts an instruction file written by `main --binary` back to the text
+// disassembly, optionally only the records [first, first + count).
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    printf("usage: bin2asm file.bin [first_record [record_count]]\n");
+    return -1;
+  }
+
+  char *filename = argv[1];
+  MappedFile mapping = {};
+  if (!MapFile(filename, &mapping)) {
+    fprintf(stderr, "ERROR: Unable to open %s.\n", filename);
+    return -1;
+  }
+
+  InstructionFile file;
+  if (!OpenInstructionFile(mapping.data, mapping.size, &file)) {
+    fprintf(stderr, "ERROR: %s is not a version %d instruction file.\n",
+            filename, INSTRUCTION_FILE_VERSION);
+    UnmapFile(&mapping);
+    return -1;
+  }
+
+  uint64_t record_count = file.header->record_count;
+  uint64_t first = argc > 2 ? strtoull(argv[2], 0, 0) : 0;
+  uint64_t end = argc > 3 ? first + strtoull(argv[3], 0, 0) : record_count;
+  if (first > record_count) {
+    first = record_count;
+  }
+  if (end > record_count || end < first) {
+    end = record_count;
+  }
+
+  OutputBuffer out = CreateOutputBuffer(stdout);
+  if (first == 0) {
+    PrintHeader(&out, file.source_name);
+  }
+
+  int result = 0;
+  uint64_t address = first < end ? GetRecordAddress(&file, first) : 0;
+  for (uint64_t record_idx = first; record_idx < end; ++record_idx) {
+    Instruction instruction;
+    if (!UnpackInstruction(file.records[record_idx], address, &instruction)) {
+      FlushOutput(&out);
+      fprintf(stderr, "ERROR: record %llu of %s is corrupt.\n",
+              (unsigned long long)record_idx, filename);
+      result = -1;
+      break;
+    }
+    PrintInstruction(&out, instruction);
+    AppendChar(&out, '\n');
+    address += instruction.size;
+  }
+  DestroyOutputBuffer(&out);
+  UnmapFile(&mapping);
+
+  return result;
+}
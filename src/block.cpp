@@ -0,0 +1,299 @@
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Basic-block execution for the simulator.
+//
+// A block is the straight-line run of instructions starting at some ip and
+// ending with its first jump (jcc, loop, jcxz), the end of the program or
+// BLOCK_MAX_OPS operations. It is translated once into BlockOps: mov and
+// add/sub/cmp between 16-bit registers and immediates get their own handler
+// with the operands baked in, and an add/sub/cmp directly followed by a
+// jump becomes one fused operation. Everything else, memory operands and
+// 8-bit registers, runs through SimulateInstruction on the cached decode.
+//
+// Blocks are looked up by start address and run without going back to the
+// fetch loop. A store that modifies decoded code drops every block.
+
+#define BLOCK_MAX_OPS 64
+
+enum BlockOpKind {
+  BlockOp_Generic,
+  BlockOp_MovRegImm,
+  BlockOp_MovRegReg,
+  BlockOp_AluRegImm,
+  BlockOp_AluRegReg,
+  BlockOp_Jump,
+  BlockOp_AluRegImmJump,
+  BlockOp_AluRegRegJump,
+};
+
+struct BlockOp {
+  uint8_t kind;
+  // OpMnemonic of the mov/add/sub/cmp part.
+  uint8_t op;
+  // OpMnemonic of the jump part.
+  uint8_t jump_op;
+  uint8_t destination;
+  uint8_t source;
+  uint8_t instruction_count;
+  // Clocks of the instructions, and the extra clocks of a taken jump.
+  uint8_t clocks;
+  uint8_t taken_clocks;
+  uint16_t immediate;
+  // Address of the instruction for BlockOp_Generic, jump target otherwise.
+  uint16_t address;
+};
+
+struct Block {
+  uint32_t first_op;
+  uint32_t op_count;
+  uint16_t start;
+  // ip after the last instruction, where a block without a taken jump
+  // continues.
+  uint16_t end;
+};
+
+struct BlockCache {
+  // Block index + 1 by start address, 0 for none.
+  uint32_t *block_at;
+
+  Block *blocks;
+  uint32_t block_count;
+  uint32_t block_capacity;
+
+  BlockOp *ops;
+  uint32_t op_count;
+  uint32_t op_capacity;
+
+  uint64_t translation_count;
+};
+
+void InitBlockCache(BlockCache *cache) {
+  *cache = {};
+  cache->block_at =
+      (uint32_t *)calloc(SIMULATOR_MAX_CODE_SIZE, sizeof(uint32_t));
+}
+
+void DestroyBlockCache(BlockCache *cache) {
+  free(cache->block_at);
+  free(cache->blocks);
+  free(cache->ops);
+  *cache = {};
+}
+
+static void ClearBlockCache(BlockCache *cache) {
+  for (uint32_t block_idx = 0; block_idx < cache->block_count; ++block_idx) {
+    cache->block_at[cache->blocks[block_idx].start] = 0;
+  }
+  cache->block_count = 0;
+  cache->op_count = 0;
+}
+
+static bool IsJump(OpMnemonic op) { return op >= Op_je && op <= Op_jcxz; }
+
+static bool IsWordRegister(Operand operand) {
+  return operand.type == Operand_Register && operand.reg.size == 2;
+}
+
+static BlockOp TranslateInstruction(Instruction *instruction) {
+  BlockOp result = {};
+  result.kind = BlockOp_Generic;
+  result.op = (uint8_t)instruction->op;
+  result.instruction_count = 1;
+  result.clocks = instruction->clocks;
+  result.taken_clocks = instruction->taken_clocks;
+  result.address = (uint16_t)instruction->address;
+
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  if (IsJump(instruction->op)) {
+    result.kind = BlockOp_Jump;
+    result.jump_op = (uint8_t)instruction->op;
+    result.address = (uint16_t)(instruction->address + instruction->size +
+                                destination.immediate_s32);
+  } else if (IsWordRegister(destination)) {
+    bool is_mov = instruction->op == Op_mov;
+    result.destination = (uint8_t)destination.reg.name;
+    if (source.type == Operand_Immediate) {
+      result.kind = is_mov ? BlockOp_MovRegImm : BlockOp_AluRegImm;
+      result.immediate = (uint16_t)source.immediate_s32;
+    } else if (IsWordRegister(source)) {
+      result.kind = is_mov ? BlockOp_MovRegReg : BlockOp_AluRegReg;
+      result.source = (uint8_t)source.reg.name;
+    }
+  }
+
+  return result;
+}
+
+static BlockOp *AddBlockOp(BlockCache *cache) {
+  if (cache->op_count == cache->op_capacity) {
+    cache->op_capacity = cache->op_capacity ? 2 * cache->op_capacity : 4096;
+    cache->ops =
+        (BlockOp *)realloc(cache->ops, cache->op_capacity * sizeof(BlockOp));
+  }
+
+  return &cache->ops[cache->op_count++];
+}
+
+// Returns 0 if the instruction at `start` does not decode.
+static Block *TranslateBlock(Simulator *simulator, BlockCache *cache,
+                             Decoder const *decoder, uint16_t start) {
+  if (cache->block_count == cache->block_capacity) {
+    cache->block_capacity =
+        cache->block_capacity ? 2 * cache->block_capacity : 1024;
+    cache->blocks = (Block *)realloc(cache->blocks,
+                                     cache->block_capacity * sizeof(Block));
+  }
+
+  Block block = {};
+  block.first_op = cache->op_count;
+  block.start = start;
+  uint32_t address = start;
+  bool is_terminated = false;
+  while (!is_terminated && address < simulator->code_size &&
+         block.op_count < BLOCK_MAX_OPS) {
+    Instruction *instruction =
+        FetchInstruction(simulator, decoder, (uint16_t)address);
+    if (!instruction) {
+      break;
+    }
+    address += instruction->size;
+
+    BlockOp op = TranslateInstruction(instruction);
+    is_terminated = op.kind == BlockOp_Jump;
+
+    BlockOp *previous =
+        block.op_count ? &cache->ops[cache->op_count - 1] : 0;
+    if (is_terminated && previous &&
+        (previous->kind == BlockOp_AluRegImm ||
+         previous->kind == BlockOp_AluRegReg)) {
+      previous->kind = previous->kind == BlockOp_AluRegImm
+                           ? BlockOp_AluRegImmJump
+                           : BlockOp_AluRegRegJump;
+      previous->jump_op = op.jump_op;
+      previous->address = op.address;
+      previous->instruction_count = 2;
+      previous->clocks += op.clocks;
+      previous->taken_clocks = op.taken_clocks;
+    } else {
+      *AddBlockOp(cache) = op;
+      ++block.op_count;
+    }
+  }
+
+  if (!block.op_count) {
+    return 0;
+  }
+
+  block.end = (uint16_t)address;
+  ++cache->translation_count;
+  cache->blocks[cache->block_count] = block;
+  cache->block_at[start] = ++cache->block_count;
+  return &cache->blocks[cache->block_count - 1];
+}
+
+inline void SimulateAlu(Simulator *simulator, OpMnemonic op, uint8_t reg,
+                        uint32_t b) {
+  uint16_t *registers = simulator->registers;
+  uint32_t a = registers[reg];
+  uint32_t result = op == Op_add ? a + b : a - b;
+  SetArithmeticFlags(simulator, op, a, b, result, true);
+  if (op != Op_cmp) {
+    registers[reg] = (uint16_t)result;
+  }
+}
+
+// Same contract as RunSimulator. The instruction limit is checked between
+// blocks, so a run may go up to one block past it.
+SimulateStatus RunSimulatorBlocks(Simulator *simulator, BlockCache *cache,
+                                  Decoder const *decoder) {
+  uint16_t *registers = simulator->registers;
+  uint64_t limit = simulator->instruction_limit;
+  if (simulator->is_code_modified) {
+    // Code changed outside of block execution, e.g. by a snapshot restore.
+    simulator->is_code_modified = false;
+    ClearBlockCache(cache);
+  }
+  while (registers[Register_is] < simulator->code_size) {
+    if (limit && simulator->instruction_count >= limit) {
+      return Simulate_LimitReached;
+    }
+
+    uint16_t ip = registers[Register_is];
+    uint32_t block_idx = cache->block_at[ip];
+    Block *block = block_idx ? &cache->blocks[block_idx - 1]
+                             : TranslateBlock(simulator, cache, decoder, ip);
+    if (!block) {
+      return Simulate_UnknownInstruction;
+    }
+
+    uint16_t next_ip = block->end;
+    BlockOp *ops = cache->ops + block->first_op;
+    for (uint32_t op_idx = 0; op_idx < block->op_count; ++op_idx) {
+      BlockOp *op = &ops[op_idx];
+      simulator->instruction_count += op->instruction_count;
+      switch (op->kind) {
+      case BlockOp_Generic: {
+        // Counts its own clocks.
+        SimulateInstruction(simulator, simulator->decode_cache[op->address]);
+        if (simulator->is_code_modified) {
+          // The rest of this block may be stale: continue from the fetch
+          // loop with fresh translations.
+          simulator->is_code_modified = false;
+          ClearBlockCache(cache);
+          next_ip = registers[Register_is];
+          op_idx = block->op_count;
+        }
+      } break;
+      case BlockOp_MovRegImm: {
+        simulator->clocks += op->clocks;
+        registers[op->destination] = op->immediate;
+      } break;
+      case BlockOp_MovRegReg: {
+        simulator->clocks += op->clocks;
+        registers[op->destination] = registers[op->source];
+      } break;
+      case BlockOp_AluRegImm: {
+        simulator->clocks += op->clocks;
+        SimulateAlu(simulator, (OpMnemonic)op->op, op->destination,
+                    op->immediate);
+      } break;
+      case BlockOp_AluRegReg: {
+        simulator->clocks += op->clocks;
+        SimulateAlu(simulator, (OpMnemonic)op->op, op->destination,
+                    registers[op->source]);
+      } break;
+      case BlockOp_Jump: {
+        simulator->clocks += op->clocks;
+        if (IsJumpTaken(simulator, (OpMnemonic)op->jump_op)) {
+          next_ip = op->address;
+          simulator->clocks += op->taken_clocks;
+        }
+      } break;
+      case BlockOp_AluRegImmJump: {
+        simulator->clocks += op->clocks;
+        SimulateAlu(simulator, (OpMnemonic)op->op, op->destination,
+                    op->immediate);
+        if (IsJumpTaken(simulator, (OpMnemonic)op->jump_op)) {
+          next_ip = op->address;
+          simulator->clocks += op->taken_clocks;
+        }
+      } break;
+      case BlockOp_AluRegRegJump: {
+        simulator->clocks += op->clocks;
+        SimulateAlu(simulator, (OpMnemonic)op->op, op->destination,
+                    registers[op->source]);
+        if (IsJumpTaken(simulator, (OpMnemonic)op->jump_op)) {
+          next_ip = op->address;
+          simulator->clocks += op->taken_clocks;
+        }
+      } break;
+      }
+    }
+    registers[Register_is] = next_ip;
+  }
+
+  return Simulate_Halted;
+}
@@ -0,0 +1,200 @@
+#include "stdint.h"
+
+// Bus and prefetch queue timing, an opt-in alternative to the table clocks.
+//
+// The 8086 and 8088 split into an execution unit (EU) and a bus interface
+// unit (BIU). Whenever the bus is free and its prefetch queue has room, the
+// BIU fetches the next code bytes in 4 clock bus cycles: one byte per cycle
+// into a 4 byte queue on the 8088, an aligned word into a 6 byte queue on
+// the 8086. The EU takes its instruction bytes from the queue, waiting when
+// it is empty, and its memory transfers take bus cycles away from the
+// prefetcher. A taken jump flushes the queue.
+//
+// The table clocks assume the queue is always full and the 8086 bus. With
+// instructions that are short to execute but long to fetch, which is most
+// of them on the 8088, the fetch time is the real cost, so the model times
+// each instruction as:
+// - its first byte taken from the queue, then the EU clocks of the table
+//   less the bus cycles of its memory transfers, during which the rest of
+//   its bytes are taken from the queue;
+// - then each memory transfer as one bus cycle, two for a word on the 8088
+//   or a word at an odd address on the 8086, after any prefetch cycle in
+//   progress;
+// - for a taken jump, the queue flushed and refilled from the target. The
+//   taken clocks of the table include a first fetch at the target, which
+//   the model does itself.
+
+#define BUS_CYCLE_CLOCKS 4
+
+enum BusModelKind {
+  BusModel_8088,
+  BusModel_8086,
+};
+
+struct BusModel {
+  uint32_t queue_size;
+  // Bytes fetched by a bus cycle at an even address.
+  uint32_t fetch_width;
+
+  // Clock at which the last instruction ended.
+  uint64_t clock;
+  // Clock at which the bus cycle in progress ends, or the bus went idle.
+  uint64_t bus_free;
+  uint32_t queue_count;
+  // Bytes the prefetch cycle in progress adds to the queue at bus_free.
+  uint32_t pending_count;
+  // Address of the next byte to prefetch.
+  uint16_t prefetch_ip;
+
+  // Clocks the EU spent waiting for code bytes.
+  uint64_t wait_clocks;
+  uint64_t flush_count;
+};
+
+// Starts with an empty queue, prefetching from `ip`.
+void InitBusModel(BusModel *model, BusModelKind kind, uint16_t ip) {
+  *model = {};
+  model->queue_size = kind == BusModel_8088 ? 4 : 6;
+  model->fetch_width = kind == BusModel_8088 ? 1 : 2;
+  model->prefetch_ip = ip;
+}
+
+// Runs the prefetcher up to `clock`, one bus cycle at a time.
+static void AdvanceBus(BusModel *model, uint64_t clock) {
+  for (;;) {
+    if (model->pending_count && model->bus_free <= clock) {
+      model->queue_count += model->pending_count;
+      model->pending_count = 0;
+    }
+    if (model->pending_count || model->bus_free > clock) {
+      break;
+    }
+
+    uint32_t width = (model->prefetch_ip & 1) ? 1 : model->fetch_width;
+    if (model->queue_count + width > model->queue_size) {
+      break;
+    }
+    model->pending_count = width;
+    model->prefetch_ip = (uint16_t)(model->prefetch_ip + width);
+    model->bus_free += BUS_CYCLE_CLOCKS;
+  }
+}
+
+// Takes one code byte from the queue no earlier than `clock`. Returns the
+// clock it was available at.
+static uint64_t TakeQueueByte(BusModel *model, uint64_t clock) {
+  AdvanceBus(model, clock);
+  while (!model->queue_count) {
+    clock = model->bus_free > clock ? model->bus_free : clock;
+    AdvanceBus(model, clock);
+  }
+  --model->queue_count;
+
+  // An idle prefetcher starts again as soon as there is room.
+  if (!model->pending_count && model->bus_free < clock) {
+    model->bus_free = clock;
+  }
+  return clock;
+}
+
+// Runs `cycle_count` EU bus cycles no earlier than `clock`, after the
+// prefetch cycle in progress. Returns the clock they end at.
+static uint64_t RunTransfer(BusModel *model, uint64_t clock,
+                            uint32_t cycle_count) {
+  AdvanceBus(model, clock);
+  if (model->bus_free > clock) {
+    clock = model->bus_free;
+    AdvanceBus(model, clock);
+  }
+  model->bus_free = clock + cycle_count * BUS_CYCLE_CLOCKS;
+  return model->bus_free;
+}
+
+// Times one executed instruction. `is_odd_address` is whether its memory
+// operand was at an odd offset, `is_taken` whether it jumped to `next_ip`.
+// Returns its clocks.
+uint32_t TimeInstruction(BusModel *model, Instruction const *instruction,
+                         bool is_odd_address, bool is_taken,
+                         uint16_t next_ip) {
+  uint64_t start = model->clock;
+  uint32_t bus_clocks = instruction->transfer_count * BUS_CYCLE_CLOCKS;
+  uint32_t eu_clocks = instruction->clocks - bus_clocks;
+
+  // Waiting for the first byte counts too, not only for the ones after it.
+  uint64_t clock = TakeQueueByte(model, start);
+  model->wait_clocks += clock - start;
+  uint64_t eu_end = clock + eu_clocks;
+  for (uint32_t byte_idx = 1; byte_idx < instruction->size; ++byte_idx) {
+    clock = TakeQueueByte(model, clock);
+  }
+  model->wait_clocks += clock > eu_end ? clock - eu_end : 0;
+  clock = clock > eu_end ? clock : eu_end;
+
+  bool is_wide = instruction->flags & Inst_Wide;
+  bool is_split = is_wide && (model->fetch_width == 1 || is_odd_address);
+  for (uint32_t transfer_idx = 0; transfer_idx < instruction->transfer_count;
+       ++transfer_idx) {
+    clock = RunTransfer(model, clock, is_split ? 2 : 1);
+  }
+
+  if (is_taken) {
+    clock += instruction->taken_clocks - BUS_CYCLE_CLOCKS;
+    // The cycle in progress still holds the bus, but its bytes are
+    // dropped.
+    model->queue_count = 0;
+    model->pending_count = 0;
+    model->prefetch_ip = next_ip;
+    if (model->bus_free < clock) {
+      model->bus_free = clock;
+    }
+    ++model->flush_count;
+  }
+
+  model->clock = clock;
+  return (uint32_t)(clock - start);
+}
+
+// Same contract as RunSimulator, timing each instruction with `model`.
+// With `trace`, each executed instruction is written there with its clocks.
+SimulateStatus RunSimulatorTimed(Simulator *simulator, BusModel *model,
+                                 Decoder const *decoder, OutputBuffer *trace) {
+  uint16_t *ip = &simulator->registers[Register_is];
+  uint64_t limit = simulator->instruction_limit;
+  while (*ip < simulator->code_size) {
+    if (limit && simulator->instruction_count >= limit) {
+      return Simulate_LimitReached;
+    }
+
+    Instruction *instruction = FetchInstruction(simulator, decoder, *ip);
+    if (!instruction) {
+      return Simulate_UnknownInstruction;
+    }
+
+    // Before executing, as for the table clocks.
+    bool is_odd_address = false;
+    if (instruction->transfer_count) {
+      Operand *operands = instruction->operands;
+      Operand memory =
+          operands[0].type == Operand_Memory ? operands[0] : operands[1];
+      is_odd_address =
+          GetEffectiveAddress(simulator, memory.address).offset & 1;
+    }
+
+    bool is_taken = SimulateInstruction(simulator, *instruction);
+    ++simulator->instruction_count;
+
+    uint32_t clocks =
+        TimeInstruction(model, instruction, is_odd_address, is_taken, *ip);
+    if (trace) {
+      PrintInstruction(trace, *instruction);
+      ReserveOutput(trace);
+      AppendString(trace, " ; Clocks: +");
+      AppendU32(trace, clocks);
+      AppendString(trace, " = ");
+      AppendU64(trace, model->clock);
+      AppendChar(trace, '\n');
+    }
+  }
+
+  return Simulate_Halted;
+}
@@ -0,0 +1,361 @@
+#include "stdint.h"
+#include "stdlib.h"
+
+#if _MSC_VER
+#include <intrin.h>
+#endif
+
+// Control flow graph of a decoded image, and disassembly with labels.
+//
+// Every jump (jcc, loop, jcxz) is relative, so its target is known from the
+// decode alone. Targets that land on an instruction start get a label,
+// numbered in address order, and start a basic block, as does the
+// instruction after each jump. A block ends before the next block start,
+// which makes its last instruction either a jump, with a taken edge to the
+// target block and a fall-through edge, or a plain instruction falling
+// through. Targets in the middle of an instruction or outside the image are
+// left unresolved and keep their $ offset.
+//
+// Everything is in flat arrays: blocks in address order, and successor and
+// predecessor edges grouped by block, each block's run starting where the
+// block says and ending where the next one starts. Predecessors are sorted
+// from the successors by counting. Targets are a bitmap over the image with
+// the count of set bits before each word, so the label of an address is a
+// lookup plus a popcount. The whole build is linear in the instruction
+// count plus the image size / 64.
+
+#define CFG_NO_LABEL 0xffffffff
+
+enum CfgEdgeKind {
+  CfgEdge_Taken,
+  CfgEdge_FallThrough,
+};
+
+struct CfgEdge {
+  // Target block of a successor edge, source block of a predecessor edge.
+  uint32_t block;
+  uint32_t kind;
+};
+
+// The instructions, successors and predecessors of block b run up to the
+// first ones of block b + 1. A sentinel block after the last one holds the
+// totals.
+struct CfgBlock {
+  uint64_t start;
+  uint32_t first_instruction;
+  // CFG_NO_LABEL if no jump targets the block.
+  uint32_t label;
+  uint32_t first_successor;
+  uint32_t first_predecessor;
+};
+
+// Indexes are 32-bit: an image has at most 4G instructions.
+struct ControlFlowGraph {
+  Instruction const *instructions;
+  uint32_t instruction_count;
+  uint64_t image_size;
+
+  CfgBlock *blocks;
+  uint32_t block_count;
+  CfgEdge *successors;
+  CfgEdge *predecessors;
+  uint32_t edge_count;
+
+  // Block of each label.
+  uint32_t *label_blocks;
+  uint32_t label_count;
+  // Jumps whose target is not an instruction start in the image.
+  uint64_t unresolved_count;
+
+  // One bit per image byte, set at the labeled addresses, and the number of
+  // labels before each word.
+  uint64_t *target_bits;
+  uint32_t *target_ranks;
+};
+
+inline uint32_t CountBits(uint64_t value) {
+#if _MSC_VER
+  return (uint32_t)__popcnt64(value);
+#else
+  return (uint32_t)__builtin_popcountll(value);
+#endif
+}
+
+static bool IsRelativeJump(Instruction const *instruction) {
+  return instruction->operands[0].type == Operand_RelativeImmediate;
+}
+
+// Relative to the end of the jump. May be outside the image.
+static int64_t GetJumpTarget(Instruction const *instruction) {
+  return (int64_t)instruction->address + instruction->size +
+         instruction->operands[0].immediate_s32;
+}
+
+// Addresses outside the image map to image_size, whose bit is never set.
+static uint64_t ClampToImage(ControlFlowGraph const *cfg, int64_t address) {
+  return (uint64_t)address < cfg->image_size ? (uint64_t)address
+                                             : cfg->image_size;
+}
+
+// Label at `address`, CFG_NO_LABEL if none.
+uint32_t GetLabel(ControlFlowGraph const *cfg, int64_t address) {
+  uint64_t index = ClampToImage(cfg, address);
+  uint64_t word = cfg->target_bits[index / 64];
+  uint64_t bit = 1ull << (index % 64);
+  uint32_t label = cfg->target_ranks[index / 64] + CountBits(word & (bit - 1));
+  return (word & bit) ? label : CFG_NO_LABEL;
+}
+
+// Block holding the instruction at or before `address`, by binary search.
+// Returns block_count if `address` is before the first block.
+uint32_t FindBlock(ControlFlowGraph const *cfg, uint64_t address) {
+  uint32_t low = 0;
+  uint32_t high = cfg->block_count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (cfg->blocks[middle].start <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low ? low - 1 : cfg->block_count;
+}
+
+// Marks the targets that are instruction starts and numbers them.
+static void FindLabels(ControlFlowGraph *cfg) {
+  uint64_t word_count = cfg->image_size / 64 + 1;
+  uint64_t *starts = (uint64_t *)calloc(word_count, sizeof(uint64_t));
+  uint64_t *targets = (uint64_t *)calloc(word_count, sizeof(uint64_t));
+  for (uint32_t instruction_idx = 0; instruction_idx < cfg->instruction_count;
+       ++instruction_idx) {
+    Instruction const *instruction = &cfg->instructions[instruction_idx];
+    uint64_t address = instruction->address;
+    starts[address / 64] |= 1ull << (address % 64);
+    // Not a branch: jumps are too frequent and irregular to predict.
+    uint64_t target = ClampToImage(cfg, GetJumpTarget(instruction));
+    uint64_t is_jump = IsRelativeJump(instruction);
+    targets[target / 64] |= is_jump << (target % 64);
+  }
+
+  cfg->target_ranks = (uint32_t *)malloc(word_count * sizeof(uint32_t));
+  uint32_t label_count = 0;
+  for (uint64_t word_idx = 0; word_idx < word_count; ++word_idx) {
+    targets[word_idx] &= starts[word_idx];
+    cfg->target_ranks[word_idx] = label_count;
+    label_count += CountBits(targets[word_idx]);
+  }
+  free(starts);
+
+  cfg->target_bits = targets;
+  cfg->label_count = label_count;
+}
+
+// Splits the instructions into blocks and adds their successor edges, the
+// taken ones with the target label in place of the block, which may come
+// later.
+static void FindBlocks(ControlFlowGraph *cfg) {
+  // At most a block per instruction, plus the sentinel, and a taken and a
+  // fall-through edge per block. Only the pages written to are ever touched.
+  uint32_t instruction_count = cfg->instruction_count;
+  CfgBlock *blocks =
+      (CfgBlock *)malloc((instruction_count + 1) * sizeof(CfgBlock));
+  CfgEdge *successors =
+      (CfgEdge *)malloc(2 * (uint64_t)instruction_count * sizeof(CfgEdge));
+  uint32_t *label_blocks =
+      (uint32_t *)malloc(cfg->label_count * sizeof(uint32_t));
+
+  uint32_t block_count = 0;
+  uint32_t edge_count = 0;
+  uint64_t unresolved_count = 0;
+  uint32_t label_count = 0;
+  bool is_open = false;
+  for (uint32_t instruction_idx = 0; instruction_idx < instruction_count;
+       ++instruction_idx) {
+    Instruction const *instruction = &cfg->instructions[instruction_idx];
+    uint64_t address = instruction->address;
+    // Labels are numbered in address order, the order they come up in.
+    bool is_labeled = (cfg->target_bits[address / 64] >> (address % 64)) & 1;
+    if (!is_open || is_labeled) {
+      // A label splits the open block, which falls through into it.
+      if (is_open) {
+        successors[edge_count++] = {block_count, CfgEdge_FallThrough};
+      }
+      CfgBlock *block = &blocks[block_count];
+      block->start = address;
+      block->first_instruction = instruction_idx;
+      block->label = is_labeled ? label_count : CFG_NO_LABEL;
+      block->first_successor = edge_count;
+      if (is_labeled) {
+        label_blocks[label_count++] = block_count;
+      }
+      ++block_count;
+      is_open = true;
+    }
+
+    // Every jump is conditional, so it ends its block with a taken edge and
+    // a fall-through edge to the next one, if any.
+    if (IsRelativeJump(instruction)) {
+      uint32_t target = GetLabel(cfg, GetJumpTarget(instruction));
+      if (target != CFG_NO_LABEL) {
+        successors[edge_count++] = {target, CfgEdge_Taken};
+      } else {
+        ++unresolved_count;
+      }
+      if (instruction_idx + 1 < instruction_count) {
+        successors[edge_count++] = {block_count, CfgEdge_FallThrough};
+      }
+      is_open = false;
+    }
+  }
+
+  cfg->blocks = blocks;
+  cfg->block_count = block_count;
+  cfg->successors = successors;
+  cfg->edge_count = edge_count;
+  cfg->label_blocks = label_blocks;
+  cfg->unresolved_count = unresolved_count;
+
+  CfgBlock *sentinel = &cfg->blocks[cfg->block_count];
+  *sentinel = {};
+  if (instruction_count) {
+    Instruction const *last = &cfg->instructions[instruction_count - 1];
+    sentinel->start = last->address + last->size;
+  }
+  sentinel->first_instruction = instruction_count;
+  sentinel->label = CFG_NO_LABEL;
+  sentinel->first_successor = cfg->edge_count;
+  sentinel->first_predecessor = cfg->edge_count;
+}
+
+// Resolves the taken edges to blocks and sorts the edges by target block
+// into the predecessors, a counting sort.
+static void FindPredecessors(ControlFlowGraph *cfg) {
+  CfgBlock *blocks = cfg->blocks;
+  CfgEdge *successors = cfg->successors;
+  uint32_t *cursors = (uint32_t *)calloc(cfg->block_count, sizeof(uint32_t));
+  for (uint32_t edge_idx = 0; edge_idx < cfg->edge_count; ++edge_idx) {
+    CfgEdge *edge = &successors[edge_idx];
+    if (edge->kind == CfgEdge_Taken) {
+      edge->block = cfg->label_blocks[edge->block];
+    }
+    ++cursors[edge->block];
+  }
+
+  uint32_t first_predecessor = 0;
+  for (uint32_t block_idx = 0; block_idx < cfg->block_count; ++block_idx) {
+    uint32_t count = cursors[block_idx];
+    blocks[block_idx].first_predecessor = first_predecessor;
+    cursors[block_idx] = first_predecessor;
+    first_predecessor += count;
+  }
+
+  cfg->predecessors = (CfgEdge *)malloc(cfg->edge_count * sizeof(CfgEdge));
+  for (uint32_t block_idx = 0; block_idx < cfg->block_count; ++block_idx) {
+    for (uint32_t edge_idx = blocks[block_idx].first_successor;
+         edge_idx < blocks[block_idx + 1].first_successor; ++edge_idx) {
+      CfgEdge edge = successors[edge_idx];
+      cfg->predecessors[cursors[edge.block]++] = {block_idx, edge.kind};
+    }
+  }
+  free(cursors);
+}
+
+// `instructions` are consecutive, in address order, and must outlive the
+// graph.
+void BuildControlFlowGraph(ControlFlowGraph *cfg,
+                           Instruction const *instructions,
+                           uint64_t instruction_count, uint64_t image_size) {
+  *cfg = {};
+  cfg->instructions = instructions;
+  cfg->instruction_count = (uint32_t)instruction_count;
+  cfg->image_size = image_size;
+
+  FindLabels(cfg);
+  FindBlocks(cfg);
+  FindPredecessors(cfg);
+}
+
+void DestroyControlFlowGraph(ControlFlowGraph *cfg) {
+  free(cfg->blocks);
+  free(cfg->successors);
+  free(cfg->predecessors);
+  free(cfg->label_blocks);
+  free(cfg->target_bits);
+  free(cfg->target_ranks);
+  *cfg = {};
+}
+
+// Decodes a whole image into a growing array, which the caller frees. Same
+// contract as DisassembleImage for the return value and error_address; the
+// instructions before the error are kept.
+bool DecodeImage(Decoder const *decoder, uint8_t const *image,
+                 uint64_t image_size, Instruction **instructions,
+                 uint64_t *instruction_count, uint64_t *error_address) {
+  uint64_t capacity = image_size / 2 + DISASSEMBLE_BATCH_SIZE;
+  Instruction *result = (Instruction *)malloc(capacity * sizeof(Instruction));
+  uint64_t count = 0;
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < image_size) {
+    if (capacity - count < DISASSEMBLE_BATCH_SIZE) {
+      capacity *= 2;
+      result =
+          (Instruction *)realloc(result, capacity * sizeof(Instruction));
+    }
+
+    uint32_t batch_count;
+    uint64_t consumed;
+    status = DecodeInstructions(decoder, image + address, image_size - address,
+                                address, result + count,
+                                DISASSEMBLE_BATCH_SIZE, &batch_count,
+                                &consumed);
+    count += batch_count;
+    address += consumed;
+  }
+
+  *instructions = result;
+  *instruction_count = count;
+  *error_address = address;
+  return status == Decode_Ok;
+}
+
+static void PrintLabel(OutputBuffer *out, uint32_t label) {
+  AppendString(out, "label_");
+  AppendU32(out, label);
+}
+
+// Disassembles the graph's instructions with a label line before each
+// labeled block and resolved jumps printed as their target label. With
+// total_clocks, as DisassembleImage.
+void PrintLabeledInstructions(ControlFlowGraph const *cfg, OutputBuffer *out,
+                              uint64_t *total_clocks = 0) {
+  for (uint32_t block_idx = 0; block_idx < cfg->block_count; ++block_idx) {
+    CfgBlock const *block = &cfg->blocks[block_idx];
+    if (block->label != CFG_NO_LABEL) {
+      ReserveOutput(out);
+      PrintLabel(out, block->label);
+      AppendString(out, ":\n");
+    }
+
+    for (uint32_t instruction_idx = block->first_instruction;
+         instruction_idx < block[1].first_instruction; ++instruction_idx) {
+      Instruction const *instruction = &cfg->instructions[instruction_idx];
+      uint32_t label = IsRelativeJump(instruction)
+                           ? GetLabel(cfg, GetJumpTarget(instruction))
+                           : CFG_NO_LABEL;
+      if (label != CFG_NO_LABEL) {
+        ReserveOutput(out);
+        AppendString(out, GetMnemonicName(instruction->op));
+        AppendChar(out, ' ');
+        PrintLabel(out, label);
+      } else {
+        PrintInstruction(out, *instruction);
+      }
+      if (total_clocks) {
+        PrintClocks(out, *instruction, total_clocks);
+      }
+      AppendChar(out, '\n');
+    }
+  }
+}
@@ -1,23 +1,8 @@
 #include "assert.h"
 #include "stdint.h"
-#include "stdio.h"
-#include "stdlib.h"
 #include "string.h"
 
-#include "opcode.h"
-
-// https://stackoverflow.com/a/3208376
-#define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
-#define BYTE_TO_BINARY(byte)                                                   \
-  ((byte) & 0x80 ? '1' : '0'), ((byte) & 0x40 ? '1' : '0'),                    \
-      ((byte) & 0x20 ? '1' : '0'), ((byte) & 0x10 ? '1' : '0'),                \
-      ((byte) & 0x08 ? '1' : '0'), ((byte) & 0x04 ? '1' : '0'),                \
-      ((byte) & 0x02 ? '1' : '0'), ((byte) & 0x01 ? '1' : '0')
-
-#define INSTRUCTION_NOT_IMPLEMENTED()                                          \
-  printf("\n" BYTE_TO_BINARY_PATTERN, BYTE_TO_BINARY(instruction));            \
-  printf(" - INSTRUCTION NOT IMPLEMENTED\n");                                  \
-  exit(-1);
+#include "decoder.h"
 
 #define BIT_MASK(bits) (~(0xff << bits))
 #define BIT_SHIFT(byte, bits) (byte >> bits)
@@ -29,6 +14,7 @@
 #define MOD {Bit_Mod, 2}
 #define REG {Bit_Reg, 3}
 #define RM {Bit_RM, 3}
+#define SR {Bit_SR, 2}
 #define DATA {Bit_Data, 0}
 #define DISP {Bit_Displacement, 0}
 #define ADDR {Bit_Address, 0}
@@ -47,24 +33,29 @@
 #define IMP_S(value) {Bit_Signed, 0, value}
 #define IMP_D(value) {Bit_Destination, 0, value}
 
-InstructionEncoding instructions[] = {
+static InstructionEncoding const instructions[] = {
     {Op_mov, {BITS(100010), D, W, MOD, REG, RM, DISP}},
     {Op_mov, {BITS(1100011), W, MOD, BITS(000), RM, DISP, DATA}},
-    {Op_mov, {BITS(1011), W, REG, DATA}},
+    {Op_mov, {BITS(1011), W, REG, DATA, IMP_D(1)}},
+    {Op_mov,
+     {BITS(1010000), W, ADDR, IMP_MOD(0b00), IMP_REG(0b000), IMP_RM(0b110),
+      IMP_D(1)}},
     {Op_mov,
-     {BITS(101000), D, W, ADDR, IMP_MOD(0b00), IMP_REG(0b000), IMP_RM(0b110)}},
+     {BITS(1010001), W, ADDR, IMP_MOD(0b00), IMP_REG(0b000), IMP_RM(0b110),
+      IMP_D(0)}},
+    {Op_mov, {BITS(100011), D, BITS(0), MOD, BITS(0), SR, RM, DISP, IMP_W(1)}},
 
     {Op_add, {BITS(000000), D, W, MOD, REG, RM, DISP}},
     {Op_add, {BITS(100000), S, W, MOD, BITS(000), RM, DISP, DATA}},
-    {Op_add, {BITS(0000010), DATA, IMP_D(1), IMP_REG(0b000)}},
+    {Op_add, {BITS(0000010), W, DATA, IMP_D(1), IMP_REG(0b000)}},
 
     {Op_sub, {BITS(001010), D, W, MOD, REG, RM, DISP}},
     {Op_sub, {BITS(100000), S, W, MOD, BITS(101), RM, DISP, DATA}},
-    {Op_sub, {BITS(0010110), DATA, IMP_D(1), IMP_REG(0b000)}},
+    {Op_sub, {BITS(0010110), W, DATA, IMP_D(1), IMP_REG(0b000)}},
 
     {Op_cmp, {BITS(001110), D, W, MOD, REG, RM, DISP}},
     {Op_cmp, {BITS(100000), S, W, MOD, BITS(111), RM, DISP, DATA}},
-    {Op_cmp, {BITS(0011110), DATA, IMP_D(1), IMP_REG(0b000)}},
+    {Op_cmp, {BITS(0011110), W, DATA, IMP_D(1), IMP_REG(0b000)}},
 
     {Op_je, {BITS(01110100), FLAG(Bit_RelativeJmpAddress)}},
     {Op_jl, {BITS(01111100), FLAG(Bit_RelativeJmpAddress)}},
@@ -88,25 +79,40 @@ InstructionEncoding instructions[] = {
     {Op_jcxz, {BITS(11100011), FLAG(Bit_RelativeJmpAddress)}},
 };
 
+// Decoder_CollapseDataRuns bounds.
+#define DATA_RUN_MIN_SIZE 8
+#define DATA_RUN_MAX_SIZE 0xffff
+
+// base points at the instruction being decoded and address is the position of
+// base in the image, so base can be moved to a copy of the bytes without
+// changing the decoded addresses.
 struct MemoryAccess {
-  uint8_t *base;
-  uint8_t offset;
+  uint8_t const *base;
+  uint64_t offset;
+  uint64_t address;
 };
 
-uint8_t *GetAddress(uint8_t *base, uint8_t offset,
-                    uint8_t additional_offset = 0) {
+static uint8_t const *GetAddress(uint8_t const *base, uint64_t offset,
+                                 uint64_t additional_offset = 0) {
   return base + offset + additional_offset;
 }
 
-uint8_t *GetAddress(MemoryAccess memory_idx, uint8_t additional_offset = 0) {
+static uint8_t const *GetAddress(MemoryAccess memory_idx,
+                                 uint64_t additional_offset = 0) {
   return GetAddress(memory_idx.base, memory_idx.offset, additional_offset);
 }
 
-uint8_t ReadMemory(MemoryAccess memory_idx, uint8_t additional_offset = 0) {
+static uint8_t ReadMemory(MemoryAccess memory_idx,
+                          uint64_t additional_offset = 0) {
   return *GetAddress(memory_idx, additional_offset);
 }
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(0 [array]))
+// Moves base past the bytes consumed so far.
+static void AdvanceMemory(MemoryAccess *memory_idx) {
+  memory_idx->base += memory_idx->offset;
+  memory_idx->address += memory_idx->offset;
+  memory_idx->offset = 0;
+}
 
 static uint16_t ParseValue(MemoryAccess *memory_idx, bool is_wide,
                            bool is_signed_extended) {
@@ -125,23 +131,158 @@ static uint16_t ParseValue(MemoryAccess *memory_idx, bool is_wide,
     ++memory_idx->offset;
 
     if (is_signed_extended) {
-      result |= (result & 0b10000000) << 8;
+      result = (uint16_t)(int16_t)(int8_t)result;
     }
   }
 
   return result;
 }
 
-Instruction TryParse(InstructionEncoding instruction, MemoryAccess memory_idx) {
+static RegisterInfo ParseRegister(uint8_t register_idx, bool is_wide) {
+  static RegisterInfo const register_table[][2] = {
+      {{Register_a, 1, 0}, {Register_a, 2, 0}},
+      {{Register_c, 1, 0}, {Register_c, 2, 0}},
+      {{Register_d, 1, 0}, {Register_d, 2, 0}},
+      {{Register_b, 1, 0}, {Register_b, 2, 0}},
+      {{Register_a, 1, 1}, {Register_sp, 2, 0}},
+      {{Register_c, 1, 1}, {Register_bp, 2, 0}},
+      {{Register_d, 1, 1}, {Register_si, 2, 0}},
+      {{Register_b, 1, 1}, {Register_di, 2, 0}},
+  };
+
+  uint8_t register_mask = 0x7;
+  return register_table[register_idx & register_mask][is_wide];
+}
+
+static EffectiveAddressBase ParseEffectiveAddressBase(uint8_t rm) {
+  static EffectiveAddressBase const base_table[] = {
+      EffectiveAddress_bx_si, EffectiveAddress_bx_di, EffectiveAddress_bp_si,
+      EffectiveAddress_bp_di, EffectiveAddress_si,    EffectiveAddress_di,
+      EffectiveAddress_bp,    EffectiveAddress_bx,
+  };
+
+  uint8_t rm_mask = 0x7;
+  return base_table[rm & rm_mask];
+}
+
+// 8086 clocks to compute an effective address.
+static uint8_t GetEffectiveAddressClocks(EffectiveAddressBase base,
+                                         bool has_displacement) {
+  static uint8_t const base_clocks[] = {
+      7, 8, 8, 7, 5, 5, 5, 5, 6,
+  };
+
+  uint8_t result = base_clocks[base];
+  if (has_displacement && base != EffectiveAddress_direct) {
+    result += 4;
+  }
+  return result;
+}
+
+// `has_displacement` is whether the memory operand was encoded with one,
+// `is_accumulator_form` whether a mov used the short accumulator encoding.
+static void SetClocks(Instruction *instruction, bool has_displacement,
+                      bool is_accumulator_form) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  bool is_memory_destination = destination.type == Operand_Memory;
+  bool is_memory_source = source.type == Operand_Memory;
+  bool is_immediate_source = source.type == Operand_Immediate;
+
+  uint8_t clocks = 0;
+  uint8_t taken_clocks = 0;
+  uint8_t transfer_count = 0;
+  switch (instruction->op) {
+  case Op_mov: {
+    if (is_accumulator_form) {
+      clocks = 10;
+    } else if (is_memory_destination) {
+      clocks = is_immediate_source ? 10 : 9;
+    } else if (is_memory_source) {
+      clocks = 8;
+    } else {
+      clocks = is_immediate_source ? 4 : 2;
+    }
+    transfer_count = is_memory_destination || is_memory_source;
+  } break;
+  case Op_add:
+  case Op_sub:
+  case Op_cmp: {
+    // add and sub read and write back a memory destination, cmp only reads
+    // it.
+    bool is_compare = instruction->op == Op_cmp;
+    if (is_memory_destination) {
+      clocks = is_immediate_source ? 17 : 16;
+      transfer_count = 2;
+      if (is_compare) {
+        clocks = is_immediate_source ? 10 : 9;
+        transfer_count = 1;
+      }
+    } else if (is_memory_source) {
+      clocks = 9;
+      transfer_count = 1;
+    } else {
+      clocks = is_immediate_source ? 4 : 3;
+    }
+  } break;
+  case Op_loop: {
+    clocks = 5;
+    taken_clocks = 12;
+  } break;
+  case Op_loopz:
+  case Op_jcxz: {
+    clocks = 6;
+    taken_clocks = 12;
+  } break;
+  case Op_loopnz: {
+    clocks = 5;
+    taken_clocks = 14;
+  } break;
+  default: {
+    if (instruction->op >= Op_je && instruction->op <= Op_jcxz) {
+      clocks = 4;
+      taken_clocks = 12;
+    }
+  } break;
+  }
+
+  uint8_t ea_clocks = 0;
+  if (!is_accumulator_form && (is_memory_destination || is_memory_source)) {
+    Operand memory = is_memory_destination ? destination : source;
+    ea_clocks =
+        GetEffectiveAddressClocks(memory.address.base, has_displacement);
+  }
+
+  instruction->clocks = clocks + ea_clocks;
+  instruction->ea_clocks = ea_clocks;
+  instruction->taken_clocks = taken_clocks;
+  instruction->transfer_count = transfer_count;
+}
+
+void EstimateClocks(Instruction *instruction) {
+  Operand destination = instruction->operands[0];
+  Operand source = instruction->operands[1];
+  Operand memory = destination.type == Operand_Memory ? destination : source;
+
+  // A mov with a memory operand and no ModRM byte is the accumulator form.
+  bool is_accumulator_form = instruction->op == Op_mov &&
+                             memory.type == Operand_Memory &&
+                             (instruction->flags & Inst_ShortForm);
+  SetClocks(instruction, memory.address.has_displacement,
+            is_accumulator_form);
+}
+
+static Instruction TryParse(InstructionEncoding const *instruction,
+                            MemoryAccess memory_idx) {
   bool valid = true;
-  uint32_t bits[Bit_Count];
-  uint32_t has_bits;
+  uint32_t bits[Bit_Count] = {};
+  uint32_t has_bits = 0;
 
   uint8_t remaining_bits = 0;
   uint8_t read_byte = 0;
-  for (uint32_t bit_idx = 0; valid && bit_idx < ARRAY_SIZE(instruction.bits);
+  for (uint32_t bit_idx = 0; valid && bit_idx < ARRAY_SIZE(instruction->bits);
        ++bit_idx) {
-    InstructionBit test_bits = instruction.bits[bit_idx];
+    InstructionBit test_bits = instruction->bits[bit_idx];
 
     uint8_t read_bits = test_bits.value;
     if (test_bits.size != 0) {
@@ -165,46 +306,106 @@ Instruction TryParse(InstructionEncoding instruction, MemoryAccess memory_idx) {
 
   Instruction result = {};
   if (valid) {
-    result.op = instruction.op;
-    result.address = (uint32_t)memory_idx.base;
-    result.size = memory_idx.offset;
-
     uint32_t mod = bits[Bit_Mod];
+    uint32_t reg = bits[Bit_Reg];
     uint32_t rm = bits[Bit_RM];
     uint32_t w = bits[Bit_Wide];
     uint32_t s = bits[Bit_Signed];
     uint32_t d = bits[Bit_Destination];
 
-    bool has_direct_address = (mod == 0b00) && (rm == 0b110);
-    bool has_displacement =
-        has_direct_address || mod == 0b01 || mod == 0b10 || bits[Bit_Address];
-    bool has_data = bits[Bit_Data];
+    bool has_mod = has_bits & (1 << Bit_Mod);
+    bool has_address = has_bits & (1 << Bit_Address);
+    bool has_direct_address = has_mod && (mod == 0b00) && (rm == 0b110);
+    bool has_displacement = has_direct_address || has_address ||
+                            (has_mod && (mod == 0b01 || mod == 0b10));
+    bool has_data = has_bits & (1 << Bit_Data);
+    bool has_relative_jump = has_bits & (1 << Bit_RelativeJmpAddress);
     bool is_displacement_wide =
-        has_direct_address || mod == 0b10 || bits[Bit_Address];
+        has_direct_address || has_address || (has_mod && mod == 0b10);
     bool is_data_wide = w && !s;
 
     if (has_displacement) {
       bits[Bit_Displacement] |=
           ParseValue(&memory_idx, is_displacement_wide, !is_displacement_wide);
     }
-    if (bits[Bit_Data]) {
-      ParseValue(&memory_idx, is_data_wide, s);
+    if (has_data) {
+      bits[Bit_Data] = ParseValue(&memory_idx, is_data_wide, s);
+    }
+    if (has_relative_jump) {
+      bits[Bit_RelativeJmpAddress] = ParseValue(&memory_idx, false, true);
+    }
+
+    result.op = instruction->op;
+    result.address = memory_idx.address;
+    result.size = (uint32_t)memory_idx.offset;
+    if (w) {
+      result.flags |= Inst_Wide;
+    }
+    if (d) {
+      result.flags |= Inst_Destination;
+    }
+    if (s) {
+      result.flags |= Inst_Signed;
+    }
+    if (!has_mod || has_address) {
+      result.flags |= Inst_ShortForm;
+    }
+
+    Operand *reg_operand = &result.operands[d ? 0 : 1];
+    Operand *mod_operand = &result.operands[d ? 1 : 0];
+
+    if (has_bits & (1 << Bit_Reg)) {
+      reg_operand->type = Operand_Register;
+      reg_operand->reg = ParseRegister(reg, w);
+    }
+    if (has_bits & (1 << Bit_SR)) {
+      reg_operand->type = Operand_Register;
+      reg_operand->reg = {(RegisterName)(Register_es + bits[Bit_SR]), 2, 0};
     }
 
-    printf("; " BYTE_TO_BINARY_PATTERN " - matched\n",
-           BYTE_TO_BINARY(instruction.bits[0].value));
+    if (has_mod) {
+      if (mod == 0b11) {
+        mod_operand->type = Operand_Register;
+        mod_operand->reg = ParseRegister(rm, w);
+      } else {
+        mod_operand->type = Operand_Memory;
+        mod_operand->address.base = has_direct_address
+                                        ? EffectiveAddress_direct
+                                        : ParseEffectiveAddressBase(rm);
+        mod_operand->address.displacement = bits[Bit_Displacement];
+        mod_operand->address.is_wide = is_displacement_wide;
+        mod_operand->address.has_displacement = has_displacement;
+      }
+    }
+
+    if (has_data) {
+      Operand *data_operand =
+          &result.operands[result.operands[0].type ? 1 : 0];
+      data_operand->type = Operand_Immediate;
+      data_operand->immediate_s32 = w ? (int16_t)bits[Bit_Data]
+                                      : (int8_t)bits[Bit_Data];
+    }
+
+    if (has_relative_jump) {
+      result.operands[0].type = Operand_RelativeImmediate;
+      result.operands[0].immediate_s32 =
+          (int8_t)bits[Bit_RelativeJmpAddress];
+    }
+
+    SetClocks(&result, has_displacement && !has_direct_address,
+              has_address);
   }
 
   return result;
 }
 
-Instruction ParseInstruction(MemoryAccess *memory_idx) {
+// Reference decoder: tries every encoding of instructions[] in order. Kept to
+// benchmark and cross-check the dispatch table against.
+static Instruction ParseInstructionLinear(MemoryAccess *memory_idx) {
   Instruction result = {};
   for (uint32_t i = 0; i < ARRAY_SIZE(instructions); ++i) {
-    InstructionEncoding instruction = instructions[i];
-    result = TryParse(instruction, *memory_idx);
+    result = TryParse(&instructions[i], *memory_idx);
     if (result.op) {
-      // memory_idx->offset += result.size;
       break;
     }
   }
@@ -212,381 +413,424 @@ Instruction ParseInstruction(MemoryAccess *memory_idx) {
   return result;
 }
 
-static RegisterInfo ParseRegister(uint8_t register_idx, bool is_wide) {
-  RegisterInfo register_table[][2] = {
-      {{Register_a, 1, 0}, {Register_a, 2, 0}},
-      {{Register_c, 1, 0}, {Register_c, 2, 0}},
-      {{Register_d, 1, 0}, {Register_d, 2, 0}},
-      {{Register_b, 1, 0}, {Register_b, 2, 0}},
-      {{Register_a, 1, 1}, {Register_sp, 2, 0}},
-      {{Register_c, 1, 1}, {Register_bp, 2, 0}},
-      {{Register_d, 1, 1}, {Register_si, 2, 0}},
-      {{Register_b, 1, 1}, {Register_di, 2, 0}},
-  };
+#define ENCODING_NONE 0xff
 
-  uint8_t register_mask = 0x7;
-  return register_table[register_idx & register_mask][is_wide];
-}
+// Returns whether `encoding` can start with `first_byte`, given `reg` in the
+// ModRM reg field. Sets *uses_reg when the match depended on `reg`.
+static bool EncodingMatchesPrefix(InstructionEncoding const *encoding,
+                                  uint8_t first_byte, uint8_t reg,
+                                  bool *uses_reg) {
+  uint8_t prefix[2] = {first_byte, (uint8_t)(reg << 3)};
+  uint32_t bit_position = 0;
+  bool valid = true;
+  *uses_reg = false;
 
-static EffectiveAddress ParseEffectiveAddress(uint8_t rm, uint8_t mod,
-                                              MemoryAccess *memory_idx) {
-  EffectiveAddress effective_address_table[][3] = {
-      {{EffectiveAddress_bx_si, 0},
-       {EffectiveAddress_bx_si, 1},
-       {EffectiveAddress_bx_si, 2}},
-      {{EffectiveAddress_bx_di, 0},
-       {EffectiveAddress_bx_di, 1},
-       {EffectiveAddress_bx_di, 2}},
-      {{EffectiveAddress_bp_si, 0},
-       {EffectiveAddress_bp_si, 1},
-       {EffectiveAddress_bp_si, 2}},
-      {{EffectiveAddress_bp_di, 0},
-       {EffectiveAddress_bp_di, 1},
-       {EffectiveAddress_bp_di, 2}},
-      {{EffectiveAddress_si, 0},
-       {EffectiveAddress_si, 1},
-       {EffectiveAddress_si, 2}},
-      {{EffectiveAddress_di, 0},
-       {EffectiveAddress_di, 1},
-       {EffectiveAddress_di, 2}},
-      {{EffectiveAddress_direct, 2},
-       {EffectiveAddress_bp, 1},
-       {EffectiveAddress_bp, 2}},
-      {{EffectiveAddress_bx, 0},
-       {EffectiveAddress_bx, 1},
-       {EffectiveAddress_bx, 2}},
-  };
+  for (uint32_t bit_idx = 0; valid && bit_idx < ARRAY_SIZE(encoding->bits);
+       ++bit_idx) {
+    InstructionBit test_bits = encoding->bits[bit_idx];
+    if (test_bits.size == 0) {
+      continue;
+    }
 
-  uint8_t mod_mask = 0x3;
-  uint8_t rm_mask = 0x7;
+    uint32_t byte_idx = bit_position / 8;
+    bit_position += test_bits.size;
+    if (test_bits.type != Bit_Literal) {
+      continue;
+    }
 
-  EffectiveAddress address =
-      effective_address_table[rm & rm_mask][mod & mod_mask];
-  if (mod != 0 || address.base == EffectiveAddress_direct) {
-    address.is_wide = address.displacement == 2;
-    address.displacement = ParseValue(memory_idx, address.is_wide, false);
+    // Literals past the first byte are only supported in the reg field.
+    assert(byte_idx == 0 || (byte_idx == 1 && bit_position <= 8 + 5 &&
+                             bit_position - test_bits.size >= 8 + 2));
+    uint8_t shift = 8 * (byte_idx + 1) - bit_position;
+    uint8_t read_bits = BIT_SHIFT_MASK(prefix[byte_idx], shift, test_bits.size);
+    valid = read_bits == test_bits.value;
+    *uses_reg = *uses_reg || byte_idx == 1;
   }
 
-  return address;
+  return valid;
 }
 
-// name is a 3 byte buffer;
-static char const *GetRegisterName(RegisterInfo reg) {
-  char const *register_table[][3] = {
-      {"al", "ah", "ax"}, {"cl", "ch", "cx"}, {"dl", "dh", "dx"},
-      {"bl", "bh", "bx"}, {"sp", "sp", "sp"}, {"bp", "bp", "bp"},
-      {"si", "si", "si"}, {"di", "di", "di"}, {"es", "es", "es"},
-      {"cs", "cs", "cs"}, {"ds", "ds", "ds"}, {"ip", "ip", "ip"},
-  };
+static void BuildInstructionTable(InstructionTable *table) {
+  memset(table->has_reg_extension, 0, sizeof(table->has_reg_extension));
+  memset(table->encoding_idx, ENCODING_NONE, sizeof(table->encoding_idx));
 
-  uint8_t wide_mask = 0x2;
-  return register_table[reg.name][reg.size & wide_mask + reg.offset];
+  assert(ARRAY_SIZE(instructions) < ENCODING_NONE);
+  // Earlier entries win, the same way the linear scan would pick them.
+  for (uint32_t i = 0; i < ARRAY_SIZE(instructions); ++i) {
+    for (uint32_t first_byte = 0; first_byte < 256; ++first_byte) {
+      for (uint8_t reg = 0; reg < 8; ++reg) {
+        bool uses_reg;
+        if (EncodingMatchesPrefix(&instructions[i], first_byte, reg,
+                                  &uses_reg) &&
+            table->encoding_idx[first_byte][reg] == ENCODING_NONE) {
+          table->encoding_idx[first_byte][reg] = i;
+          table->has_reg_extension[first_byte] |= uses_reg;
+        }
+      }
+    }
+  }
 }
 
-// name is a 6 byte buffer;
-static char const *GetEffectiveAddressBase(EffectiveAddress effective_address) {
-  char const *address_base_table[] = {
-      "bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx", "",
-  };
+static InstructionEncoding const *
+LookupEncoding(InstructionTable const *table, MemoryAccess memory_idx) {
+  uint8_t first_byte = ReadMemory(memory_idx);
+  uint8_t reg = 0;
+  if (table->has_reg_extension[first_byte]) {
+    reg = BIT_SHIFT_MASK(ReadMemory(memory_idx, 1), 3, 3);
+  }
 
-  return address_base_table[effective_address.base];
+  uint8_t encoding_idx = table->encoding_idx[first_byte][reg];
+  return encoding_idx == ENCODING_NONE ? 0 : &instructions[encoding_idx];
 }
 
-void PrintValue(uint16_t value, bool is_wide) {
-  if (is_wide) {
-    printf("%hd", value);
-  } else {
-    printf("%hhd", (uint8_t)value);
+static Instruction ParseInstruction(InstructionTable const *table,
+                                    MemoryAccess *memory_idx) {
+  Instruction result = {};
+  InstructionEncoding const *encoding = LookupEncoding(table, *memory_idx);
+  if (encoding) {
+    result = TryParse(encoding, *memory_idx);
   }
+
+  return result;
 }
 
-uint32_t GetValue(uint8_t *data, bool is_signed, bool is_wide, uint16_t *value,
-                  char *data_buf) {
-  *value = data[0];
-  if (is_signed) {
-    *value |= (*value & 0b10000000) << 8;
-    strncpy(data_buf, "%hd", 4);
-    return 1;
-  } else if (is_wide) {
-    *value += (data[1] << 8);
-    strncpy(data_buf, "%hd", 4);
-    return 2;
-  } else {
-    strncpy(data_buf, "%hhd", 5);
-    return 1;
-  }
+void InitDecoder(Decoder *decoder, uint32_t flags) {
+  decoder->flags = flags;
+  BuildInstructionTable(&decoder->table);
 }
 
-void PrintEffectiveAddress(EffectiveAddress effective_address) {
-  printf("[");
+// `times count db value`
+static Instruction MakeDataInstruction(uint64_t address, uint8_t value,
+                                       uint32_t count) {
+  Instruction result = {};
+  result.op = Op_db;
+  result.address = address;
+  result.size = count;
+  result.operands[0].type = Operand_Immediate;
+  result.operands[0].immediate_s32 = value;
 
-  if (effective_address.base != EffectiveAddress_direct) {
-    printf("%s", GetEffectiveAddressBase(effective_address));
-    if (effective_address.displacement != 0) {
-      printf("+");
-    }
+  return result;
+}
+
+// Returns the length of the run of identical bytes at the start of data, or 0
+// if it is shorter than DATA_RUN_MIN_SIZE. Costs one 8 byte compare when
+// there is no run.
+static uint32_t GetDataRunSize(uint8_t const *data, uint64_t size) {
+  static_assert(DATA_RUN_MIN_SIZE == sizeof(uint64_t), "one word compare");
+  if (size < DATA_RUN_MIN_SIZE) {
+    return 0;
   }
 
-  if (effective_address.displacement != 0) {
-    PrintValue(effective_address.displacement, effective_address.is_wide);
+  uint64_t first_word;
+  memcpy(&first_word, data, sizeof(first_word));
+  if (first_word != data[0] * 0x0101010101010101ull) {
+    return 0;
   }
 
-  printf("]");
-}
+  uint64_t max_size = size < DATA_RUN_MAX_SIZE ? size : DATA_RUN_MAX_SIZE;
+  uint32_t result = DATA_RUN_MIN_SIZE;
+  while (result < max_size && data[result] == data[0]) {
+    ++result;
+  }
 
-void RegisterOrMemoryWithRegisterToEither(MemoryAccess *memory_idx) {
-  uint8_t is_dest = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 1, 1);
-  uint8_t is_wide = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 1);
-  ++memory_idx->offset;
+  return result;
+}
 
-  uint8_t mod_bits = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 6, 2);
-  uint8_t reg_bits = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 3, 3);
-  uint8_t rm_bits = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 3);
-  ++memory_idx->offset;
+DecodeStatus DecodeInstruction(Decoder const *decoder, uint8_t const *data,
+                               uint64_t size, uint64_t address,
+                               Instruction *result) {
+  if (decoder->flags & Decoder_CollapseDataRuns) {
+    uint32_t run_size = GetDataRunSize(data, size);
+    if (run_size) {
+      *result = MakeDataInstruction(address, data[0], run_size);
+      return Decode_Ok;
+    }
+  }
 
-  if (is_dest) {
-    RegisterInfo reg = ParseRegister(reg_bits, is_wide);
-    printf("%s", GetRegisterName(reg));
-    printf(", ");
+  MemoryAccess memory_idx = {};
+  memory_idx.base = data;
+  memory_idx.address = address;
+
+  // The last bytes are decoded from a zero padded copy so that a truncated
+  // instruction never reads past the end of data.
+  uint8_t tail[2 * MAX_INSTRUCTION_SIZE];
+  if (size < MAX_INSTRUCTION_SIZE) {
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data, size);
+    memory_idx.base = tail;
   }
 
-  if (mod_bits == 3) {
-    RegisterInfo reg = ParseRegister(rm_bits, is_wide);
-    printf("%s", GetRegisterName(reg));
+  DecodeStatus status = Decode_Ok;
+  *result = {};
+  if (size == 0) {
+    status = Decode_Truncated;
   } else {
-    EffectiveAddress effective_address =
-        ParseEffectiveAddress(rm_bits, mod_bits, memory_idx);
-    PrintEffectiveAddress(effective_address);
-  }
+    *result = ParseInstruction(&decoder->table, &memory_idx);
+    if (!result->op) {
+      status = Decode_UnknownInstruction;
+    } else if (result->size > size) {
+      *result = {};
+      status = Decode_Truncated;
+    }
 
-  if (!is_dest) {
-    printf(", ");
-    RegisterInfo reg = ParseRegister(reg_bits, is_wide);
-    printf("%s", GetRegisterName(reg));
+    if (status != Decode_Ok && (decoder->flags & Decoder_EmitData)) {
+      *result = MakeDataInstruction(address, data[0], 1);
+      status = Decode_Ok;
+    }
   }
+
+  return status;
 }
 
-void ImmediateToRegisterOrMemory(MemoryAccess *memory_idx, bool is_signed_op) {
-  uint8_t is_signed =
-      is_signed_op && BIT_SHIFT_MASK(ReadMemory(*memory_idx), 1, 1);
-  uint8_t is_wide = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 1);
-  ++memory_idx->offset;
+DecodeStatus DecodeInstructions(Decoder const *decoder, uint8_t const *data,
+                                uint64_t size, uint64_t address,
+                                Instruction *results, uint32_t max_count,
+                                uint32_t *result_count,
+                                uint64_t *bytes_consumed) {
+  DecodeStatus status = Decode_Ok;
+  uint64_t offset = 0;
+  uint32_t count = 0;
+  while (status == Decode_Ok && count < max_count && offset < size) {
+    status = DecodeInstruction(decoder, data + offset, size - offset,
+                               address + offset, &results[count]);
+    if (status == Decode_Ok) {
+      offset += results[count++].size;
+    }
+  }
 
-  uint8_t mod_bits = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 6, 2);
-  uint8_t rm_bits = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 3);
-  ++memory_idx->offset;
+  *result_count = count;
+  if (bytes_consumed) {
+    *bytes_consumed = offset;
+  }
+  return status;
+}
 
-  if (mod_bits == 3) {
-    RegisterInfo reg = ParseRegister(rm_bits, is_wide);
-    printf("%s", GetRegisterName(reg));
-  } else {
-    printf(is_wide ? "word " : "byte ");
+// Encoding: the inverse of TryParse, over the same table.
 
-    EffectiveAddress effective_address =
-        ParseEffectiveAddress(rm_bits, mod_bits, memory_idx);
-    PrintEffectiveAddress(effective_address);
+// Inverse of ParseRegister. Returns false for a register with no code of
+// that width.
+static bool GetRegisterCode(Operand operand, bool is_wide, uint32_t *code) {
+  RegisterInfo reg = operand.reg;
+  if (operand.type != Operand_Register || reg.name > Register_di ||
+      reg.size != (is_wide ? 2 : 1)) {
+    return false;
   }
-  printf(", ");
 
-  uint16_t value = ParseValue(memory_idx, is_wide && !is_signed, is_signed);
-  PrintValue(value, is_wide | is_signed);
+  if (is_wide) {
+    *code = reg.name;
+  } else if (reg.name <= Register_b) {
+    *code = reg.name + 4 * reg.offset;
+  } else {
+    return false;
+  }
+  return true;
 }
 
-void ImmediateToRegister(MemoryAccess *memory_idx, uint8_t is_wide,
-                         uint8_t reg_idx) {
-  RegisterInfo reg = ParseRegister(reg_idx, is_wide);
-  printf("%s", GetRegisterName(reg));
+// Inverse of the mod/rm decode in TryParse. A displacement that was not
+// recorded as encoded gets the shortest form that holds it.
+static bool GetModRM(Operand operand, bool is_wide, uint32_t *mod,
+                     uint32_t *rm, uint32_t *displacement_size) {
+  *displacement_size = 0;
+  if (operand.type == Operand_Register) {
+    *mod = 0b11;
+    return GetRegisterCode(operand, is_wide, rm);
+  }
+  if (operand.type != Operand_Memory) {
+    return false;
+  }
 
-  printf(", ");
+  EffectiveAddress address = operand.address;
+  if (address.base == EffectiveAddress_direct) {
+    *mod = 0b00;
+    *rm = 0b110;
+    *displacement_size = 2;
+    return true;
+  }
 
-  uint16_t value = ParseValue(memory_idx, is_wide, false);
-  PrintValue(value, is_wide);
+  int16_t displacement = (int16_t)address.displacement;
+  bool fits_byte = displacement >= -128 && displacement <= 127;
+  *rm = address.base;
+  if (!address.has_displacement && !displacement &&
+      address.base != EffectiveAddress_bp) {
+    *mod = 0b00;
+  } else if (!address.is_wide && fits_byte) {
+    *mod = 0b01;
+    *displacement_size = 1;
+  } else {
+    *mod = 0b10;
+    *displacement_size = 2;
+  }
+  return true;
 }
 
-void ImmediateToAccumulator(MemoryAccess *memory_idx) {
-  uint8_t is_wide = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 1);
-  ++memory_idx->offset;
+// Returns the size of `instruction` encoded with `encoding`, 0 if it does
+// not fit. `data` has room for MAX_INSTRUCTION_SIZE bytes.
+static uint32_t TryEncode(InstructionEncoding const *encoding,
+                          Instruction const *instruction, uint8_t *data) {
+  uint32_t flags = instruction->flags;
+  uint32_t values[Bit_Count] = {};
+  values[Bit_Wide] = (flags & Inst_Wide) != 0;
+  values[Bit_Signed] = (flags & Inst_Signed) != 0;
+  values[Bit_Destination] = (flags & Inst_Destination) != 0;
+  bool w = values[Bit_Wide];
+  bool d = values[Bit_Destination];
+
+  Operand const *operands = instruction->operands;
+  Operand reg_operand = operands[d ? 0 : 1];
+  Operand mod_operand = operands[d ? 1 : 0];
+  bool has_reg_code = GetRegisterCode(reg_operand, w, &values[Bit_Reg]);
+  bool has_segment = reg_operand.type == Operand_Register &&
+                     reg_operand.reg.name >= Register_es &&
+                     reg_operand.reg.name <= Register_ds;
+  values[Bit_SR] = reg_operand.reg.name - Register_es;
+  uint32_t displacement_size = 0;
+  bool has_mod_rm = GetModRM(mod_operand, w, &values[Bit_Mod],
+                             &values[Bit_RM], &displacement_size);
+
+  // Check every field against the instruction while packing the fixed
+  // bits, high bits of each byte first.
+  memset(data, 0, MAX_INSTRUCTION_SIZE);
+  uint32_t has_bits = 0;
+  uint32_t bit_count = 0;
+  for (uint32_t bit_idx = 0; bit_idx < ARRAY_SIZE(encoding->bits);
+       ++bit_idx) {
+    InstructionBit bits = encoding->bits[bit_idx];
+    if (bits.type == Bit_Literal && !bits.size) {
+      continue;
+    }
+    has_bits |= 1 << bits.type;
+
+    bool is_valid = true;
+    if (bits.type == Bit_Reg) {
+      is_valid = has_reg_code;
+    } else if (bits.type == Bit_SR) {
+      is_valid = has_segment;
+    } else if (bits.type == Bit_Mod || bits.type == Bit_RM) {
+      is_valid = has_mod_rm;
+    }
+    if (!is_valid) {
+      return 0;
+    }
 
-  ImmediateToRegister(memory_idx, is_wide, 0);
-}
+    uint32_t value = bits.type == Bit_Literal ? bits.value : values[bits.type];
+    bool is_trailing = bits.type == Bit_Data ||
+                       bits.type == Bit_Displacement ||
+                       bits.type == Bit_Address ||
+                       bits.type == Bit_RelativeJmpAddress;
+    if (bits.size) {
+      bit_count += bits.size;
+      uint32_t shift = 8 * ((bit_count + 7) / 8) - bit_count;
+      data[(bit_count - 1) / 8] |= (uint8_t)(value << shift);
+    } else if (!is_trailing && value != bits.value) {
+      return 0;
+    }
+  }
 
-void AddressWithAccumulatorToEither(MemoryAccess *memory_idx) {
-  uint8_t is_dest = !BIT_SHIFT_MASK(ReadMemory(*memory_idx), 1, 1);
-  uint8_t is_wide = BIT_SHIFT_MASK(ReadMemory(*memory_idx), 0, 1);
-  ++memory_idx->offset;
+  // Fields the encoding lacks are 0 to the decoder.
+  uint32_t const implied_zero[] = {Bit_Wide, Bit_Signed, Bit_Destination};
+  for (uint32_t field_idx = 0; field_idx < ARRAY_SIZE(implied_zero);
+       ++field_idx) {
+    uint32_t type = implied_zero[field_idx];
+    if (!(has_bits & (1 << type)) && values[type]) {
+      return 0;
+    }
+  }
 
-  if (is_dest) {
-    RegisterInfo reg = ParseRegister(0, is_wide);
-    printf("%s", GetRegisterName(reg));
-    printf(", ");
+  // The operands must be exactly the ones the decoder would fill in.
+  bool has_reg = has_bits & ((1 << Bit_Reg) | (1 << Bit_SR));
+  bool has_mod = has_bits & (1 << Bit_Mod);
+  bool has_address = has_bits & (1 << Bit_Address);
+  bool has_data = has_bits & (1 << Bit_Data);
+  bool has_relative_jump = has_bits & (1 << Bit_RelativeJmpAddress);
+  bool is_short_form = !has_mod || has_address;
+  if (is_short_form != ((flags & Inst_ShortForm) != 0)) {
+    return 0;
   }
 
-  printf("[");
-  uint16_t value = ParseValue(memory_idx, is_wide, false);
-  PrintValue(value, is_wide);
-  printf("]");
+  bool is_used[2] = {};
+  if (has_reg) {
+    is_used[d ? 0 : 1] = true;
+  }
+  if (has_mod) {
+    is_used[d ? 1 : 0] = true;
+  }
+  uint32_t data_idx = is_used[0] ? 1 : 0;
+  if (has_data) {
+    if (operands[data_idx].type != Operand_Immediate) {
+      return 0;
+    }
+    is_used[data_idx] = true;
+  }
+  if (has_relative_jump) {
+    if (operands[0].type != Operand_RelativeImmediate) {
+      return 0;
+    }
+    is_used[0] = true;
+  }
+  for (uint32_t operand_idx = 0; operand_idx < 2; ++operand_idx) {
+    if (is_used[operand_idx] != (operands[operand_idx].type != Operand_None)) {
+      return 0;
+    }
+  }
+  if (has_address) {
+    displacement_size = 2;
+  } else if (!has_mod) {
+    displacement_size = 0;
+  }
+
+  uint32_t size = (bit_count + 7) / 8;
+  uint32_t displacement = mod_operand.address.displacement;
+  for (uint32_t byte_idx = 0; byte_idx < displacement_size; ++byte_idx) {
+    data[size++] = (uint8_t)(displacement >> (8 * byte_idx));
+  }
 
-  if (!is_dest) {
-    printf(", ");
-    RegisterInfo reg = ParseRegister(0, is_wide);
-    printf("%s", GetRegisterName(reg));
+  if (has_data) {
+    int32_t immediate = operands[data_idx].immediate_s32;
+    bool is_data_wide = w && !values[Bit_Signed];
+    int32_t fitted = is_data_wide ? (int16_t)immediate : (int8_t)immediate;
+    if (fitted != immediate) {
+      return 0;
+    }
+    data[size++] = (uint8_t)immediate;
+    if (is_data_wide) {
+      data[size++] = (uint8_t)(immediate >> 8);
+    }
   }
+
+  if (has_relative_jump) {
+    int32_t offset = operands[0].immediate_s32;
+    if ((int8_t)offset != offset) {
+      return 0;
+    }
+    data[size++] = (uint8_t)offset;
+  }
+
+  return size;
 }
 
-void DecodeInstruction(MemoryAccess *memory_idx) {
-  ParseInstruction(memory_idx);
-  uint8_t instruction = ReadMemory(*memory_idx);
-  if ((instruction >> 2) == OPCODE_MOV_RM2REG) {
-    printf("mov ");
-    RegisterOrMemoryWithRegisterToEither(memory_idx);
-  } else if ((instruction >> 4) == OPCODE_MOV_IMM2REG) {
-    printf("mov ");
-
-    uint8_t is_wide = BIT_SHIFT_MASK(instruction, 3, 1);
-    uint8_t reg = BIT_SHIFT_MASK(instruction, 0, 3);
-    ++memory_idx->offset;
+uint32_t EncodeInstruction(Instruction const *instruction, uint8_t *data,
+                           uint64_t size) {
+  if (instruction->op == Op_db) {
+    uint32_t count = instruction->size ? instruction->size : 1;
+    if (count > size) {
+      return 0;
+    }
+    memset(data, (uint8_t)instruction->operands[0].immediate_s32, count);
+    return count;
+  }
 
-    ImmediateToRegister(memory_idx, is_wide, reg);
-  } else if ((instruction >> 1) == OPCODE_MOV_IMM2RM) {
-    printf("mov ");
-    ImmediateToRegisterOrMemory(memory_idx, false);
-  } else if ((instruction >> 2) ==
-             ((OPCODE_MOV_MEM2ACC | OPCODE_MOV_ACC2MEM) & 0b11111100)) {
-    printf("mov ");
-    AddressWithAccumulatorToEither(memory_idx);
-  } else if ((instruction >> 2) == OPCODE_ADD_RM2REG ||
-             (instruction >> 2) == OPCODE_SUB_RM2REG ||
-             (instruction >> 2) == OPCODE_CMP_RM2REG) {
-    switch (instruction & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
-    }
-    RegisterOrMemoryWithRegisterToEither(memory_idx);
-  } else if ((instruction >> 2) ==
-             (OPCODE_ADD_IMM2RM | OPCODE_SUB_IMM2RM | OPCODE_CMP_IMM2RM)) {
-    switch ((ReadMemory(*memory_idx, 1)) & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
-    }
-    ImmediateToRegisterOrMemory(memory_idx, true);
-  } else if ((instruction >> 1) == OPCODE_ADD_IMM2ACC ||
-             (instruction >> 1) == OPCODE_SUB_IMM2ACC ||
-             (instruction >> 1) == OPCODE_CMP_IMM2ACC) {
-    switch (instruction & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
-    }
-    ImmediateToAccumulator(memory_idx);
-  } else if (instruction == OPCODE_JE || instruction == OPCODE_JL ||
-             instruction == OPCODE_JLE || instruction == OPCODE_JB ||
-             instruction == OPCODE_JBE || instruction == OPCODE_JP ||
-             instruction == OPCODE_JO || instruction == OPCODE_JS ||
-             instruction == OPCODE_JNE || instruction == OPCODE_JNL ||
-             instruction == OPCODE_JG || instruction == OPCODE_JNB ||
-             instruction == OPCODE_JA || instruction == OPCODE_JNP ||
-             instruction == OPCODE_JNO || instruction == OPCODE_JNS ||
-             instruction == OPCODE_LOOP || instruction == OPCODE_LOOPZ ||
-             instruction == OPCODE_LOOPNZ || instruction == OPCODE_JCXZ) {
-    switch (instruction) {
-    case OPCODE_JE: {
-      printf("je ");
-    } break;
-    case OPCODE_JL: {
-      printf("jl ");
-    } break;
-    case OPCODE_JLE: {
-      printf("jle ");
-    } break;
-    case OPCODE_JB: {
-      printf("jb ");
-    } break;
-    case OPCODE_JBE: {
-      printf("jbe ");
-    } break;
-    case OPCODE_JP: {
-      printf("jp ");
-    } break;
-    case OPCODE_JO: {
-      printf("jo ");
-    } break;
-    case OPCODE_JS: {
-      printf("js ");
-    } break;
-    case OPCODE_JNE: {
-      printf("jne ");
-    } break;
-    case OPCODE_JNL: {
-      printf("jnl ");
-    } break;
-    case OPCODE_JG: {
-      printf("jg ");
-    } break;
-    case OPCODE_JNB: {
-      printf("jnb ");
-    } break;
-    case OPCODE_JA: {
-      printf("ja ");
-    } break;
-    case OPCODE_JNP: {
-      printf("jnp ");
-    } break;
-    case OPCODE_JNO: {
-      printf("jno ");
-    } break;
-    case OPCODE_JNS: {
-      printf("jns ");
-    } break;
-    case OPCODE_LOOP: {
-      printf("loop ");
-    } break;
-    case OPCODE_LOOPZ: {
-      printf("loopz ");
-    } break;
-    case OPCODE_LOOPNZ: {
-      printf("loopnz ");
-    } break;
-    case OPCODE_JCXZ: {
-      printf("jcxz ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
+  uint8_t bytes[MAX_INSTRUCTION_SIZE];
+  for (uint32_t i = 0; i < ARRAY_SIZE(instructions); ++i) {
+    if (instructions[i].op != instruction->op) {
+      continue;
     }
-    ++memory_idx->offset;
 
-    int8_t value = ParseValue(memory_idx, false, false) + 2;
-    printf("$+0");
-    if (value >= 0) {
-      printf("+");
+    uint32_t result = TryEncode(&instructions[i], instruction, bytes);
+    if (result && result <= size) {
+      memcpy(data, bytes, result);
+      return result;
     }
-    PrintValue(value, false);
-  } else {
-    INSTRUCTION_NOT_IMPLEMENTED();
   }
+
+  return 0;
 }
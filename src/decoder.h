@@ -0,0 +1,78 @@
+#pragma once
+#include "stdint.h"
+
+#include "opcode.h"
+
+// 8086 instruction decoder.
+//
+// A Decoder is initialized once and only read afterwards, so one instance can
+// be shared by any number of threads. The decoder keeps no other state and
+// does no I/O.
+
+// Longest encoding: opcode, ModRM, 2 displacement bytes and 2 data bytes.
+// Only Op_db runs are longer.
+#define MAX_INSTRUCTION_SIZE 6
+
+enum DecodeStatus {
+  Decode_Ok,
+  // The bytes at the stop position match no known encoding.
+  Decode_UnknownInstruction,
+  // The instruction at the stop position runs past the end of the buffer.
+  Decode_Truncated,
+};
+
+// First-byte dispatch over the encoding table. Opcodes that share their first
+// byte and are told apart by the ModRM reg field (the 100000 add/sub/cmp
+// group, and the segment register movs, valid only for reg < 4) get a second
+// level indexed by that field; every other opcode fills all 8 slots with the
+// same encoding.
+struct InstructionTable {
+  uint8_t has_reg_extension[256];
+  uint8_t encoding_idx[256][8];
+};
+
+enum DecoderFlag {
+  // Bytes that do not decode, including a truncated last instruction, come
+  // out as one byte Op_db instructions instead of stopping the decode.
+  Decoder_EmitData = 0x1,
+  // Runs of 8 or more identical bytes (zero fill, padding) come out as a
+  // single Op_db instruction whose size is the run length, instead of being
+  // decoded as instructions one at a time.
+  Decoder_CollapseDataRuns = 0x2,
+};
+
+struct Decoder {
+  uint32_t flags;
+  InstructionTable table;
+};
+
+// flags is a combination of DecoderFlag.
+void InitDecoder(Decoder *decoder, uint32_t flags);
+
+// Decodes the instruction at the start of `data`, reading at most `size`
+// bytes. `address` is the position of data[0] in the caller's image and is
+// stored in Instruction::address.
+DecodeStatus DecodeInstruction(Decoder const *decoder, uint8_t const *data,
+                               uint64_t size, uint64_t address,
+                               Instruction *result);
+
+// Sets the clock fields of `instruction` from its op, operands and flags.
+// DecodeInstruction already does this.
+void EstimateClocks(Instruction *instruction);
+
+// Encodes `instruction` into at most `size` bytes of `data`, with the
+// encoding table entry that matches its operands and the form recorded in
+// its flags. Returns the number of bytes written, 0 if no entry encodes it
+// or it does not fit. Whatever DecodeInstruction returns encodes back to
+// the bytes it was decoded from.
+uint32_t EncodeInstruction(Instruction const *instruction, uint8_t *data,
+                           uint64_t size);
+
+// Decodes up to `max_count` consecutive instructions from `data` into
+// `results`. Stops early at the end of `data` (returning Decode_Ok) or at an
+// instruction that does not decode, which is then at data[*bytes_consumed].
+DecodeStatus DecodeInstructions(Decoder const *decoder, uint8_t const *data,
+                                uint64_t size, uint64_t address,
+                                Instruction *results, uint32_t max_count,
+                                uint32_t *result_count,
+                                uint64_t *bytes_consumed);
@@ -0,0 +1,556 @@
+#include "assert.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "decode.cpp"
+#include "generate.cpp"
+#include "print.cpp"
+#include "platform_metrics.cpp"
+
+// Differential fuzzer for the decoder. Every execution decodes the bytes at
+// one position of a random stream several ways and requires them to agree:
+// - ParseInstructionLinear, the scan of instructions[], against the oracle
+//   below, the hand-written opcode chain the decoder had before the
+//   encoding table, ported to fill an Instruction. It shares no parsing
+//   code with the table, so it checks operand, displacement, immediate,
+//   width and flag extraction as well as encoding selection;
+// - ParseInstruction, the first-byte dispatch table, against the scan. Both
+//   go through TryParse, so this only checks which encoding is picked;
+// - DecodeInstruction, the public entry point, given only the bytes the
+//   scan says the instruction takes;
+// and, with --encode, EncodeInstruction must give the bytes back.
+//
+// Streams alternate between random bytes and generator output with a few
+// bits flipped, so both unknown and valid encodings near the edges come
+// up. Buffers are filled once per round and nothing is formatted unless a
+// mismatch is found. A mismatch is minimized before it is reported: the
+// window is shortened, then every byte and bit that can be cleared while
+// the decoders still disagree is cleared.
+
+#define FUZZ_BUFFER_SIZE (64 * 1024)
+#define FUZZ_WINDOW_SIZE 8
+#define FUZZ_MAX_REPORTS 8
+#define FUZZ_DEFAULT_SECONDS 10
+
+struct Fuzzer {
+  Decoder decoder;
+  InstructionGenerator generator;
+  uint64_t state;
+  bool check_encode;
+
+  // FUZZ_WINDOW_SIZE bytes of padding past the end, so a window never reads
+  // out of the buffer.
+  uint8_t buffer[FUZZ_BUFFER_SIZE + FUZZ_WINDOW_SIZE];
+
+  uint64_t execution_count;
+  uint64_t mismatch_count;
+
+  // Minimized windows reported so far, zero padded.
+  uint8_t reported[FUZZ_MAX_REPORTS][FUZZ_WINDOW_SIZE];
+  uint32_t report_count;
+};
+
+static bool IsOperandEqual(Operand a, Operand b) {
+  if (a.type != b.type) {
+    return false;
+  }
+
+  switch (a.type) {
+  case Operand_Register:
+    return a.reg.name == b.reg.name && a.reg.size == b.reg.size &&
+           a.reg.offset == b.reg.offset;
+  case Operand_Memory:
+    return a.address.base == b.address.base &&
+           a.address.displacement == b.address.displacement &&
+           a.address.is_wide == b.address.is_wide &&
+           a.address.has_displacement == b.address.has_displacement;
+  case Operand_Immediate:
+  case Operand_RelativeImmediate:
+    return a.immediate_s32 == b.immediate_s32;
+  default:
+    return true;
+  }
+}
+
+static bool IsInstructionEqual(Instruction const *a, Instruction const *b) {
+  return a->op == b->op && a->size == b->size && a->flags == b->flags &&
+         IsOperandEqual(a->operands[0], b->operands[0]) &&
+         IsOperandEqual(a->operands[1], b->operands[1]);
+}
+
+// Oracle: the decoder's original hand-written chain. It reads the bytes
+// directly and keeps its own register and effective address tables; only
+// the output types are shared with the decoder. Returns an instruction
+// with op Op_None for bytes it does not know.
+
+struct OracleReader {
+  uint8_t const *data;
+  uint32_t offset;
+};
+
+static uint8_t OracleReadByte(OracleReader *reader) {
+  return reader->data[reader->offset++];
+}
+
+static uint16_t OracleReadValue(OracleReader *reader, bool is_wide,
+                                bool is_signed_extended) {
+  uint16_t result = OracleReadByte(reader);
+  if (is_wide) {
+    result |= OracleReadByte(reader) << 8;
+  } else if (is_signed_extended && (result & 0x80)) {
+    result |= 0xff00;
+  }
+  return result;
+}
+
+static Operand OracleRegister(uint8_t register_idx, bool is_wide) {
+  static RegisterInfo const register_table[][2] = {
+      {{Register_a, 1, 0}, {Register_a, 2, 0}},
+      {{Register_c, 1, 0}, {Register_c, 2, 0}},
+      {{Register_d, 1, 0}, {Register_d, 2, 0}},
+      {{Register_b, 1, 0}, {Register_b, 2, 0}},
+      {{Register_a, 1, 1}, {Register_sp, 2, 0}},
+      {{Register_c, 1, 1}, {Register_bp, 2, 0}},
+      {{Register_d, 1, 1}, {Register_si, 2, 0}},
+      {{Register_b, 1, 1}, {Register_di, 2, 0}},
+  };
+
+  Operand result = {};
+  result.type = Operand_Register;
+  result.reg = register_table[register_idx & 0x7][is_wide];
+  return result;
+}
+
+// Register or memory operand from the mod and rm fields, reading the
+// displacement.
+static Operand OracleModRM(OracleReader *reader, uint8_t mod, uint8_t rm,
+                           bool is_wide) {
+  if (mod == 0b11) {
+    return OracleRegister(rm, is_wide);
+  }
+
+  // Base and displacement size in bytes for each rm and mod.
+  static EffectiveAddress const effective_address_table[][3] = {
+      {{EffectiveAddress_bx_si, 0},
+       {EffectiveAddress_bx_si, 1},
+       {EffectiveAddress_bx_si, 2}},
+      {{EffectiveAddress_bx_di, 0},
+       {EffectiveAddress_bx_di, 1},
+       {EffectiveAddress_bx_di, 2}},
+      {{EffectiveAddress_bp_si, 0},
+       {EffectiveAddress_bp_si, 1},
+       {EffectiveAddress_bp_si, 2}},
+      {{EffectiveAddress_bp_di, 0},
+       {EffectiveAddress_bp_di, 1},
+       {EffectiveAddress_bp_di, 2}},
+      {{EffectiveAddress_si, 0},
+       {EffectiveAddress_si, 1},
+       {EffectiveAddress_si, 2}},
+      {{EffectiveAddress_di, 0},
+       {EffectiveAddress_di, 1},
+       {EffectiveAddress_di, 2}},
+      {{EffectiveAddress_direct, 2},
+       {EffectiveAddress_bp, 1},
+       {EffectiveAddress_bp, 2}},
+      {{EffectiveAddress_bx, 0},
+       {EffectiveAddress_bx, 1},
+       {EffectiveAddress_bx, 2}},
+  };
+
+  Operand result = {};
+  result.type = Operand_Memory;
+  result.address = effective_address_table[rm & 0x7][mod & 0x3];
+  uint16_t displacement_size = result.address.displacement;
+  result.address.displacement = 0;
+  if (displacement_size) {
+    result.address.is_wide = displacement_size == 2;
+    result.address.has_displacement = true;
+    result.address.displacement =
+        OracleReadValue(reader, result.address.is_wide, true);
+  }
+  return result;
+}
+
+static Operand OracleImmediate(int32_t value) {
+  Operand result = {};
+  result.type = Operand_Immediate;
+  result.immediate_s32 = value;
+  return result;
+}
+
+// add/sub/cmp from the reg field of the 100000 group and the opcode bits of
+// the other forms, Op_None for the rest.
+static OpMnemonic OracleAluOp(uint8_t bits) {
+  switch (bits & 0b00111000) {
+  case 0b00000000:
+    return Op_add;
+  case 0b00101000:
+    return Op_sub;
+  case 0b00111000:
+    return Op_cmp;
+  default:
+    return Op_None;
+  }
+}
+
+static void OracleRegisterOrMemoryWithRegisterToEither(OracleReader *reader,
+                                                       Instruction *result) {
+  uint8_t first = OracleReadByte(reader);
+  bool is_dest = (first >> 1) & 1;
+  bool is_wide = first & 1;
+  uint8_t modrm = OracleReadByte(reader);
+
+  Operand reg = OracleRegister((modrm >> 3) & 0x7, is_wide);
+  Operand rm = OracleModRM(reader, modrm >> 6, modrm & 0x7, is_wide);
+  result->operands[0] = is_dest ? reg : rm;
+  result->operands[1] = is_dest ? rm : reg;
+  result->flags = (is_wide ? Inst_Wide : 0) | (is_dest ? Inst_Destination : 0);
+}
+
+static void OracleImmediateToRegisterOrMemory(OracleReader *reader,
+                                              bool is_signed_op,
+                                              Instruction *result) {
+  uint8_t first = OracleReadByte(reader);
+  bool is_signed = is_signed_op && ((first >> 1) & 1);
+  bool is_wide = first & 1;
+  uint8_t modrm = OracleReadByte(reader);
+
+  result->operands[0] = OracleModRM(reader, modrm >> 6, modrm & 0x7, is_wide);
+  uint16_t value = OracleReadValue(reader, is_wide && !is_signed, is_signed);
+  result->operands[1] =
+      OracleImmediate(is_wide ? (int16_t)value : (int8_t)value);
+  result->flags = (is_wide ? Inst_Wide : 0) | (is_signed ? Inst_Signed : 0);
+}
+
+static void OracleImmediateToRegister(OracleReader *reader, bool is_wide,
+                                      uint8_t reg_idx, Instruction *result) {
+  result->operands[0] = OracleRegister(reg_idx, is_wide);
+  uint16_t value = OracleReadValue(reader, is_wide, false);
+  result->operands[1] =
+      OracleImmediate(is_wide ? (int16_t)value : (int8_t)value);
+  result->flags =
+      (is_wide ? Inst_Wide : 0) | Inst_Destination | Inst_ShortForm;
+}
+
+static void OracleAddressWithAccumulatorToEither(OracleReader *reader,
+                                                 Instruction *result) {
+  uint8_t first = OracleReadByte(reader);
+  bool is_dest = !((first >> 1) & 1);
+  bool is_wide = first & 1;
+
+  Operand accumulator = OracleRegister(0, is_wide);
+  Operand memory = {};
+  memory.type = Operand_Memory;
+  memory.address.base = EffectiveAddress_direct;
+  memory.address.is_wide = true;
+  memory.address.has_displacement = true;
+  memory.address.displacement = OracleReadValue(reader, true, false);
+  result->operands[0] = is_dest ? accumulator : memory;
+  result->operands[1] = is_dest ? memory : accumulator;
+  result->flags = (is_wide ? Inst_Wide : 0) |
+                  (is_dest ? Inst_Destination : 0) | Inst_ShortForm;
+}
+
+// mov between a segment register and a register or memory word.
+static void OracleSegmentWithRegisterOrMemory(OracleReader *reader,
+                                              Instruction *result) {
+  uint8_t first = OracleReadByte(reader);
+  bool is_dest = (first >> 1) & 1;
+  uint8_t modrm = OracleReadByte(reader);
+
+  Operand segment = {};
+  segment.type = Operand_Register;
+  segment.reg = {(RegisterName)(Register_es + ((modrm >> 3) & 0x3)), 2, 0};
+  Operand rm = OracleModRM(reader, modrm >> 6, modrm & 0x7, true);
+  result->operands[0] = is_dest ? segment : rm;
+  result->operands[1] = is_dest ? rm : segment;
+  result->flags = Inst_Wide | (is_dest ? Inst_Destination : 0);
+}
+
+static Instruction OracleDecode(uint8_t const *data) {
+  static struct {
+    uint8_t opcode;
+    OpMnemonic op;
+  } const jumps[] = {
+      {OPCODE_JE, Op_je},       {OPCODE_JL, Op_jl},
+      {OPCODE_JLE, Op_jle},     {OPCODE_JB, Op_jb},
+      {OPCODE_JBE, Op_jbe},     {OPCODE_JP, Op_jp},
+      {OPCODE_JO, Op_jo},       {OPCODE_JS, Op_js},
+      {OPCODE_JNE, Op_jne},     {OPCODE_JNL, Op_jnl},
+      {OPCODE_JG, Op_jg},       {OPCODE_JNB, Op_jnb},
+      {OPCODE_JA, Op_ja},       {OPCODE_JNP, Op_jnp},
+      {OPCODE_JNO, Op_jno},     {OPCODE_JNS, Op_jns},
+      {OPCODE_LOOP, Op_loop},   {OPCODE_LOOPZ, Op_loopz},
+      {OPCODE_LOOPNZ, Op_loopnz}, {OPCODE_JCXZ, Op_jcxz},
+  };
+
+  OracleReader reader = {data, 0};
+  Instruction result = {};
+  uint8_t instruction = data[0];
+  if ((instruction >> 2) == OPCODE_MOV_RM2REG) {
+    result.op = Op_mov;
+    OracleRegisterOrMemoryWithRegisterToEither(&reader, &result);
+  } else if ((instruction >> 4) == OPCODE_MOV_IMM2REG) {
+    result.op = Op_mov;
+    OracleReadByte(&reader);
+    OracleImmediateToRegister(&reader, (instruction >> 3) & 1,
+                              instruction & 0x7, &result);
+  } else if ((instruction >> 1) == OPCODE_MOV_IMM2RM) {
+    if ((data[1] & 0b00111000) == 0) {
+      result.op = Op_mov;
+      OracleImmediateToRegisterOrMemory(&reader, false, &result);
+    }
+  } else if ((instruction >> 2) ==
+             ((OPCODE_MOV_MEM2ACC | OPCODE_MOV_ACC2MEM) & 0b11111100)) {
+    result.op = Op_mov;
+    OracleAddressWithAccumulatorToEither(&reader, &result);
+  } else if ((instruction & 0b11111101) == 0b10001100) {
+    // Segment registers are es, cs, ss and ds: reg must be below 4.
+    if ((data[1] & 0b00100000) == 0) {
+      result.op = Op_mov;
+      OracleSegmentWithRegisterOrMemory(&reader, &result);
+    }
+  } else if ((instruction >> 2) == OPCODE_ADD_RM2REG ||
+             (instruction >> 2) == OPCODE_SUB_RM2REG ||
+             (instruction >> 2) == OPCODE_CMP_RM2REG) {
+    result.op = OracleAluOp(instruction);
+    OracleRegisterOrMemoryWithRegisterToEither(&reader, &result);
+  } else if ((instruction >> 2) ==
+             (OPCODE_ADD_IMM2RM | OPCODE_SUB_IMM2RM | OPCODE_CMP_IMM2RM)) {
+    result.op = OracleAluOp(data[1]);
+    if (result.op) {
+      OracleImmediateToRegisterOrMemory(&reader, true, &result);
+    }
+  } else if ((instruction >> 1) == OPCODE_ADD_IMM2ACC ||
+             (instruction >> 1) == OPCODE_SUB_IMM2ACC ||
+             (instruction >> 1) == OPCODE_CMP_IMM2ACC) {
+    result.op = OracleAluOp(instruction);
+    OracleReadByte(&reader);
+    OracleImmediateToRegister(&reader, instruction & 1, 0, &result);
+  } else {
+    for (uint32_t jump_idx = 0; jump_idx < ARRAY_SIZE(jumps); ++jump_idx) {
+      if (instruction == jumps[jump_idx].opcode) {
+        result.op = jumps[jump_idx].op;
+        OracleReadByte(&reader);
+        result.operands[0].type = Operand_RelativeImmediate;
+        result.operands[0].immediate_s32 = (int8_t)OracleReadByte(&reader);
+        result.flags = Inst_ShortForm;
+      }
+    }
+  }
+
+  if (result.op) {
+    result.size = reader.offset;
+  } else {
+    result = {};
+  }
+  return result;
+}
+
+// Decodes `window` every way and returns whether they disagree. The
+// decodes go to `table` and `linear` for reporting.
+static bool IsMismatch(Fuzzer *fuzzer, uint8_t const *window,
+                       Instruction *table, Instruction *linear) {
+  MemoryAccess memory_idx = {};
+  memory_idx.base = window;
+  *table = ParseInstruction(&fuzzer->decoder.table, &memory_idx);
+  *linear = ParseInstructionLinear(&memory_idx);
+  if (!IsInstructionEqual(table, linear)) {
+    return true;
+  }
+  Instruction oracle = OracleDecode(window);
+  if (oracle.op != linear->op ||
+      (linear->op && !IsInstructionEqual(&oracle, linear))) {
+    return true;
+  }
+  if (!linear->op) {
+    return false;
+  }
+
+  // Exactly the instruction's bytes: no truncation, no read past them.
+  Instruction decoded;
+  DecodeStatus status = DecodeInstruction(&fuzzer->decoder, window,
+                                          linear->size, 0, &decoded);
+  if (status != Decode_Ok || !IsInstructionEqual(&decoded, linear) ||
+      decoded.clocks != linear->clocks) {
+    return true;
+  }
+
+  if (fuzzer->check_encode) {
+    uint8_t encoded[MAX_INSTRUCTION_SIZE];
+    uint32_t size = EncodeInstruction(linear, encoded, sizeof(encoded));
+    if (size != linear->size || memcmp(encoded, window, size) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void PrintBytes(uint8_t const *bytes, uint32_t size) {
+  for (uint32_t byte_idx = 0; byte_idx < size; ++byte_idx) {
+    printf(" %02x", bytes[byte_idx]);
+  }
+}
+
+static void PrintDecoded(char const *label, Instruction instruction) {
+  OutputBuffer out = CreateOutputBuffer(stdout, OUTPUT_MAX_RESERVE * 2);
+  printf("  %-7s size %u, flags 0x%x: ", label, instruction.size,
+         instruction.flags);
+  fflush(stdout);
+  if (instruction.op) {
+    PrintInstruction(&out, instruction);
+  } else {
+    AppendString(&out, "(unknown)");
+  }
+  AppendChar(&out, '\n');
+  DestroyOutputBuffer(&out);
+}
+
+// Shrinks a mismatching window while it keeps mismatching, then reports it
+// unless the same minimized window was reported before.
+static void ReportMismatch(Fuzzer *fuzzer, uint8_t const *found) {
+  uint8_t window[FUZZ_WINDOW_SIZE];
+  memcpy(window, found, sizeof(window));
+  Instruction table;
+  Instruction linear;
+
+  // Shortest prefix, the rest zero.
+  uint32_t size = FUZZ_WINDOW_SIZE;
+  while (size > 1) {
+    uint8_t shorter[FUZZ_WINDOW_SIZE] = {};
+    memcpy(shorter, window, size - 1);
+    if (!IsMismatch(fuzzer, shorter, &table, &linear)) {
+      break;
+    }
+    memcpy(window, shorter, sizeof(window));
+    --size;
+  }
+
+  // Fewest set bits.
+  for (uint32_t byte_idx = 0; byte_idx < size; ++byte_idx) {
+    for (uint32_t bit = 0; bit < 8; ++bit) {
+      uint8_t saved = window[byte_idx];
+      window[byte_idx] &= (uint8_t)~(1 << bit);
+      if (window[byte_idx] != saved &&
+          !IsMismatch(fuzzer, window, &table, &linear)) {
+        window[byte_idx] = saved;
+      }
+    }
+  }
+
+  for (uint32_t report_idx = 0; report_idx < fuzzer->report_count;
+       ++report_idx) {
+    if (memcmp(fuzzer->reported[report_idx], window, sizeof(window)) == 0) {
+      return;
+    }
+  }
+  if (fuzzer->report_count == FUZZ_MAX_REPORTS) {
+    return;
+  }
+  memcpy(fuzzer->reported[fuzzer->report_count++], window, sizeof(window));
+
+  IsMismatch(fuzzer, window, &table, &linear);
+  printf("Mismatch after %llu executions, minimized from",
+         (unsigned long long)fuzzer->execution_count);
+  PrintBytes(found, FUZZ_WINDOW_SIZE);
+  printf(" to");
+  PrintBytes(window, size);
+  printf(":\n");
+  PrintDecoded("table", table);
+  PrintDecoded("linear", linear);
+  PrintDecoded("oracle", OracleDecode(window));
+  if (linear.op && fuzzer->check_encode) {
+    uint8_t encoded[MAX_INSTRUCTION_SIZE];
+    uint32_t encoded_size = EncodeInstruction(&linear, encoded,
+                                              sizeof(encoded));
+    printf("  encoded");
+    PrintBytes(encoded, encoded_size);
+    printf("\n");
+  }
+}
+
+// Refills the buffer, random bytes on even rounds and mutated generator
+// output on odd ones.
+static void FillBuffer(Fuzzer *fuzzer, uint64_t round) {
+  uint8_t *buffer = fuzzer->buffer;
+  if (round & 1) {
+    uint64_t size =
+        GenerateInstructions(&fuzzer->generator, buffer, FUZZ_BUFFER_SIZE);
+    memset(buffer + size, 0, FUZZ_BUFFER_SIZE - size);
+    for (uint32_t flip = 0; flip < FUZZ_BUFFER_SIZE / 64; ++flip) {
+      uint64_t random = NextRandom(&fuzzer->state);
+      buffer[random % FUZZ_BUFFER_SIZE] ^= (uint8_t)(1 << (random >> 61));
+    }
+  } else {
+    for (uint32_t offset = 0; offset < FUZZ_BUFFER_SIZE; offset += 8) {
+      uint64_t random = NextRandom(&fuzzer->state);
+      memcpy(buffer + offset, &random, sizeof(random));
+    }
+  }
+}
+
+// Walks the buffer one instruction at a time, one byte past unknown ones.
+static void FuzzBuffer(Fuzzer *fuzzer) {
+  uint64_t offset = 0;
+  while (offset < FUZZ_BUFFER_SIZE) {
+    uint8_t const *window = fuzzer->buffer + offset;
+    Instruction table;
+    Instruction linear;
+    ++fuzzer->execution_count;
+    if (IsMismatch(fuzzer, window, &table, &linear)) {
+      ReportMismatch(fuzzer, window);
+      ++fuzzer->mismatch_count;
+    }
+    offset += linear.op ? linear.size : 1;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = 0x8086;
+  double seconds = FUZZ_DEFAULT_SECONDS;
+  uint64_t max_executions = 0;
+  bool check_encode = false;
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    if (strcmp(argv[arg_idx], "--seed") == 0 && arg_idx + 1 < argc) {
+      seed = strtoull(argv[++arg_idx], 0, 0);
+    } else if (strcmp(argv[arg_idx], "--seconds") == 0 && arg_idx + 1 < argc) {
+      seconds = atof(argv[++arg_idx]);
+    } else if (strcmp(argv[arg_idx], "--count") == 0 && arg_idx + 1 < argc) {
+      max_executions = strtoull(argv[++arg_idx], 0, 0);
+    } else if (strcmp(argv[arg_idx], "--encode") == 0) {
+      check_encode = true;
+    } else {
+      printf("usage: fuzz [--seed n] [--seconds s | --count executions] "
+             "[--encode]\n");
+      return -1;
+    }
+  }
+
+  Fuzzer *fuzzer = (Fuzzer *)calloc(1, sizeof(Fuzzer));
+  InitDecoder(&fuzzer->decoder, 0);
+  InitGenerator(&fuzzer->generator, seed);
+  fuzzer->state = seed ? seed : 0x8086;
+  fuzzer->check_encode = check_encode;
+
+  uint64_t start = ReadOSTimer();
+  double elapsed = 0;
+  for (uint64_t round = 0;; ++round) {
+    FillBuffer(fuzzer, round);
+    FuzzBuffer(fuzzer);
+
+    elapsed = SecondsElapsed(start, ReadOSTimer());
+    bool is_done = max_executions ? fuzzer->execution_count >= max_executions
+                                  : elapsed >= seconds;
+    if (is_done) {
+      break;
+    }
+  }
+
+  printf("%llu executions in %.2fs (%.2f M/s), %llu mismatches\n",
+         (unsigned long long)fuzzer->execution_count, elapsed,
+         fuzzer->execution_count / elapsed / 1000000.0,
+         (unsigned long long)fuzzer->mismatch_count);
+  return fuzzer->mismatch_count ? -1 : 0;
+}
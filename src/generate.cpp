@@ -0,0 +1,174 @@
+#include "stdint.h"
+#include "string.h"
+
+// Random instruction streams built from the decoder's encoding table, for
+// benchmark corpora and fuzzing. Include after decode.cpp.
+//
+// Each entry of instructions[] is compiled once into a template: the fixed
+// and random bits of its one or two opcode bytes, and where its W and S
+// bits are. An instruction is then one xorshift draw: 12 bits pick the
+// encoding, 16 fill its random opcode bits (D, W, S, mod, reg, r/m, sr),
+// and the rest are its displacement and data, whose sizes follow from mod,
+// r/m, W and S the same way the decoder reads them. Every encoding, mod/rm
+// form and bit variant comes up, and every instruction decodes.
+
+#define GENERATOR_PICK_BITS 12
+#define GENERATOR_PICK_SIZE (1 << GENERATOR_PICK_BITS)
+#define GENERATOR_NO_BIT 0xff
+
+struct GeneratorEncoding {
+  // Opcode bytes, first byte in the low 8 bits.
+  uint16_t fixed_bits;
+  uint16_t random_bits;
+  uint8_t opcode_size;
+  // Opcode bytes plus the bytes every instance has: a direct address or a
+  // jump offset.
+  uint8_t fixed_size;
+  // Bit position in the opcode bytes, 16 (always 0) when absent.
+  uint8_t w_bit;
+  uint8_t s_bit;
+  // 0xff when the encoding has the field, else 0.
+  uint8_t mod_mask;
+  uint8_t data_mask;
+};
+
+struct InstructionGenerator {
+  uint64_t state;
+  GeneratorEncoding encodings[ARRAY_SIZE(instructions)];
+  // Encoding index by the pick bits of a draw, in proportion to the weights.
+  uint8_t pick[GENERATOR_PICK_SIZE];
+};
+
+static GeneratorEncoding CompileEncoding(InstructionEncoding const *encoding) {
+  GeneratorEncoding result = {};
+  result.w_bit = 16;
+  result.s_bit = 16;
+
+  uint32_t bit_count = 0;
+  uint32_t extra_size = 0;
+  for (uint32_t bit_idx = 0; bit_idx < ARRAY_SIZE(encoding->bits);
+       ++bit_idx) {
+    InstructionBit bits = encoding->bits[bit_idx];
+    if (bits.type == Bit_Address) {
+      extra_size = 2;
+    } else if (bits.type == Bit_RelativeJmpAddress) {
+      extra_size = 1;
+    } else if (bits.type == Bit_Data) {
+      result.data_mask = 0xff;
+    }
+    if (!bits.size) {
+      continue;
+    }
+
+    // Bits are read from the high end of each byte.
+    bit_count += bits.size;
+    uint32_t byte_idx = (bit_count - 1) / 8;
+    uint32_t shift = 8 * byte_idx + (8 * (byte_idx + 1) - bit_count);
+    uint16_t mask = (uint16_t)(((1 << bits.size) - 1) << shift);
+    if (bits.type == Bit_Literal) {
+      result.fixed_bits |= (uint16_t)(bits.value << shift);
+    } else {
+      result.random_bits |= mask;
+    }
+    if (bits.type == Bit_Mod) {
+      result.mod_mask = 0xff;
+    } else if (bits.type == Bit_Wide) {
+      result.w_bit = (uint8_t)shift;
+    } else if (bits.type == Bit_Signed) {
+      result.s_bit = (uint8_t)shift;
+    }
+  }
+  result.opcode_size = (uint8_t)((bit_count + 7) / 8);
+  result.fixed_size = (uint8_t)(result.opcode_size + extra_size);
+
+  return result;
+}
+
+// `weights` has one entry per OpMnemonic, the weight of each encoding of
+// that op; 0 gives every encoding the same weight. Weights are resolved to
+// 1/GENERATOR_PICK_SIZE, so an encoding with a tiny share may never come up.
+void InitGenerator(InstructionGenerator *generator, uint64_t seed,
+                   uint32_t const *weights = 0) {
+  *generator = {};
+  // xorshift never leaves 0.
+  generator->state = seed ? seed : 0x8086;
+
+  uint64_t total_weight = 0;
+  for (uint32_t i = 0; i < ARRAY_SIZE(instructions); ++i) {
+    generator->encodings[i] = CompileEncoding(&instructions[i]);
+    total_weight += weights ? weights[instructions[i].op] : 1;
+  }
+
+  // Slot s goes to the encoding whose weight range holds its middle.
+  uint32_t encoding_idx = 0;
+  uint64_t range_end = weights ? weights[instructions[0].op] : 1;
+  for (uint32_t slot = 0; slot < GENERATOR_PICK_SIZE; ++slot) {
+    uint64_t position = ((2 * slot + 1) * total_weight) /
+                        (2 * GENERATOR_PICK_SIZE);
+    while (position >= range_end &&
+           encoding_idx + 1 < ARRAY_SIZE(instructions)) {
+      ++encoding_idx;
+      range_end += weights ? weights[instructions[encoding_idx].op] : 1;
+    }
+    generator->pick[slot] = (uint8_t)encoding_idx;
+  }
+}
+
+inline uint64_t NextRandom(uint64_t *state) {
+  uint64_t value = *state;
+  value ^= value << 13;
+  value ^= value >> 7;
+  value ^= value << 17;
+  *state = value;
+  return value;
+}
+
+// Displacement bytes by mod, and for mod 00 whether r/m is 110.
+static uint8_t const displacement_sizes[4][2] = {
+    {0, 2},
+    {1, 1},
+    {2, 2},
+    {0, 0},
+};
+
+// Fills `data` with whole instructions, at most `size` bytes. Returns the
+// number of bytes written, less than `size` by at most
+// MAX_INSTRUCTION_SIZE - 1.
+uint64_t GenerateInstructions(InstructionGenerator *generator, uint8_t *data,
+                              uint64_t size) {
+  // No branch depends on the draw: the sizes come from masks and tables.
+  // The state is kept local, as stores to data could alias it.
+  uint64_t state = generator->state;
+  uint64_t offset = 0;
+  while (offset + MAX_INSTRUCTION_SIZE <= size) {
+    uint64_t random = NextRandom(&state);
+    GeneratorEncoding const *encoding =
+        &generator->encodings[generator->pick[random &
+                                              (GENERATOR_PICK_SIZE - 1)]];
+    random >>= GENERATOR_PICK_BITS;
+
+    uint32_t opcode = encoding->fixed_bits | (random & encoding->random_bits);
+    random >>= 16;
+    uint32_t w = (opcode >> encoding->w_bit) & 1;
+    uint32_t s = (opcode >> encoding->s_bit) & 1;
+    uint32_t mod = (opcode >> 14) & 0x3;
+    uint32_t rm = (opcode >> 8) & 0x7;
+    uint32_t displacement_size =
+        displacement_sizes[mod][rm == 0b110] & encoding->mod_mask;
+    uint32_t data_size = (1 + (w & ~s)) & encoding->data_mask;
+
+    // The random bits left fill the displacement and data.
+    uint64_t bytes = opcode | random << (8 * encoding->opcode_size);
+    uint32_t instruction_size =
+        encoding->fixed_size + displacement_size + data_size;
+    if (offset + sizeof(bytes) <= size) {
+      memcpy(data + offset, &bytes, sizeof(bytes));
+    } else {
+      memcpy(data + offset, &bytes, instruction_size);
+    }
+    offset += instruction_size;
+  }
+  generator->state = state;
+
+  return offset;
+}
@@ -0,0 +1,326 @@
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Execution history for stepping the simulator backwards.
+//
+// While the program runs, on blocks or the fetch loop, the history only
+// takes a checkpoint every checkpoint_interval instructions. The first
+// checkpoint is a full snapshot; the others are deltas holding the pages
+// written during their interval, so a checkpoint costs what the interval
+// stored to, not every page dirty since the program was loaded. Nothing is
+// recorded per instruction.
+//
+// Stepping back restores the latest checkpoint, or the one before when the
+// simulator is at it, and re-executes forward to the instruction before,
+// this time with an undo log: before each instruction runs, the state it
+// is about to overwrite goes to one UndoStep with its ip, the flags and the
+// word of the one register it can write, plus one UndoByte per memory byte
+// it stores to. The following steps back pop the bytes, then the step. The
+// cost of a step back is bounded by the interval, not by how long the
+// program has been running.
+//
+// The checkpoints take the place of any snapshot taken on the same
+// simulator (see RestoreSnapshot).
+
+#define HISTORY_DEFAULT_INTERVAL (1 << 16)
+
+struct UndoStep {
+  uint16_t ip;
+  // Old word of `reg`. Instructions that write no register save ip, which
+  // the step restores anyway.
+  uint16_t register_value;
+  uint8_t reg;
+  // The flags, as PendingFlags when flags_op is not Op_None. a and b are
+  // at most 16 bits and the result follows from them.
+  uint8_t flags_op;
+  uint8_t flags_is_wide;
+  // Number of UndoBytes logged by the instruction.
+  uint8_t byte_count;
+  uint16_t flags_a;
+  uint16_t flags_b;
+  // Low bits of the clock total before the instruction; an instruction
+  // takes far fewer than 2^16 clocks.
+  uint16_t clocks;
+};
+
+// Physical address in the low 20 bits, old byte in the top 8.
+typedef uint32_t UndoByte;
+
+struct History {
+  UndoStep *steps;
+  uint32_t step_count;
+  uint32_t step_capacity;
+
+  UndoByte *bytes;
+  uint32_t byte_count;
+
+  SimulatorSnapshot *checkpoints;
+  uint32_t checkpoint_count;
+  uint32_t checkpoint_capacity;
+  uint64_t checkpoint_interval;
+
+  // Instructions executed again to step back past a checkpoint.
+  uint64_t replay_count;
+};
+
+static void TakeCheckpoint(History *history, Simulator *simulator) {
+  if (history->checkpoint_count == history->checkpoint_capacity) {
+    history->checkpoint_capacity =
+        history->checkpoint_capacity ? 2 * history->checkpoint_capacity : 16;
+    history->checkpoints = (SimulatorSnapshot *)realloc(
+        history->checkpoints,
+        history->checkpoint_capacity * sizeof(SimulatorSnapshot));
+  }
+
+  SimulatorSnapshot *checkpoint =
+      &history->checkpoints[history->checkpoint_count++];
+  *checkpoint = {};
+  if (history->checkpoint_count == 1) {
+    TakeSnapshot(simulator, checkpoint);
+  } else {
+    TakeDeltaSnapshot(simulator, checkpoint);
+  }
+  history->step_count = 0;
+  history->byte_count = 0;
+}
+
+// Starts recording from the current state. `checkpoint_interval` is in
+// instructions, 0 for HISTORY_DEFAULT_INTERVAL.
+void InitHistory(History *history, Simulator *simulator,
+                 uint64_t checkpoint_interval) {
+  *history = {};
+  history->checkpoint_interval =
+      checkpoint_interval ? checkpoint_interval : HISTORY_DEFAULT_INTERVAL;
+  TakeCheckpoint(history, simulator);
+}
+
+void DestroyHistory(History *history) {
+  for (uint32_t checkpoint_idx = 0; checkpoint_idx < history->checkpoint_count;
+       ++checkpoint_idx) {
+    DestroySnapshot(&history->checkpoints[checkpoint_idx]);
+  }
+  free(history->checkpoints);
+  free(history->bytes);
+  free(history->steps);
+  *history = {};
+}
+
+// Records what `instruction` is about to overwrite, mirroring
+// SimulateInstruction.
+inline void LogInstruction(History *history, Simulator *simulator,
+                           Instruction *instruction) {
+  // An instruction stores two bytes at most, so bytes has room for twice
+  // as many entries as steps.
+  if (history->step_count == history->step_capacity) {
+    history->step_capacity =
+        history->step_capacity ? 2 * history->step_capacity : 4096;
+    history->steps = (UndoStep *)realloc(
+        history->steps, history->step_capacity * sizeof(UndoStep));
+    history->bytes = (UndoByte *)realloc(
+        history->bytes, 2 * history->step_capacity * sizeof(UndoByte));
+  }
+
+  // Built locally and stored once.
+  UndoStep step = {};
+  uint16_t *registers = simulator->registers;
+  step.ip = registers[Register_is];
+
+  RegisterName reg = Register_is;
+  OpMnemonic op = instruction->op;
+  Operand *destination = &instruction->operands[0];
+  if (op == Op_mov || op == Op_add || op == Op_sub) {
+    if (destination->type == Operand_Register) {
+      reg = destination->reg.name;
+    } else if (destination->type == Operand_Memory) {
+      SegmentedAddress address =
+          GetEffectiveAddress(simulator, destination->address);
+      uint32_t physical = GetPhysicalAddress(address.segment, address.offset);
+      UndoByte *bytes = history->bytes + history->byte_count;
+      bytes[0] = physical | (uint32_t)simulator->memory[physical] << 24;
+      step.byte_count = 1;
+      if (instruction->flags & Inst_Wide) {
+        uint16_t high_offset = (uint16_t)(address.offset + 1);
+        physical = GetPhysicalAddress(address.segment, high_offset);
+        bytes[1] = physical | (uint32_t)simulator->memory[physical] << 24;
+        step.byte_count = 2;
+      }
+      history->byte_count += step.byte_count;
+    }
+  } else if (op == Op_loop || op == Op_loopz || op == Op_loopnz) {
+    reg = Register_c;
+  }
+  step.clocks = (uint16_t)simulator->clocks;
+  step.reg = (uint8_t)reg;
+  step.register_value = registers[reg];
+
+  if (simulator->has_pending_flags) {
+    PendingFlags pending = simulator->pending_flags;
+    step.flags_op = pending.op;
+    step.flags_is_wide = pending.is_wide;
+    step.flags_a = (uint16_t)pending.a;
+    step.flags_b = (uint16_t)pending.b;
+  } else {
+    step.flags_op = Op_None;
+    step.flags_a = simulator->flags;
+  }
+  history->steps[history->step_count++] = step;
+}
+
+// Executes one instruction with logging, checkpointing at the end of each
+// interval. Returns false if the instruction does not decode.
+inline bool StepLogged(History *history, Simulator *simulator,
+                       Decoder const *decoder) {
+  Instruction *instruction =
+      FetchInstruction(simulator, decoder, simulator->registers[Register_is]);
+  if (!instruction) {
+    return false;
+  }
+
+  LogInstruction(history, simulator, instruction);
+  SimulateInstruction(simulator, *instruction);
+  ++simulator->instruction_count;
+
+  if (history->step_count >= history->checkpoint_interval) {
+    TakeCheckpoint(history, simulator);
+  }
+  return true;
+}
+
+// Same contract as RunSimulatorBlocks, or RunSimulator when `blocks` is 0,
+// recording history. Checkpoints are taken when the instruction limit
+// would be checked, so on blocks they may be up to one block late.
+SimulateStatus RunSimulatorRecorded(Simulator *simulator, History *history,
+                                    BlockCache *blocks,
+                                    Decoder const *decoder) {
+  // A log left by stepping back does not cover what runs next.
+  if (history->step_count) {
+    TakeCheckpoint(history, simulator);
+  }
+
+  uint64_t limit = simulator->instruction_limit;
+  SimulateStatus status;
+  bool is_at_checkpoint;
+  do {
+    SimulatorSnapshot *latest =
+        &history->checkpoints[history->checkpoint_count - 1];
+    uint64_t checkpoint_at =
+        latest->instruction_count + history->checkpoint_interval;
+    simulator->instruction_limit =
+        limit && limit < checkpoint_at ? limit : checkpoint_at;
+    status = blocks ? RunSimulatorBlocks(simulator, blocks, decoder)
+                    : RunSimulator(simulator, decoder);
+    simulator->instruction_limit = limit;
+
+    is_at_checkpoint = status == Simulate_LimitReached &&
+                       !(limit && simulator->instruction_count >= limit);
+    if (is_at_checkpoint) {
+      TakeCheckpoint(history, simulator);
+    }
+  } while (is_at_checkpoint);
+
+  return status;
+}
+
+static void UndoLoggedStep(History *history, Simulator *simulator) {
+  UndoStep step = history->steps[--history->step_count];
+  for (uint32_t byte_idx = 0; byte_idx < step.byte_count; ++byte_idx) {
+    UndoByte byte = history->bytes[--history->byte_count];
+    uint32_t physical = byte & (SIMULATOR_MEMORY_SIZE - 1);
+    // The page stays dirty: it may be zero again, but dirty only means it
+    // has to be looked at.
+    InvalidateDecodeCache(simulator, physical, 1);
+    simulator->memory[physical] = (uint8_t)(byte >> 24);
+  }
+
+  simulator->registers[step.reg] = step.register_value;
+  simulator->registers[Register_is] = step.ip;
+  simulator->has_pending_flags = step.flags_op != Op_None;
+  if (simulator->has_pending_flags) {
+    uint32_t a = step.flags_a;
+    uint32_t b = step.flags_b;
+    uint32_t result = step.flags_op == Op_add ? a + b : a - b;
+    simulator->pending_flags = {a, b, result, step.flags_op,
+                                step.flags_is_wide};
+  } else {
+    simulator->flags = step.flags_a;
+  }
+  --simulator->instruction_count;
+  simulator->clocks -= (uint16_t)((uint16_t)simulator->clocks - step.clocks);
+}
+
+// Puts the simulator back at the latest checkpoint. Only `changed_pages`,
+// the pages written since, need their contents back: each gets the copy
+// from the most recent checkpoint that stored it, or zero if it was clean.
+static void RestoreCheckpoint(History *history, Simulator *simulator,
+                              uint64_t const *changed_pages) {
+  uint32_t latest_idx = history->checkpoint_count - 1;
+  SimulatorSnapshot *latest = &history->checkpoints[latest_idx];
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    if (!((changed_pages[page / 64] >> (page % 64)) & 1)) {
+      continue;
+    }
+
+    uint8_t const *data = 0;
+    if ((latest->dirty_pages[page / 64] >> (page % 64)) & 1) {
+      for (uint32_t checkpoint_idx = latest_idx + 1; checkpoint_idx-- > 0;) {
+        SimulatorSnapshot *checkpoint = &history->checkpoints[checkpoint_idx];
+        if ((checkpoint->stored_pages[page / 64] >> (page % 64)) & 1) {
+          data = checkpoint->pages +
+                 checkpoint->page_slot[page] * SIMULATOR_PAGE_SIZE;
+          break;
+        }
+      }
+    }
+    RestorePage(simulator, page, data);
+  }
+  RestoreSnapshotState(simulator, latest);
+}
+
+// Undoes the last instruction. Returns false, changing nothing, when the
+// simulator is back where the history started, and also when the replay
+// from a checkpoint fails to fetch an instruction it ran before, leaving
+// the simulator where the replay stopped.
+bool StepBack(History *history, Simulator *simulator, Decoder const *decoder) {
+  if (history->step_count) {
+    UndoLoggedStep(history, simulator);
+    return true;
+  }
+
+  // Past the latest checkpoint with nothing logged: replay from it. At it:
+  // replay from the one before, if any.
+  SimulatorSnapshot *latest =
+      &history->checkpoints[history->checkpoint_count - 1];
+  uint64_t target = simulator->instruction_count - 1;
+  if (simulator->instruction_count > latest->instruction_count) {
+    RestoreCheckpoint(history, simulator, simulator->written_pages);
+  } else if (history->checkpoint_count > 1) {
+    --history->checkpoint_count;
+    RestoreCheckpoint(history, simulator, latest->stored_pages);
+    DestroySnapshot(latest);
+  } else {
+    return false;
+  }
+
+  while (simulator->instruction_count < target) {
+    if (!StepLogged(history, simulator, decoder)) {
+      return false;
+    }
+    ++history->replay_count;
+  }
+  return true;
+}
+
+// Steps back until ip is at `address`, the state just before the most
+// recent execution of the instruction there. Returns false if it was never
+// executed, leaving the simulator where the history started.
+bool RunBackToAddress(History *history, Simulator *simulator,
+                      Decoder const *decoder, uint16_t address) {
+  while (StepBack(history, simulator, decoder)) {
+    if (simulator->registers[Register_is] == address) {
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,267 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "instruction_file.h"
+
+PackedOperand PackOperand(Operand operand) {
+  PackedOperand result = {};
+  result.type = (uint8_t)operand.type;
+  switch (operand.type) {
+  case Operand_Register: {
+    result.detail = (uint8_t)(operand.reg.name | (operand.reg.size == 2) << 4 |
+                              operand.reg.offset << 5);
+  } break;
+  case Operand_Memory: {
+    // Whether and how wide the displacement was encoded, which the text
+    // does not show but the encoder and the clocks need.
+    result.detail = (uint8_t)(operand.address.base |
+                              operand.address.has_displacement << 4 |
+                              operand.address.is_wide << 5);
+    result.value = operand.address.displacement;
+  } break;
+  case Operand_Immediate:
+  case Operand_RelativeImmediate: {
+    result.value = (uint16_t)operand.immediate_s32;
+  } break;
+  default:
+    break;
+  }
+
+  return result;
+}
+
+// Returns false if the operand holds a value the enums do not have.
+bool UnpackOperand(PackedOperand packed, Operand *result) {
+  *result = {};
+  if (packed.type > Operand_RelativeImmediate) {
+    return false;
+  }
+
+  result->type = (OperandType)packed.type;
+  switch (result->type) {
+  case Operand_Register: {
+    if ((packed.detail & 0xf) >= Register_count) {
+      return false;
+    }
+    result->reg.name = (RegisterName)(packed.detail & 0xf);
+    result->reg.size = (packed.detail >> 4) & 1 ? 2 : 1;
+    result->reg.offset = (packed.detail >> 5) & 1;
+  } break;
+  case Operand_Memory: {
+    if ((packed.detail & 0xf) > EffectiveAddress_direct) {
+      return false;
+    }
+    result->address.base = (EffectiveAddressBase)(packed.detail & 0xf);
+    result->address.has_displacement = (packed.detail >> 4) & 1;
+    result->address.is_wide = (packed.detail >> 5) & 1;
+    result->address.displacement = packed.value;
+  } break;
+  case Operand_Immediate:
+  case Operand_RelativeImmediate: {
+    result->immediate_s32 = (int16_t)packed.value;
+  } break;
+  default:
+    break;
+  }
+
+  return true;
+}
+
+InstructionRecord PackInstruction(Instruction instruction) {
+  InstructionRecord result = {};
+  result.op = (uint8_t)instruction.op;
+  result.flags = (uint8_t)instruction.flags;
+  result.size = (uint16_t)instruction.size;
+  result.operands[0] = PackOperand(instruction.operands[0]);
+  result.operands[1] = PackOperand(instruction.operands[1]);
+
+  return result;
+}
+
+// Returns false if the record is corrupt: the file is mapped as is, and
+// the op, operand types, registers and bases index tables further on.
+bool UnpackInstruction(InstructionRecord record, uint64_t address,
+                       Instruction *result) {
+  *result = {};
+  if (record.op > Op_db ||
+      !UnpackOperand(record.operands[0], &result->operands[0]) ||
+      !UnpackOperand(record.operands[1], &result->operands[1])) {
+    return false;
+  }
+
+  result->address = address;
+  result->size = record.size;
+  result->op = (OpMnemonic)record.op;
+  result->flags = record.flags;
+  // Clocks are not stored, they follow from the op, operands and flags.
+  EstimateClocks(result);
+
+  return true;
+}
+
+// Streaming writer. Records go through `out`; the index is kept in memory and
+// the header is rewritten with the final counts when the file is closed, so
+// the output must be seekable.
+struct InstructionFileWriter {
+  OutputBuffer out;
+  InstructionFileHeader header;
+
+  uint64_t *index;
+  uint64_t index_count;
+  uint64_t index_capacity;
+};
+
+static uint64_t AlignUp8(uint64_t value) { return (value + 7) & ~7ull; }
+
+void BeginInstructionFile(InstructionFileWriter *writer, FILE *file,
+                          char const *source_name, uint64_t image_size) {
+  *writer = {};
+  writer->out = CreateOutputBuffer(file);
+
+  InstructionFileHeader *header = &writer->header;
+  header->magic = INSTRUCTION_FILE_MAGIC;
+  header->version = INSTRUCTION_FILE_VERSION;
+  header->record_size = sizeof(InstructionRecord);
+  header->image_size = image_size;
+  header->name_size = (uint32_t)strlen(source_name);
+  header->records_offset =
+      AlignUp8(sizeof(InstructionFileHeader) + header->name_size + 1);
+
+  uint8_t padding[8] = {};
+  WriteOutput(&writer->out, (uint8_t const *)header, sizeof(*header));
+  WriteOutput(&writer->out, (uint8_t const *)source_name, header->name_size);
+  WriteOutput(&writer->out, padding,
+              header->records_offset - sizeof(*header) - header->name_size);
+}
+
+void WriteInstructionRecords(InstructionFileWriter *writer,
+                             Instruction const *instructions, uint32_t count) {
+  InstructionFileHeader *header = &writer->header;
+  for (uint32_t instruction_idx = 0; instruction_idx < count;
+       ++instruction_idx) {
+    if (header->record_count % INSTRUCTION_FILE_INDEX_STRIDE == 0) {
+      if (writer->index_count == writer->index_capacity) {
+        writer->index_capacity =
+            writer->index_capacity ? 2 * writer->index_capacity : 1024;
+        writer->index = (uint64_t *)realloc(
+            writer->index, writer->index_capacity * sizeof(uint64_t));
+      }
+      writer->index[writer->index_count++] =
+          instructions[instruction_idx].address;
+    }
+
+    InstructionRecord record = PackInstruction(instructions[instruction_idx]);
+    ReserveOutput(&writer->out);
+    memcpy(writer->out.data + writer->out.size, &record, sizeof(record));
+    writer->out.size += sizeof(record);
+    ++header->record_count;
+  }
+}
+
+// Returns false if the header could not be rewritten.
+bool EndInstructionFile(InstructionFileWriter *writer) {
+  InstructionFileHeader *header = &writer->header;
+  uint64_t records_end =
+      header->records_offset + header->record_count * sizeof(InstructionRecord);
+  header->index_offset = AlignUp8(records_end);
+  uint8_t padding[8] = {};
+  WriteOutput(&writer->out, padding, header->index_offset - records_end);
+  WriteOutput(&writer->out, (uint8_t const *)writer->index,
+              writer->index_count * sizeof(uint64_t));
+  FlushOutput(&writer->out);
+
+  FILE *file = writer->out.file;
+  bool success = fseek(file, 0, SEEK_SET) == 0 &&
+                 fwrite(header, sizeof(*header), 1, file) == 1;
+  fflush(file);
+
+  free(writer->index);
+  DestroyOutputBuffer(&writer->out);
+  return success;
+}
+
+// Same contract as DisassembleImage, with records instead of text.
+bool WriteInstructionFile(Decoder const *decoder, uint8_t const *image,
+                          uint64_t image_size, char const *source_name,
+                          FILE *file, uint64_t *error_address) {
+  InstructionFileWriter writer;
+  BeginInstructionFile(&writer, file, source_name, image_size);
+
+  Instruction instructions[DISASSEMBLE_BATCH_SIZE];
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < image_size) {
+    uint32_t count;
+    uint64_t consumed;
+    status = DecodeInstructions(decoder, image + address, image_size - address,
+                                address, instructions, DISASSEMBLE_BATCH_SIZE,
+                                &count, &consumed);
+    WriteInstructionRecords(&writer, instructions, count);
+    address += consumed;
+  }
+
+  *error_address = address;
+  return EndInstructionFile(&writer) && status == Decode_Ok;
+}
+
+// A mapped instruction file. All pointers point into the mapping.
+struct InstructionFile {
+  InstructionFileHeader const *header;
+  char const *source_name;
+  InstructionRecord const *records;
+  uint64_t const *index;
+};
+
+// Returns false if the data is not an instruction file this version reads,
+// or its sections do not fit in `size`. The records are not checked, see
+// UnpackInstruction.
+bool OpenInstructionFile(uint8_t const *data, uint64_t size,
+                         InstructionFile *result) {
+  InstructionFileHeader const *header = (InstructionFileHeader const *)data;
+  if (size < sizeof(*header) || header->magic != INSTRUCTION_FILE_MAGIC ||
+      header->version != INSTRUCTION_FILE_VERSION ||
+      header->record_size != sizeof(InstructionRecord)) {
+    return false;
+  }
+
+  // Each offset is checked against the end of the file before anything is
+  // derived from it, so that nothing wraps around.
+  uint64_t records_offset = header->records_offset;
+  uint64_t record_count = header->record_count;
+  uint64_t name_end =
+      AlignUp8(sizeof(*header) + (uint64_t)header->name_size + 1);
+  if (records_offset < name_end || records_offset > size ||
+      records_offset % 8 != 0 ||
+      record_count > (size - records_offset) / sizeof(InstructionRecord)) {
+    return false;
+  }
+
+  uint64_t index_offset = AlignUp8(
+      records_offset + record_count * sizeof(InstructionRecord));
+  uint64_t index_count =
+      (record_count + INSTRUCTION_FILE_INDEX_STRIDE - 1) /
+      INSTRUCTION_FILE_INDEX_STRIDE;
+  if (header->index_offset != index_offset || index_offset > size ||
+      index_count > (size - index_offset) / sizeof(uint64_t) ||
+      data[sizeof(*header) + header->name_size] != 0) {
+    return false;
+  }
+
+  result->header = header;
+  result->source_name = (char const *)(data + sizeof(*header));
+  result->records = (InstructionRecord const *)(data + header->records_offset);
+  result->index = (uint64_t const *)(data + header->index_offset);
+  return true;
+}
+
+uint64_t GetRecordAddress(InstructionFile const *file, uint64_t record_idx) {
+  uint64_t block_start = record_idx - record_idx % INSTRUCTION_FILE_INDEX_STRIDE;
+  uint64_t result = file->index[block_start / INSTRUCTION_FILE_INDEX_STRIDE];
+  for (uint64_t idx = block_start; idx < record_idx; ++idx) {
+    result += file->records[idx].size;
+  }
+
+  return result;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "stdint.h"
+
+#include "opcode.h"
+
+// Binary instruction stream, the decoded counterpart of the text disassembly.
+//
+// Layout, all little-endian:
+//   InstructionFileHeader
+//   source name (name_size bytes, zero terminated and padded to a multiple
+//   of 8)
+//   InstructionRecord[record_count]                    at records_offset
+//   padding to a multiple of 8
+//   uint64_t address[ceil(record_count / INSTRUCTION_FILE_INDEX_STRIDE)]
+//                                                      at index_offset
+//
+// Records have a fixed size, so record i is at records_offset + i * 12. The
+// address index holds the image address of every INSTRUCTION_FILE_INDEX_STRIDE
+// th record; the address of any other record is its block's entry plus the
+// sizes of the records before it in the block.
+
+#define INSTRUCTION_FILE_MAGIC 0x44363849 // "I86D"
+#define INSTRUCTION_FILE_VERSION 3
+#define INSTRUCTION_FILE_INDEX_STRIDE 256
+
+struct InstructionFileHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint64_t record_count;
+  uint64_t image_size;
+  uint64_t records_offset;
+  uint64_t index_offset;
+  uint32_t name_size;
+  uint32_t reserved;
+};
+
+// Register:  detail = RegisterName | (size == 2) << 4 | offset << 5
+// Memory:    detail = EffectiveAddressBase | has_displacement << 4 |
+//                     is_wide << 5, value = displacement
+// Immediate and RelativeImmediate: value = immediate, sign-extended on load
+struct PackedOperand {
+  uint8_t type;
+  uint8_t detail;
+  uint16_t value;
+};
+
+struct InstructionRecord {
+  uint8_t op;
+  uint8_t flags;
+  uint16_t size;
+  PackedOperand operands[2];
+};
+
+static_assert(sizeof(InstructionFileHeader) == 48, "header layout");
+static_assert(sizeof(InstructionRecord) == 12, "record layout");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "instruction files are written in host byte order"
+#endif
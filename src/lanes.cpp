@@ -0,0 +1,541 @@
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include <immintrin.h>
+
+// Runs one program on LANE_COUNT independent 8086 states in lockstep, for
+// sweeps over register and memory seeds. Needs AVX2.
+//
+// Registers and flags are stored as structure of arrays, one 16-bit
+// element per lane, so each register is one 256-bit vector. Every step
+// picks the lowest ip among the running lanes and executes the instruction
+// there on the lanes at that ip, the active lanes: register results and
+// flags are computed for all lanes and blended in under the active mask.
+// Lanes whose jumps diverge wait at their own ip until the lowest ip
+// catches up, which reconverges them at the join point of forward branches
+// and loops.
+//
+// Each lane has its own 1 MiB of memory. Memory operands compute their
+// addresses in vectors and then load and store lane by lane: AVX2 has no
+// scatter, and a gather would still need the 64 KiB and 1 MiB wrap fixups.
+//
+// The decoded program is shared, so a lane that stores into it stops with
+// Simulate_CodeModified; run that seed on the scalar engine instead.
+
+#define LANE_COUNT 16
+
+struct LaneSimulator {
+  alignas(32) uint16_t registers[Register_count][LANE_COUNT];
+  alignas(32) uint16_t flags[LANE_COUNT];
+  alignas(32) uint32_t instruction_counts[LANE_COUNT];
+  // SimulateStatus of each lane, once it stops running.
+  uint8_t status[LANE_COUNT];
+  // Bit per lane.
+  uint32_t running_lanes;
+
+  // LANE_COUNT memories of SIMULATOR_MEMORY_SIZE bytes.
+  uint8_t *memory;
+  // Copy of the program, which the decode cache is built from.
+  uint8_t *code;
+  uint32_t code_base;
+  uint32_t code_size;
+  Instruction *decode_cache;
+
+  // Per lane, 0 for no limit.
+  uint32_t instruction_limit;
+  // Instructions executed by all lanes, and the steps that executed them.
+  uint64_t instruction_count;
+  uint64_t step_count;
+};
+
+void InitLaneSimulator(LaneSimulator *simulator) {
+  *simulator = {};
+  simulator->memory =
+      (uint8_t *)calloc((size_t)LANE_COUNT * SIMULATOR_MEMORY_SIZE, 1);
+  simulator->code = (uint8_t *)malloc(SIMULATOR_MAX_CODE_SIZE);
+  simulator->decode_cache =
+      (Instruction *)calloc(SIMULATOR_MAX_CODE_SIZE, sizeof(Instruction));
+}
+
+void DestroyLaneSimulator(LaneSimulator *simulator) {
+  free(simulator->decode_cache);
+  free(simulator->code);
+  free(simulator->memory);
+  *simulator = {};
+}
+
+inline uint8_t *GetLaneMemory(LaneSimulator *simulator, uint32_t lane) {
+  return simulator->memory + (size_t)lane * SIMULATOR_MEMORY_SIZE;
+}
+
+// Copies the program to cs:0 of every lane, with cs taken from lane 0, and
+// starts all lanes. Returns false if it does not fit.
+bool LoadLaneProgram(LaneSimulator *simulator, uint8_t const *code,
+                     uint64_t size) {
+  uint32_t base = GetPhysicalAddress(simulator->registers[Register_cs][0], 0);
+  if (size > SIMULATOR_MAX_CODE_SIZE || base + size > SIMULATOR_MEMORY_SIZE) {
+    return false;
+  }
+
+  for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+    simulator->registers[Register_cs][lane] =
+        simulator->registers[Register_cs][0];
+    memcpy(GetLaneMemory(simulator, lane) + base, code, size);
+    simulator->status[lane] = Simulate_Halted;
+  }
+  memcpy(simulator->code, code, size);
+  memset(simulator->decode_cache, 0,
+         SIMULATOR_MAX_CODE_SIZE * sizeof(Instruction));
+  simulator->code_base = base;
+  simulator->code_size = (uint32_t)size;
+  simulator->running_lanes = (1u << LANE_COUNT) - 1;
+  return true;
+}
+
+inline __m256i LoadLanes(uint16_t const *values) {
+  return _mm256_load_si256((__m256i const *)values);
+}
+
+inline void StoreLanes(uint16_t *values, __m256i vector) {
+  _mm256_store_si256((__m256i *)values, vector);
+}
+
+// Bit per lane of a vector mask.
+inline uint32_t GetLaneBits(__m256i mask) {
+  __m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(mask),
+                                  _mm256_extracti128_si256(mask, 1));
+  return (uint32_t)_mm_movemask_epi8(bytes);
+}
+
+inline __m256i GetLaneMask(uint32_t lanes) {
+  __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512,
+                                   1024, 2048, 4096, 8192, 16384, -32768);
+  __m256i selected = _mm256_and_si256(_mm256_set1_epi16((int16_t)lanes), bits);
+  return _mm256_cmpeq_epi16(selected, bits);
+}
+
+// Per-lane segment and offset of a memory operand.
+static void GetLaneAddresses(LaneSimulator *simulator, EffectiveAddress address,
+                             uint16_t *segments, uint16_t *offsets) {
+  uint16_t(*registers)[LANE_COUNT] = simulator->registers;
+  __m256i base = _mm256_setzero_si256();
+  RegisterName segment = Register_ds;
+  switch (address.base) {
+  case EffectiveAddress_bx_si: {
+    base = _mm256_add_epi16(LoadLanes(registers[Register_b]),
+                            LoadLanes(registers[Register_si]));
+  } break;
+  case EffectiveAddress_bx_di: {
+    base = _mm256_add_epi16(LoadLanes(registers[Register_b]),
+                            LoadLanes(registers[Register_di]));
+  } break;
+  case EffectiveAddress_bp_si: {
+    base = _mm256_add_epi16(LoadLanes(registers[Register_bp]),
+                            LoadLanes(registers[Register_si]));
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_bp_di: {
+    base = _mm256_add_epi16(LoadLanes(registers[Register_bp]),
+                            LoadLanes(registers[Register_di]));
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_si: {
+    base = LoadLanes(registers[Register_si]);
+  } break;
+  case EffectiveAddress_di: {
+    base = LoadLanes(registers[Register_di]);
+  } break;
+  case EffectiveAddress_bp: {
+    base = LoadLanes(registers[Register_bp]);
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_bx: {
+    base = LoadLanes(registers[Register_b]);
+  } break;
+  default:
+    break;
+  }
+
+  base = _mm256_add_epi16(base,
+                          _mm256_set1_epi16((int16_t)address.displacement));
+  StoreLanes(offsets, base);
+  memcpy(segments, registers[segment], LANE_COUNT * sizeof(uint16_t));
+}
+
+static __m256i ReadLaneOperand(LaneSimulator *simulator, Operand *operand,
+                               bool is_wide, uint32_t lanes) {
+  switch (operand->type) {
+  case Operand_Register: {
+    __m256i word = LoadLanes(simulator->registers[operand->reg.name]);
+    if (operand->reg.size == 2) {
+      return word;
+    }
+    if (operand->reg.offset) {
+      word = _mm256_srli_epi16(word, 8);
+    }
+    return _mm256_and_si256(word, _mm256_set1_epi16(0xff));
+  }
+  case Operand_Memory: {
+    alignas(32) uint16_t segments[LANE_COUNT];
+    alignas(32) uint16_t offsets[LANE_COUNT];
+    alignas(32) uint16_t values[LANE_COUNT] = {};
+    GetLaneAddresses(simulator, operand->address, segments, offsets);
+    for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+      if (!(lanes & (1u << lane))) {
+        continue;
+      }
+      uint8_t *memory = GetLaneMemory(simulator, lane);
+      values[lane] = memory[GetPhysicalAddress(segments[lane], offsets[lane])];
+      if (is_wide) {
+        uint16_t high_offset = (uint16_t)(offsets[lane] + 1);
+        values[lane] |= memory[GetPhysicalAddress(segments[lane], high_offset)]
+                        << 8;
+      }
+    }
+    return LoadLanes(values);
+  }
+  case Operand_Immediate:
+  case Operand_RelativeImmediate: {
+    return _mm256_set1_epi16((int16_t)operand->immediate_s32);
+  }
+  default:
+    return _mm256_setzero_si256();
+  }
+}
+
+// Returns the lanes that stored into the program.
+static uint32_t StoreLaneMemory(LaneSimulator *simulator, Operand *operand,
+                                __m256i value, bool is_wide, uint32_t lanes) {
+  alignas(32) uint16_t segments[LANE_COUNT];
+  alignas(32) uint16_t offsets[LANE_COUNT];
+  alignas(32) uint16_t values[LANE_COUNT];
+  GetLaneAddresses(simulator, operand->address, segments, offsets);
+  StoreLanes(values, value);
+
+  uint32_t result = 0;
+  for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+    if (!(lanes & (1u << lane))) {
+      continue;
+    }
+    uint8_t *memory = GetLaneMemory(simulator, lane);
+    for (uint32_t byte_idx = 0; byte_idx < (is_wide ? 2u : 1u); ++byte_idx) {
+      uint32_t physical = GetPhysicalAddress(
+          segments[lane], (uint16_t)(offsets[lane] + byte_idx));
+      memory[physical] = (uint8_t)(values[lane] >> (8 * byte_idx));
+      uint32_t address =
+          (physical - simulator->code_base) & (SIMULATOR_MEMORY_SIZE - 1);
+      if (address < simulator->code_size) {
+        result |= 1u << lane;
+      }
+    }
+  }
+
+  return result;
+}
+
+// Returns the lanes that stored into the program.
+static uint32_t WriteLaneOperand(LaneSimulator *simulator, Operand *operand,
+                                 __m256i value, bool is_wide, __m256i active,
+                                 uint32_t lanes) {
+  if (operand->type == Operand_Memory) {
+    return StoreLaneMemory(simulator, operand, value, is_wide, lanes);
+  }
+  if (operand->type != Operand_Register) {
+    return 0;
+  }
+
+  uint16_t *word = simulator->registers[operand->reg.name];
+  __m256i old = LoadLanes(word);
+  __m256i result = value;
+  if (operand->reg.size == 1) {
+    __m256i byte = _mm256_and_si256(value, _mm256_set1_epi16(0xff));
+    __m256i keep = _mm256_set1_epi16((int16_t)0xff00);
+    if (operand->reg.offset) {
+      byte = _mm256_slli_epi16(byte, 8);
+      keep = _mm256_set1_epi16(0xff);
+    }
+    result = _mm256_or_si256(_mm256_and_si256(old, keep), byte);
+  }
+  StoreLanes(word, _mm256_blendv_epi8(old, result, active));
+  return 0;
+}
+
+inline __m256i IsLaneNonZero(__m256i value) {
+  return _mm256_xor_si256(_mm256_cmpeq_epi16(value, _mm256_setzero_si256()),
+                          _mm256_set1_epi16(-1));
+}
+
+// The flags of `a op b` in every lane, as GetArithmeticFlags computes them
+// for one.
+static __m256i GetLaneArithmeticFlags(OpMnemonic op, __m256i a, __m256i b,
+                                      __m256i result, bool is_wide) {
+  __m256i mask = _mm256_set1_epi16(is_wide ? (int16_t)0xffff : 0xff);
+  __m256i sign = _mm256_set1_epi16(is_wide ? (int16_t)0x8000 : 0x80);
+  bool is_add = op == Op_add;
+
+  // a > result for add, b > a for sub and cmp, on the masked values.
+  __m256i masked = _mm256_and_si256(result, mask);
+  __m256i carry =
+      is_add ? _mm256_xor_si256(
+                   _mm256_cmpeq_epi16(_mm256_max_epu16(masked, a), masked),
+                   _mm256_set1_epi16(-1))
+             : _mm256_xor_si256(
+                   _mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a),
+                   _mm256_set1_epi16(-1));
+
+  __m256i parity = _mm256_and_si256(result, _mm256_set1_epi16(0xff));
+  parity = _mm256_xor_si256(parity, _mm256_srli_epi16(parity, 4));
+  parity = _mm256_xor_si256(parity, _mm256_srli_epi16(parity, 2));
+  parity = _mm256_xor_si256(parity, _mm256_srli_epi16(parity, 1));
+  __m256i odd_parity = _mm256_and_si256(parity, _mm256_set1_epi16(1));
+
+  __m256i auxiliary = _mm256_and_si256(
+      _mm256_xor_si256(_mm256_xor_si256(a, b), result),
+      _mm256_set1_epi16(0x10));
+  __m256i zero = _mm256_cmpeq_epi16(masked, _mm256_setzero_si256());
+  __m256i negative = IsLaneNonZero(_mm256_and_si256(result, sign));
+  __m256i a_xor_b = _mm256_xor_si256(a, b);
+  __m256i overflow = _mm256_and_si256(
+      _mm256_and_si256(is_add ? _mm256_xor_si256(a_xor_b, mask) : a_xor_b,
+                       _mm256_xor_si256(a, result)),
+      sign);
+  overflow = IsLaneNonZero(overflow);
+
+  __m256i flags = _mm256_and_si256(carry, _mm256_set1_epi16(Flag_CF));
+  flags = _mm256_or_si256(
+      flags, _mm256_andnot_si256(_mm256_slli_epi16(odd_parity, 2),
+                                 _mm256_set1_epi16(Flag_PF)));
+  flags = _mm256_or_si256(flags, auxiliary);
+  flags = _mm256_or_si256(flags,
+                          _mm256_and_si256(zero, _mm256_set1_epi16(Flag_ZF)));
+  flags = _mm256_or_si256(
+      flags, _mm256_and_si256(negative, _mm256_set1_epi16(Flag_SF)));
+  flags = _mm256_or_si256(
+      flags, _mm256_and_si256(overflow, _mm256_set1_epi16(Flag_OF)));
+  return flags;
+}
+
+inline __m256i GetLaneFlag(__m256i flags, FlagBit flag) {
+  __m256i bit = _mm256_set1_epi16((int16_t)flag);
+  return _mm256_cmpeq_epi16(_mm256_and_si256(flags, bit), bit);
+}
+
+// The lanes where the jump is taken, as IsJumpTaken decides for one. The
+// loops decrement cx in the active lanes.
+static __m256i GetLaneJumpsTaken(LaneSimulator *simulator, OpMnemonic op,
+                                 __m256i active) {
+  __m256i flags = LoadLanes(simulator->flags);
+  __m256i all = _mm256_set1_epi16(-1);
+  __m256i zero = GetLaneFlag(flags, Flag_ZF);
+  __m256i less = _mm256_xor_si256(GetLaneFlag(flags, Flag_SF),
+                                  GetLaneFlag(flags, Flag_OF));
+  __m256i carry = GetLaneFlag(flags, Flag_CF);
+  switch (op) {
+  case Op_je:
+    return zero;
+  case Op_jl:
+    return less;
+  case Op_jle:
+    return _mm256_or_si256(zero, less);
+  case Op_jb:
+    return carry;
+  case Op_jbe:
+    return _mm256_or_si256(carry, zero);
+  case Op_jp:
+    return GetLaneFlag(flags, Flag_PF);
+  case Op_jo:
+    return GetLaneFlag(flags, Flag_OF);
+  case Op_js:
+    return GetLaneFlag(flags, Flag_SF);
+  case Op_jne:
+    return _mm256_xor_si256(zero, all);
+  case Op_jnl:
+    return _mm256_xor_si256(less, all);
+  case Op_jg:
+    return _mm256_xor_si256(_mm256_or_si256(zero, less), all);
+  case Op_jnb:
+    return _mm256_xor_si256(carry, all);
+  case Op_ja:
+    return _mm256_xor_si256(_mm256_or_si256(carry, zero), all);
+  case Op_jnp:
+    return _mm256_xor_si256(GetLaneFlag(flags, Flag_PF), all);
+  case Op_jno:
+    return _mm256_xor_si256(GetLaneFlag(flags, Flag_OF), all);
+  case Op_jns:
+    return _mm256_xor_si256(GetLaneFlag(flags, Flag_SF), all);
+  default:
+    break;
+  }
+
+  uint16_t *cx = simulator->registers[Register_c];
+  __m256i count = LoadLanes(cx);
+  if (op == Op_jcxz) {
+    return _mm256_cmpeq_epi16(count, _mm256_setzero_si256());
+  }
+
+  // Subtracting the active mask adds one there.
+  count = _mm256_add_epi16(count, active);
+  StoreLanes(cx, count);
+  __m256i is_counting = IsLaneNonZero(count);
+  switch (op) {
+  case Op_loop:
+    return is_counting;
+  case Op_loopz:
+    return _mm256_and_si256(is_counting, zero);
+  case Op_loopnz:
+    return _mm256_andnot_si256(zero, is_counting);
+  default:
+    return _mm256_setzero_si256();
+  }
+}
+
+static Instruction *FetchLaneInstruction(LaneSimulator *simulator,
+                                         Decoder const *decoder,
+                                         uint16_t address) {
+  Instruction *result = &simulator->decode_cache[address];
+  if (!result->size) {
+    DecodeStatus status =
+        DecodeInstruction(decoder, simulator->code + address,
+                          simulator->code_size - address, address, result);
+    Operand destination = result->operands[0];
+    bool writes_cs = destination.type == Operand_Register &&
+                     destination.reg.name == Register_cs;
+    if (status != Decode_Ok || result->op == Op_db || writes_cs) {
+      result->size = 0;
+      return 0;
+    }
+  }
+
+  return result;
+}
+
+static void StopLanes(LaneSimulator *simulator, uint32_t lanes,
+                      SimulateStatus status) {
+  lanes &= simulator->running_lanes;
+  if (!lanes) {
+    return;
+  }
+  for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+    if (lanes & (1u << lane)) {
+      simulator->status[lane] = (uint8_t)status;
+    }
+  }
+  simulator->running_lanes &= ~lanes;
+}
+
+// Executes the instruction at the lowest ip of the running lanes.
+static void StepLanes(LaneSimulator *simulator, Decoder const *decoder) {
+  uint16_t *ips = simulator->registers[Register_is];
+  __m256i ip = LoadLanes(ips);
+  __m256i running = GetLaneMask(simulator->running_lanes);
+  // Stopped lanes do not take part in the minimum.
+  __m256i candidates = _mm256_or_si256(ip, _mm256_xor_si256(
+                                               running, _mm256_set1_epi16(-1)));
+  __m128i low = _mm_minpos_epu16(_mm256_castsi256_si128(candidates));
+  __m128i high = _mm_minpos_epu16(_mm256_extracti128_si256(candidates, 1));
+  uint16_t address = (uint16_t)_mm_cvtsi128_si32(_mm_min_epu16(low, high));
+
+  __m256i active = _mm256_and_si256(
+      _mm256_cmpeq_epi16(ip, _mm256_set1_epi16((int16_t)address)), running);
+  uint32_t lanes = GetLaneBits(active);
+
+  Instruction *instruction = FetchLaneInstruction(simulator, decoder, address);
+  if (!instruction) {
+    StopLanes(simulator, lanes, Simulate_UnknownInstruction);
+    return;
+  }
+
+  uint16_t next_address = (uint16_t)(address + instruction->size);
+  __m256i next_ip = _mm256_set1_epi16((int16_t)next_address);
+  bool is_wide = instruction->flags & Inst_Wide;
+  Operand *destination = &instruction->operands[0];
+  Operand *source = &instruction->operands[1];
+  uint32_t modifying_lanes = 0;
+  switch (instruction->op) {
+  case Op_mov: {
+    modifying_lanes = WriteLaneOperand(
+        simulator, destination,
+        ReadLaneOperand(simulator, source, is_wide, lanes), is_wide, active,
+        lanes);
+  } break;
+  case Op_add:
+  case Op_sub:
+  case Op_cmp: {
+    __m256i mask = _mm256_set1_epi16(is_wide ? (int16_t)0xffff : 0xff);
+    __m256i a = _mm256_and_si256(
+        ReadLaneOperand(simulator, destination, is_wide, lanes), mask);
+    __m256i b = _mm256_and_si256(
+        ReadLaneOperand(simulator, source, is_wide, lanes), mask);
+    __m256i result = instruction->op == Op_add ? _mm256_add_epi16(a, b)
+                                               : _mm256_sub_epi16(a, b);
+
+    __m256i flags =
+        GetLaneArithmeticFlags(instruction->op, a, b, result, is_wide);
+    StoreLanes(simulator->flags,
+               _mm256_blendv_epi8(LoadLanes(simulator->flags), flags, active));
+    if (instruction->op != Op_cmp) {
+      modifying_lanes = WriteLaneOperand(simulator, destination, result,
+                                         is_wide, active, lanes);
+    }
+  } break;
+  default: {
+    __m256i taken = _mm256_and_si256(
+        GetLaneJumpsTaken(simulator, instruction->op, active), active);
+    __m256i target = _mm256_set1_epi16(
+        (int16_t)(next_address + destination->immediate_s32));
+    next_ip = _mm256_blendv_epi8(next_ip, target, taken);
+  } break;
+  }
+
+  ip = _mm256_blendv_epi8(ip, next_ip, active);
+  StoreLanes(ips, ip);
+
+  __m256i counts_low =
+      _mm256_load_si256((__m256i *)simulator->instruction_counts);
+  __m256i counts_high =
+      _mm256_load_si256((__m256i *)(simulator->instruction_counts + 8));
+  counts_low = _mm256_sub_epi32(
+      counts_low, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(active)));
+  counts_high = _mm256_sub_epi32(
+      counts_high, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(active, 1)));
+  _mm256_store_si256((__m256i *)simulator->instruction_counts, counts_low);
+  _mm256_store_si256((__m256i *)(simulator->instruction_counts + 8),
+                     counts_high);
+  simulator->instruction_count += _mm_popcnt_u32(lanes);
+  ++simulator->step_count;
+
+  StopLanes(simulator, modifying_lanes, Simulate_CodeModified);
+
+  // ip >= code_size, done as ip > code_size - 1 so 64 KiB programs never
+  // halt this way.
+  if (simulator->code_size) {
+    __m256i last = _mm256_set1_epi16((int16_t)(simulator->code_size - 1));
+    __m256i is_inside = _mm256_cmpeq_epi16(_mm256_min_epu16(ip, last), ip);
+    StopLanes(simulator, lanes & ~GetLaneBits(is_inside), Simulate_Halted);
+  }
+
+  uint32_t limit = simulator->instruction_limit;
+  if (limit) {
+    // counts > limit - 1, unsigned.
+    __m256i last = _mm256_set1_epi32((int32_t)(limit - 1));
+    __m256i is_below_low = _mm256_cmpeq_epi32(
+        _mm256_min_epu32(counts_low, last), counts_low);
+    __m256i is_below_high = _mm256_cmpeq_epi32(
+        _mm256_min_epu32(counts_high, last), counts_high);
+    __m256i is_below = _mm256_permute4x64_epi64(
+        _mm256_packs_epi32(is_below_low, is_below_high), 0xd8);
+    StopLanes(simulator, lanes & ~GetLaneBits(is_below),
+              Simulate_LimitReached);
+  }
+}
+
+// Runs until every lane has stopped; each lane's reason is in status.
+void RunLaneSimulator(LaneSimulator *simulator, Decoder const *decoder) {
+  if (!simulator->code_size) {
+    simulator->running_lanes = 0;
+  }
+  while (simulator->running_lanes) {
+    StepLanes(simulator, decoder);
+  }
+}
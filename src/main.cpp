@@ -4,38 +4,442 @@
 #include "stdlib.h"
 #include "string.h"
 
-#include "decode.cpp"
+#include "decoder.h"
+#include "print.cpp"
+#include "platform_file.cpp"
+#include "platform_metrics.cpp"
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("needs a file");
+#include "batch.cpp"
+#include "instruction_file.cpp"
+#include "parallel.cpp"
+#include "pipeline.cpp"
+#include "cfg.cpp"
+#include "simulate.cpp"
+#include "block.cpp"
+#include "snapshot.cpp"
+#include "history.cpp"
+#include "bus.cpp"
+
+struct ExecOptions {
+  bool use_blocks;
+  // 0 for no limit.
+  uint64_t instruction_limit;
+  char const *dump_path;
+  // Instructions to step back after the run.
+  uint64_t back_count;
+  // Address to run back to after the run, -1 for none.
+  int32_t back_address;
+  // Time with a bus model instead of the table clocks, tracing each
+  // instruction.
+  bool use_bus_model;
+  BusModelKind bus_model;
+};
+
+// Steps back as asked by the options. The history stats go to stderr.
+static void RunBack(Simulator *simulator, History *history,
+                    Decoder const *decoder, ExecOptions const *options) {
+  uint64_t start = ReadOSTimer();
+  uint64_t stepped_count = 0;
+  while (stepped_count < options->back_count &&
+         StepBack(history, simulator, decoder)) {
+    ++stepped_count;
+  }
+  if (options->back_address >= 0 &&
+      !RunBackToAddress(history, simulator, decoder,
+                        (uint16_t)options->back_address)) {
+    fprintf(stderr, "ip %d was never executed.\n", options->back_address);
+  }
+  double seconds = SecondsElapsed(start, ReadOSTimer());
+
+  fprintf(stderr,
+          "Stepped back to instruction %llu in %.6fs (%llu replayed), "
+          "%u checkpoints\n",
+          (unsigned long long)simulator->instruction_count, seconds,
+          (unsigned long long)history->replay_count,
+          history->checkpoint_count);
+}
+
+// Simulates the program and prints the final registers. The simulation
+// speed goes to stderr so the register dump can be diffed.
+static int RunProgram(Decoder const *decoder, char const *filename,
+                      uint8_t const *code, uint64_t size,
+                      ExecOptions const *options) {
+  Simulator simulator;
+  InitSimulator(&simulator);
+  simulator.instruction_limit = options->instruction_limit;
+  if (!LoadProgram(&simulator, code, size)) {
+    fprintf(stderr, "ERROR: %s does not fit in memory.\n", filename);
+    DestroySimulator(&simulator);
     return -1;
   }
 
-  uint32_t buffer_size = 1024 * 1024;
-  uint8_t *buffer = (uint8_t *)malloc(buffer_size);
-  uint32_t byte_read;
+  // The bus model needs the trace, which is only done by the fetch loop.
+  bool use_bus_model = options->use_bus_model;
+  bool use_history = !use_bus_model &&
+                     (options->back_count || options->back_address >= 0);
+  bool use_blocks = options->use_blocks && !use_bus_model;
+  BusModel bus_model;
+  InitBusModel(&bus_model, options->bus_model, 0);
+  OutputBuffer trace = {};
+  if (use_bus_model) {
+    trace = CreateOutputBuffer(stdout);
+    printf("--- %s execution ---\n", filename);
+  }
+  History history = {};
+  if (use_history) {
+    InitHistory(&history, &simulator, 0);
+  }
 
-  char *filename = argv[1];
-  FILE *file = {};
-  if (fopen_s(&file, filename, "rb") == 0) {
-    byte_read = fread(buffer, 1, buffer_size, file);
-    fclose(file);
+  BlockCache blocks;
+  InitBlockCache(&blocks);
+  uint64_t start = ReadOSTimer();
+  SimulateStatus status =
+      use_bus_model
+          ? RunSimulatorTimed(&simulator, &bus_model, decoder, &trace)
+      : use_history ? RunSimulatorRecorded(&simulator, &history,
+                                           use_blocks ? &blocks : 0, decoder)
+      : use_blocks  ? RunSimulatorBlocks(&simulator, &blocks, decoder)
+                    : RunSimulator(&simulator, decoder);
+  double seconds = SecondsElapsed(start, ReadOSTimer());
+  uint64_t instruction_count = simulator.instruction_count;
+  if (use_history) {
+    RunBack(&simulator, &history, decoder, options);
+  }
+
+  if (use_bus_model) {
+    DestroyOutputBuffer(&trace);
   } else {
+    printf("--- %s execution ---\n", filename);
+  }
+  PrintRegisters(stdout, &simulator);
+  fprintf(stderr,
+          "%llu instructions (%llu decoded) in %.4fs (%.2f M instructions/s)\n",
+          (unsigned long long)instruction_count,
+          (unsigned long long)simulator.decode_count, seconds,
+          seconds > 0 ? instruction_count / seconds / 1e6 : 0);
+
+  fprintf(stderr, "%llu clocks\n", (unsigned long long)simulator.clocks);
+  if (use_bus_model) {
+    fprintf(stderr,
+            "%llu clocks on the %s bus model, %llu waiting for code, %llu "
+            "queue flushes\n",
+            (unsigned long long)bus_model.clock,
+            options->bus_model == BusModel_8088 ? "8088" : "8086",
+            (unsigned long long)bus_model.wait_clocks,
+            (unsigned long long)bus_model.flush_count);
+  }
+  if (use_blocks) {
+    fprintf(stderr, "%llu blocks translated\n",
+            (unsigned long long)blocks.translation_count);
+  }
+  fprintf(stderr, "%u dirty pages\n", GetDirtyPageCount(&simulator));
+
+  int result = 0;
+  if (status == Simulate_UnknownInstruction) {
+    uint16_t ip = simulator.registers[Register_is];
+    fprintf(stderr, "ERROR: unknown instruction at ip %u.\n", ip);
+    result = -1;
+  } else if (status == Simulate_LimitReached) {
+    fprintf(stderr, "Stopped after %llu instructions.\n",
+            (unsigned long long)instruction_count);
+  }
+
+  if (options->dump_path) {
+    FILE *file = fopen(options->dump_path, "wb");
+    if (!file || !WriteMemoryDump(file, &simulator)) {
+      fprintf(stderr, "ERROR: Unable to write %s.\n", options->dump_path);
+      result = -1;
+    }
+    if (file) {
+      fclose(file);
+    }
+  }
+  DestroyHistory(&history);
+  DestroyBlockCache(&blocks);
+  DestroySimulator(&simulator);
+  return result;
+}
+
+#define VERIFY_MAX_REPORTS 16
+// Room for the longest run of db.
+#define VERIFY_BUFFER_SIZE 0x10000
+
+// Encodes every decoded instruction back and compares it with the bytes it
+// was decoded from, reporting the first mismatches to stderr. Returns the
+// number of mismatches, with an instruction that does not decode as one.
+static uint64_t VerifyRoundTrip(Decoder const *decoder, uint8_t const *image,
+                                uint64_t image_size) {
+  Instruction instructions[DISASSEMBLE_BATCH_SIZE];
+  uint8_t *bytes = (uint8_t *)malloc(VERIFY_BUFFER_SIZE);
+  uint64_t instruction_count = 0;
+  uint64_t mismatch_count = 0;
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < image_size) {
+    uint32_t count;
+    uint64_t consumed;
+    status = DecodeInstructions(decoder, image + address, image_size - address,
+                                address, instructions, DISASSEMBLE_BATCH_SIZE,
+                                &count, &consumed);
+    for (uint32_t instruction_idx = 0; instruction_idx < count;
+         ++instruction_idx) {
+      Instruction *instruction = &instructions[instruction_idx];
+      uint32_t size = EncodeInstruction(instruction, bytes, VERIFY_BUFFER_SIZE);
+      if (size != instruction->size ||
+          memcmp(bytes, image + instruction->address, size) != 0) {
+        if (mismatch_count < VERIFY_MAX_REPORTS) {
+          fprintf(stderr, "Mismatch at %llu:",
+                  (unsigned long long)instruction->address);
+          for (uint32_t byte_idx = 0;
+               byte_idx < instruction->size && byte_idx < 8; ++byte_idx) {
+            fprintf(stderr, " %02x", image[instruction->address + byte_idx]);
+          }
+          fprintf(stderr, " encodes back as");
+          for (uint32_t byte_idx = 0; byte_idx < size && byte_idx < 8;
+               ++byte_idx) {
+            fprintf(stderr, " %02x", bytes[byte_idx]);
+          }
+          fprintf(stderr, "\n");
+        }
+        ++mismatch_count;
+      }
+    }
+    instruction_count += count;
+    address += consumed;
+  }
+  free(bytes);
+
+  if (status != Decode_Ok) {
+    fprintf(stderr, "Unknown instruction at %llu.\n",
+            (unsigned long long)address);
+    ++mismatch_count;
+  }
+  fprintf(stderr, "%llu instructions checked, %llu mismatches\n",
+          (unsigned long long)instruction_count,
+          (unsigned long long)mismatch_count);
+  return mismatch_count;
+}
+
+// DisassembleImage with labels: the whole image is decoded first and a
+// control flow graph built over it. The graph stats go to stderr.
+static bool DisassembleLabeled(Decoder const *decoder, uint8_t const *image,
+                               uint64_t image_size, OutputBuffer *out,
+                               uint64_t *error_address,
+                               uint64_t *total_clocks) {
+  Instruction *instructions;
+  uint64_t instruction_count;
+  bool success = DecodeImage(decoder, image, image_size, &instructions,
+                             &instruction_count, error_address);
+
+  uint64_t start = ReadOSTimer();
+  ControlFlowGraph cfg;
+  BuildControlFlowGraph(&cfg, instructions, instruction_count, image_size);
+  double seconds = SecondsElapsed(start, ReadOSTimer());
+  fprintf(stderr,
+          "%llu instructions, %u blocks, %u edges, %u labels, %llu "
+          "unresolved jumps in %.4fs\n",
+          (unsigned long long)instruction_count, cfg.block_count,
+          cfg.edge_count, cfg.label_count,
+          (unsigned long long)cfg.unresolved_count, seconds);
+
+  PrintLabeledInstructions(&cfg, out, total_clocks);
+  DestroyControlFlowGraph(&cfg);
+  free(instructions);
+  return success;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t thread_count = 1;
+  bool is_pipelined = false;
+  bool is_batch = false;
+  bool is_exec = false;
+  bool show_clocks = false;
+  bool show_labels = false;
+  bool is_verify = false;
+  ExecOptions exec_options = {};
+  exec_options.use_blocks = true;
+  exec_options.back_address = -1;
+  uint32_t decoder_flags = Decoder_EmitData;
+  char *output_directory = 0;
+  char *binary_path = 0;
+  char **inputs = (char **)malloc(argc * sizeof(char *));
+  uint32_t input_count = 0;
+  bool is_usage_error = false;
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    if (strcmp(argv[arg_idx], "-j") == 0 && arg_idx + 1 < argc) {
+      thread_count = atoi(argv[++arg_idx]);
+    } else if (strcmp(argv[arg_idx], "-o") == 0 && arg_idx + 1 < argc) {
+      output_directory = argv[++arg_idx];
+    } else if (strcmp(argv[arg_idx], "--binary") == 0 && arg_idx + 1 < argc) {
+      binary_path = argv[++arg_idx];
+    } else if (strcmp(argv[arg_idx], "--pipeline") == 0) {
+      is_pipelined = true;
+    } else if (strcmp(argv[arg_idx], "--exec") == 0) {
+      is_exec = true;
+    } else if (strcmp(argv[arg_idx], "--interpret") == 0) {
+      exec_options.use_blocks = false;
+    } else if (strcmp(argv[arg_idx], "--dump") == 0 && arg_idx + 1 < argc) {
+      exec_options.dump_path = argv[++arg_idx];
+    } else if (strcmp(argv[arg_idx], "--limit") == 0 && arg_idx + 1 < argc) {
+      exec_options.instruction_limit = strtoull(argv[++arg_idx], 0, 10);
+    } else if (strcmp(argv[arg_idx], "--back") == 0 && arg_idx + 1 < argc) {
+      exec_options.back_count = strtoull(argv[++arg_idx], 0, 10);
+    } else if (strcmp(argv[arg_idx], "--back-to") == 0 && arg_idx + 1 < argc) {
+      exec_options.back_address = (int32_t)strtol(argv[++arg_idx], 0, 0);
+    } else if (strcmp(argv[arg_idx], "--bus") == 0 && arg_idx + 1 < argc) {
+      char const *model = argv[++arg_idx];
+      exec_options.use_bus_model = true;
+      if (strcmp(model, "8088") == 0) {
+        exec_options.bus_model = BusModel_8088;
+      } else if (strcmp(model, "8086") == 0) {
+        exec_options.bus_model = BusModel_8086;
+      } else {
+        is_usage_error = true;
+      }
+    } else if (strcmp(argv[arg_idx], "--verify") == 0) {
+      is_verify = true;
+    } else if (strcmp(argv[arg_idx], "--clocks") == 0) {
+      show_clocks = true;
+    } else if (strcmp(argv[arg_idx], "--labels") == 0) {
+      show_labels = true;
+    } else if (strcmp(argv[arg_idx], "--batch") == 0) {
+      is_batch = true;
+    } else if (strcmp(argv[arg_idx], "--strict") == 0) {
+      decoder_flags &= ~Decoder_EmitData;
+    } else if (strcmp(argv[arg_idx], "--resync") == 0) {
+      decoder_flags |= Decoder_CollapseDataRuns;
+    } else {
+      inputs[input_count++] = argv[arg_idx];
+    }
+  }
+
+  if (is_usage_error || input_count == 0 ||
+      (!is_batch && input_count != 1)) {
+    printf("usage: main [options] [-j threads | --pipeline] file\n"
+           "       main [options] --binary output.bin file\n"
+           "       main --exec [--interpret] [--limit count] [--dump memory.bin] "
+           "[--back count] [--back-to ip] [--bus 8088|8086] file\n"
+           "       main [options] --batch [-j threads] [-o directory] "
+           "file|directory...\n"
+           "options:\n"
+           "  --strict  stop at the first byte that does not decode instead "
+           "of emitting db\n"
+           "  --resync  emit runs of 8+ identical bytes as one times/db "
+           "line\n"
+           "  --verify  encode every instruction back and compare with the "
+           "file instead\n"
+           "            of disassembling\n"
+           "  --clocks  comment each line with its 8086 clocks (on one "
+           "thread)\n"
+           "  --labels  print jump targets as labels, from a control flow "
+           "graph of the\n"
+           "            whole image (on one thread)\n"
+           "  --back    after --exec, step back this many instructions\n"
+           "  --back-to after --exec, step back to the last time ip was "
+           "there\n"
+           "  --bus     after --exec, trace each instruction with its clocks "
+           "on the\n"
+           "            8088 or 8086 bus and prefetch queue\n");
+    return -1;
+  }
+  if ((show_clocks || show_labels) &&
+      (is_batch || binary_path || is_verify || is_exec)) {
+    fprintf(stderr, "ERROR: --clocks and --labels only apply to "
+                    "disassembling one file.\n");
+    return -1;
+  }
+  if (thread_count == 0) {
+    thread_count = GetHardwareThreadCount();
+  }
+  if (show_clocks || show_labels) {
+    // The running total and the labels need the lines in order.
+    thread_count = 1;
+    is_pipelined = false;
+  }
+
+  Decoder decoder;
+  InitDecoder(&decoder, decoder_flags);
+
+  if (is_batch) {
+    uint32_t failure_count = DisassembleBatch(&decoder, inputs, input_count,
+                                              output_directory, thread_count);
+    return failure_count ? -1 : 0;
+  }
+
+  char *filename = inputs[0];
+  MappedFile image = {};
+  if (!MapFile(filename, &image)) {
     fprintf(stderr, "ERROR: Unable to open %s.\n", filename);
+    return -1;
+  }
+
+  if (is_verify) {
+    uint64_t mismatch_count =
+        VerifyRoundTrip(&decoder, image.data, image.size);
+    UnmapFile(&image);
+    return mismatch_count ? -1 : 0;
   }
 
-  printf("; %s\n", filename);
-  printf("bits 16\n");
-  MemoryAccess memory_idx = {};
-  memory_idx.base = buffer;
-  while (memory_idx.base - buffer < byte_read) {
-    DecodeInstruction(&memory_idx);
-    memory_idx.base += memory_idx.offset;
-    memory_idx.offset = 0;
+  if (is_exec) {
+    // The simulator fetches one instruction at a time: a run of identical
+    // bytes is code to it, so it gets a decoder without --resync.
+    Decoder exec_decoder;
+    InitDecoder(&exec_decoder, decoder_flags & ~Decoder_CollapseDataRuns);
+    int result = RunProgram(&exec_decoder, filename, image.data, image.size,
+                            &exec_options);
+    UnmapFile(&image);
+    return result;
+  }
+
+  if (binary_path) {
+    FILE *file = fopen(binary_path, "wb");
+    if (!file) {
+      fprintf(stderr, "ERROR: Unable to create %s.\n", binary_path);
+      UnmapFile(&image);
+      return -1;
+    }
 
-    printf("\n");
+    uint64_t error_address;
+    bool success = WriteInstructionFile(&decoder, image.data, image.size,
+                                        filename, file, &error_address);
+    fclose(file);
+    if (!success) {
+      INSTRUCTION_NOT_IMPLEMENTED(image.data[error_address]);
+    }
+    UnmapFile(&image);
+    return 0;
+  }
+
+  OutputBuffer out = CreateOutputBuffer(stdout);
+  PrintHeader(&out, filename);
+
+  if (is_pipelined) {
+    DisassemblePipelined(&decoder, image.data, image.size, &out);
+  } else if (thread_count > 1) {
+    DisassembleParallel(&decoder, image.data, image.size, thread_count, &out);
+  } else {
+    uint64_t error_address;
+    uint64_t total_clocks = 0;
+    uint64_t *clocks = show_clocks ? &total_clocks : 0;
+    bool success =
+        show_labels
+            ? DisassembleLabeled(&decoder, image.data, image.size, &out,
+                                 &error_address, clocks)
+            : DisassembleImage(&decoder, image.data, image.size, &out,
+                               &error_address, clocks);
+    if (!success) {
+      FlushOutput(&out);
+      INSTRUCTION_NOT_IMPLEMENTED(image.data[error_address]);
+    }
+    if (show_clocks) {
+      ReserveOutput(&out);
+      AppendString(&out, "; Total clocks: ");
+      AppendU64(&out, total_clocks);
+      AppendString(&out, ", jumps not taken\n");
+    }
   }
+  DestroyOutputBuffer(&out);
+  UnmapFile(&image);
 
   return 0;
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "stdint.h"
 
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(0 [array]))
+
 #define OPCODE_MOV_RM2REG 0b100010
 #define OPCODE_MOV_IMM2RM 0b1100011
 #define OPCODE_MOV_IMM2REG 0b1011
@@ -66,7 +68,10 @@ enum OpMnemonic {
   Op_loop,
   Op_loopz,
   Op_loopnz,
-  Op_jcxz
+  Op_jcxz,
+
+  // Raw data: `db` for one byte, `times size db value` for a run.
+  Op_db,
 };
 
 enum BitType {
@@ -74,6 +79,7 @@ enum BitType {
   Bit_Mod,
   Bit_Reg,
   Bit_RM,
+  Bit_SR,
   Bit_Data,
   Bit_Displacement,
   Bit_Address,
@@ -113,6 +119,7 @@ enum RegisterName {
   Register_ss,
   Register_ds,
   Register_is,
+  Register_count,
 };
 
 struct RegisterInfo {
@@ -137,6 +144,9 @@ struct EffectiveAddress {
   EffectiveAddressBase base;
   uint16_t displacement;
   uint8_t is_wide;
+  // Whether the displacement was encoded, even as 0: [bx] and [bx+0] are
+  // two encodings.
+  uint8_t has_displacement;
 };
 
 enum OperandType {
@@ -157,10 +167,30 @@ struct Operand {
   };
 };
 
+enum InstructionFlag {
+  Inst_Wide = 0x1,
+  // The rest record the encoding, for EncodeInstruction: the D bit, the S
+  // bit, and an encoding without a ModRM byte, like the accumulator and
+  // register-immediate forms.
+  Inst_Destination = 0x2,
+  Inst_Signed = 0x4,
+  Inst_ShortForm = 0x8,
+};
+
 struct Instruction {
-  uint32_t address;
+  uint64_t address;
   uint32_t size;
 
   OpMnemonic op;
+  uint32_t flags;
   Operand operands[2];
+
+  // 8086 clocks from the timing tables, including ea_clocks for the
+  // effective address and a 4 clock bus cycle per memory transfer. Jumps
+  // take taken_clocks more when taken, and each word transfer to or from
+  // an odd address takes 4 more.
+  uint8_t clocks;
+  uint8_t ea_clocks;
+  uint8_t taken_clocks;
+  uint8_t transfer_count;
 };
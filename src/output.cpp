@@ -0,0 +1,125 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+// Longest text a single Append* call sequence may produce between two calls
+// to ReserveOutput, e.g. one disassembled line.
+#define OUTPUT_MAX_RESERVE 256
+
+// Text is formatted straight into one large buffer that goes out to the file
+// in OUTPUT_BUFFER_SIZE writes. Without a file the buffer grows instead and
+// keeps all the text in memory.
+struct OutputBuffer {
+  FILE *file;
+  uint8_t *data;
+  uint64_t size;
+  uint64_t capacity;
+};
+
+OutputBuffer CreateOutputBuffer(FILE *file,
+                                uint64_t capacity = OUTPUT_BUFFER_SIZE) {
+  OutputBuffer out = {};
+  out.file = file;
+  out.data = (uint8_t *)malloc(capacity);
+  out.capacity = capacity;
+
+  return out;
+}
+
+void FlushOutput(OutputBuffer *out) {
+  if (out->size) {
+    fwrite(out->data, 1, out->size, out->file);
+    out->size = 0;
+  }
+}
+
+void DestroyOutputBuffer(OutputBuffer *out) {
+  if (out->file) {
+    FlushOutput(out);
+    fflush(out->file);
+  }
+  free(out->data);
+  *out = {};
+}
+
+static void GrowOutput(OutputBuffer *out, uint64_t size) {
+  while (out->capacity - out->size < size) {
+    out->capacity *= 2;
+  }
+  out->data = (uint8_t *)realloc(out->data, out->capacity);
+}
+
+// Makes room for at least OUTPUT_MAX_RESERVE bytes; the Append* functions
+// below do not check for space themselves.
+inline void ReserveOutput(OutputBuffer *out) {
+  if (out->capacity - out->size < OUTPUT_MAX_RESERVE) {
+    if (out->file) {
+      FlushOutput(out);
+    } else {
+      GrowOutput(out, OUTPUT_MAX_RESERVE);
+    }
+  }
+}
+
+// Copies a block of already formatted text; large blocks bypass the buffer.
+void WriteOutput(OutputBuffer *out, uint8_t const *data, uint64_t size) {
+  if (out->capacity - out->size < size) {
+    if (!out->file) {
+      GrowOutput(out, size);
+    } else {
+      FlushOutput(out);
+      if (size >= out->capacity) {
+        fwrite(data, 1, size, out->file);
+        return;
+      }
+    }
+  }
+
+  memcpy(out->data + out->size, data, size);
+  out->size += size;
+}
+
+inline void AppendChar(OutputBuffer *out, char c) { out->data[out->size++] = c; }
+
+inline void AppendString(OutputBuffer *out, char const *string) {
+  while (*string) {
+    out->data[out->size++] = *string++;
+  }
+}
+
+inline void AppendU32(OutputBuffer *out, uint32_t value) {
+  char digits[10];
+  uint32_t digit_count = 0;
+  do {
+    digits[digit_count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (digit_count) {
+    out->data[out->size++] = digits[--digit_count];
+  }
+}
+
+inline void AppendU64(OutputBuffer *out, uint64_t value) {
+  char digits[20];
+  uint32_t digit_count = 0;
+  do {
+    digits[digit_count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (digit_count) {
+    out->data[out->size++] = digits[--digit_count];
+  }
+}
+
+inline void AppendS32(OutputBuffer *out, int32_t value) {
+  if (value < 0) {
+    AppendChar(out, '-');
+    AppendU32(out, 0u - (uint32_t)value);
+  } else {
+    AppendU32(out, value);
+  }
+}
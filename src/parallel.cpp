@@ -0,0 +1,277 @@
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include <thread>
+
+// Parallel disassembly of a single image.
+//
+// The image is processed in rounds of thread_count chunks. Every worker
+// decodes its chunk speculatively from the chunk start, which may be in the
+// middle of an instruction, and marks each instruction start in a bitmap
+// shared by the round. Once all chunks are done, each worker keeps decoding
+// past its chunk end until it lands on an instruction start of a later
+// chunk: from there on that chunk's decode is the real one, since decoding
+// is deterministic given a start address. Stitching then walks the chunks
+// from the round start, which is always a real instruction boundary, and
+// writes out the text of each chunk from the point where the previous one
+// joined it.
+
+#ifndef PARALLEL_CHUNK_SIZE
+#define PARALLEL_CHUNK_SIZE (4 * 1024 * 1024)
+#endif
+static_assert(PARALLEL_CHUNK_SIZE % 64 == 0,
+              "chunks must own whole words of the boundary bitmap");
+
+struct LineRecord {
+  uint64_t address;
+  uint64_t text_offset;
+};
+
+struct ChunkDecode {
+  uint64_t start;
+  uint64_t end;
+
+  LineRecord *records;
+  uint64_t record_count;
+  uint64_t record_capacity;
+
+  // Records for bytes that do not decode. Speculative decoding skips them,
+  // the stitched stream stops at the first one on its path.
+  uint64_t *invalid_records;
+  uint64_t invalid_count;
+  uint64_t invalid_capacity;
+
+  OutputBuffer text;
+
+  // Where the decode past end lined up with a later chunk.
+  uint64_t join_address;
+  uint32_t join_chunk;
+};
+
+struct ParallelRound {
+  Decoder const *decoder;
+  uint8_t *image;
+  uint64_t image_size;
+
+  uint64_t start;
+  uint64_t end;
+  uint64_t *boundaries;
+  ChunkDecode *chunks;
+  uint32_t chunk_count;
+};
+
+static uint32_t GetHardwareThreadCount(void) {
+  uint32_t result = std::thread::hardware_concurrency();
+  return result ? result : 1;
+}
+
+static void AddRecord(ChunkDecode *chunk, uint64_t address, bool is_valid) {
+  if (chunk->record_count == chunk->record_capacity) {
+    chunk->record_capacity = chunk->record_capacity ? 2 * chunk->record_capacity
+                                                    : 64 * 1024;
+    chunk->records = (LineRecord *)realloc(
+        chunk->records, chunk->record_capacity * sizeof(LineRecord));
+  }
+  if (!is_valid) {
+    if (chunk->invalid_count == chunk->invalid_capacity) {
+      chunk->invalid_capacity =
+          chunk->invalid_capacity ? 2 * chunk->invalid_capacity : 64;
+      chunk->invalid_records = (uint64_t *)realloc(
+          chunk->invalid_records, chunk->invalid_capacity * sizeof(uint64_t));
+    }
+    chunk->invalid_records[chunk->invalid_count++] = chunk->record_count;
+  }
+
+  LineRecord *record = &chunk->records[chunk->record_count++];
+  record->address = address;
+  record->text_offset = chunk->text.size;
+}
+
+static bool IsBoundary(ParallelRound *round, uint64_t address) {
+  uint64_t bit = address - round->start;
+  return (round->boundaries[bit / 64] >> (bit % 64)) & 1;
+}
+
+static uint32_t GetChunkIndex(ParallelRound *round, uint64_t address) {
+  return (uint32_t)((address - round->start) / PARALLEL_CHUNK_SIZE);
+}
+
+static void DecodeChunk(ParallelRound *round, uint32_t chunk_idx) {
+  ChunkDecode *chunk = &round->chunks[chunk_idx];
+  uint64_t *boundaries = round->boundaries;
+
+  uint64_t first_bit = chunk->start - round->start;
+  memset(boundaries + first_bit / 64, 0,
+         (chunk->end - chunk->start + 63) / 64 * sizeof(uint64_t));
+
+  uint64_t address = chunk->start;
+  while (address < chunk->end) {
+    Instruction instruction;
+    DecodeInstruction(round->decoder, round->image + address,
+                      round->image_size - address, address, &instruction);
+
+    uint64_t bit = address - round->start;
+    boundaries[bit / 64] |= 1ull << (bit % 64);
+    AddRecord(chunk, address, instruction.op != Op_None);
+    if (instruction.op) {
+      PrintInstruction(&chunk->text, instruction);
+      AppendChar(&chunk->text, '\n');
+      address += instruction.size;
+    } else {
+      ++address;
+    }
+  }
+  chunk->join_address = address;
+}
+
+// Runs once every chunk of the round is decoded. The decode is continued
+// from where DecodeChunk stopped until it reaches an instruction start of a
+// later chunk, the end of the round, or an invalid instruction.
+static void JoinChunk(ParallelRound *round, uint32_t chunk_idx) {
+  ChunkDecode *chunk = &round->chunks[chunk_idx];
+
+  uint64_t address = chunk->join_address;
+  while (address < round->end && !IsBoundary(round, address)) {
+    Instruction instruction;
+    DecodeInstruction(round->decoder, round->image + address,
+                      round->image_size - address, address, &instruction);
+
+    AddRecord(chunk, address, instruction.op != Op_None);
+    if (!instruction.op) {
+      break;
+    }
+    PrintInstruction(&chunk->text, instruction);
+    AppendChar(&chunk->text, '\n');
+    address += instruction.size;
+  }
+
+  chunk->join_address = address;
+  chunk->join_chunk = address < round->end ? GetChunkIndex(round, address)
+                                           : round->chunk_count;
+}
+
+static void RunChunkWorker(ParallelRound *round, uint32_t chunk_idx,
+                           bool is_join) {
+  if (is_join) {
+    JoinChunk(round, chunk_idx);
+  } else {
+    DecodeChunk(round, chunk_idx);
+  }
+}
+
+static void RunRoundPhase(ParallelRound *round, bool is_join) {
+  std::thread threads[64];
+  uint32_t thread_count = round->chunk_count - 1;
+  for (uint32_t chunk_idx = 1; chunk_idx < round->chunk_count; ++chunk_idx) {
+    threads[chunk_idx - 1] =
+        std::thread(RunChunkWorker, round, chunk_idx, is_join);
+  }
+  RunChunkWorker(round, 0, is_join);
+  for (uint32_t thread_idx = 0; thread_idx < thread_count; ++thread_idx) {
+    threads[thread_idx].join();
+  }
+}
+
+// Returns the index of the record starting at `address`.
+static uint64_t FindRecord(ChunkDecode *chunk, uint64_t address) {
+  uint64_t low = 0;
+  uint64_t high = chunk->record_count;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    if (chunk->records[mid].address < address) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  assert(low < chunk->record_count && chunk->records[low].address == address);
+  return low;
+}
+
+// Writes the real instruction stream of the round. Returns the address the
+// next round starts at.
+static uint64_t StitchRound(ParallelRound *round, OutputBuffer *out) {
+  uint64_t address = round->start;
+  uint32_t chunk_idx = 0;
+  while (chunk_idx < round->chunk_count) {
+    ChunkDecode *chunk = &round->chunks[chunk_idx];
+    uint64_t record_idx = FindRecord(chunk, address);
+    uint64_t text_start = chunk->records[record_idx].text_offset;
+
+    for (uint64_t invalid_idx = 0; invalid_idx < chunk->invalid_count;
+         ++invalid_idx) {
+      uint64_t invalid_record = chunk->invalid_records[invalid_idx];
+      if (invalid_record >= record_idx) {
+        LineRecord *record = &chunk->records[invalid_record];
+        WriteOutput(out, chunk->text.data + text_start,
+                    record->text_offset - text_start);
+        FlushOutput(out);
+        INSTRUCTION_NOT_IMPLEMENTED(round->image[record->address]);
+      }
+    }
+
+    WriteOutput(out, chunk->text.data + text_start,
+                chunk->text.size - text_start);
+    address = chunk->join_address;
+    chunk_idx = chunk->join_chunk;
+  }
+
+  return address;
+}
+
+void DisassembleParallel(Decoder const *decoder, uint8_t *image,
+                         uint64_t image_size, uint32_t thread_count,
+                         OutputBuffer *out) {
+  if (thread_count > 64) {
+    thread_count = 64;
+  }
+
+  ParallelRound round = {};
+  round.decoder = decoder;
+  round.image = image;
+  round.image_size = image_size;
+  round.boundaries = (uint64_t *)malloc(thread_count * PARALLEL_CHUNK_SIZE / 8);
+  round.chunks = (ChunkDecode *)calloc(thread_count, sizeof(ChunkDecode));
+  for (uint32_t chunk_idx = 0; chunk_idx < thread_count; ++chunk_idx) {
+    round.chunks[chunk_idx].text = CreateOutputBuffer(0);
+  }
+
+  while (round.start < image_size) {
+    uint64_t remaining = image_size - round.start;
+    uint64_t chunk_count =
+        (remaining + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    round.chunk_count =
+        chunk_count < thread_count ? (uint32_t)chunk_count : thread_count;
+    round.end = round.start + round.chunk_count * PARALLEL_CHUNK_SIZE;
+    if (round.end > image_size) {
+      round.end = image_size;
+    }
+
+    for (uint32_t chunk_idx = 0; chunk_idx < round.chunk_count; ++chunk_idx) {
+      ChunkDecode *chunk = &round.chunks[chunk_idx];
+      chunk->start = round.start + chunk_idx * PARALLEL_CHUNK_SIZE;
+      chunk->end = chunk->start + PARALLEL_CHUNK_SIZE;
+      if (chunk->end > round.end) {
+        chunk->end = round.end;
+      }
+      chunk->record_count = 0;
+      chunk->invalid_count = 0;
+      chunk->text.size = 0;
+    }
+
+    RunRoundPhase(&round, false);
+    RunRoundPhase(&round, true);
+    round.start = StitchRound(&round, out);
+  }
+
+  for (uint32_t chunk_idx = 0; chunk_idx < thread_count; ++chunk_idx) {
+    ChunkDecode *chunk = &round.chunks[chunk_idx];
+    free(chunk->records);
+    free(chunk->invalid_records);
+    DestroyOutputBuffer(&chunk->text);
+  }
+  free(round.chunks);
+  free(round.boundaries);
+}
@@ -0,0 +1,241 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+
+#include <atomic>
+#include <thread>
+
+// Streaming disassembly in three stages, each on its own thread:
+//
+//   decode -> [instruction batches] -> format -> [text blocks] -> write
+//
+// Stages hand fixed slots to each other through single-producer
+// single-consumer rings. A slot is filled in place by the producer and
+// published by bumping write_idx; the consumer gives it back by bumping
+// read_idx. A stage that finds its ring full (producer) or empty (consumer)
+// counts a stall and yields until the other side catches up.
+
+#define PIPELINE_BATCH_SIZE 4096
+#define PIPELINE_RING_SIZE 8
+static_assert((PIPELINE_RING_SIZE & (PIPELINE_RING_SIZE - 1)) == 0,
+              "ring size must be a power of two");
+
+struct RingStats {
+  uint64_t full_stalls;
+  uint64_t empty_stalls;
+  uint64_t full_stall_time;
+  uint64_t empty_stall_time;
+
+  // Sum of the slots in use seen by the consumer on each read.
+  uint64_t occupancy_sum;
+  uint64_t read_count;
+};
+
+struct RingIndices {
+  alignas(64) std::atomic<uint64_t> write_idx;
+  alignas(64) std::atomic<uint64_t> read_idx;
+  alignas(64) RingStats stats;
+};
+
+struct InstructionBatch {
+  Instruction instructions[PIPELINE_BATCH_SIZE];
+  uint32_t count;
+  bool is_last;
+  // Set when decoding stopped at an unknown instruction.
+  bool has_error;
+  uint8_t error_byte;
+};
+
+struct TextBlock {
+  OutputBuffer text;
+  bool is_last;
+  bool has_error;
+  uint8_t error_byte;
+};
+
+struct Pipeline {
+  Decoder const *decoder;
+  uint8_t *image;
+  uint64_t image_size;
+
+  RingIndices batch_ring;
+  InstructionBatch *batches;
+
+  RingIndices text_ring;
+  TextBlock *blocks;
+
+  uint64_t decode_time;
+  uint64_t format_time;
+  uint64_t write_time;
+};
+
+// Producer side: returns the slot to fill, waiting while the ring is full.
+static uint64_t BeginRingWrite(RingIndices *ring) {
+  uint64_t write_idx = ring->write_idx.load(std::memory_order_relaxed);
+  if (write_idx - ring->read_idx.load(std::memory_order_acquire) ==
+      PIPELINE_RING_SIZE) {
+    uint64_t start = ReadOSTimer();
+    ++ring->stats.full_stalls;
+    while (write_idx - ring->read_idx.load(std::memory_order_acquire) ==
+           PIPELINE_RING_SIZE) {
+      std::this_thread::yield();
+    }
+    ring->stats.full_stall_time += ReadOSTimer() - start;
+  }
+
+  return write_idx % PIPELINE_RING_SIZE;
+}
+
+static void EndRingWrite(RingIndices *ring) {
+  ring->write_idx.fetch_add(1, std::memory_order_release);
+}
+
+// Consumer side: returns the slot to read, waiting while the ring is empty.
+static uint64_t BeginRingRead(RingIndices *ring) {
+  uint64_t read_idx = ring->read_idx.load(std::memory_order_relaxed);
+  uint64_t write_idx = ring->write_idx.load(std::memory_order_acquire);
+  if (write_idx == read_idx) {
+    uint64_t start = ReadOSTimer();
+    ++ring->stats.empty_stalls;
+    while ((write_idx = ring->write_idx.load(std::memory_order_acquire)) ==
+           read_idx) {
+      std::this_thread::yield();
+    }
+    ring->stats.empty_stall_time += ReadOSTimer() - start;
+  }
+
+  ring->stats.occupancy_sum += write_idx - read_idx;
+  ++ring->stats.read_count;
+  return read_idx % PIPELINE_RING_SIZE;
+}
+
+static void EndRingRead(RingIndices *ring) {
+  ring->read_idx.fetch_add(1, std::memory_order_release);
+}
+
+static void RunDecodeStage(Pipeline *pipeline) {
+  uint64_t start = ReadOSTimer();
+
+  uint64_t address = 0;
+  bool is_last = false;
+  while (!is_last) {
+    InstructionBatch *batch =
+        &pipeline->batches[BeginRingWrite(&pipeline->batch_ring)];
+    uint64_t consumed;
+    DecodeStatus status = DecodeInstructions(
+        pipeline->decoder, pipeline->image + address,
+        pipeline->image_size - address, address, batch->instructions,
+        PIPELINE_BATCH_SIZE, &batch->count, &consumed);
+    address += consumed;
+
+    batch->has_error = status != Decode_Ok;
+    if (batch->has_error) {
+      batch->error_byte = pipeline->image[address];
+    }
+
+    is_last = batch->has_error || address >= pipeline->image_size;
+    batch->is_last = is_last;
+    EndRingWrite(&pipeline->batch_ring);
+  }
+
+  pipeline->decode_time = ReadOSTimer() - start;
+}
+
+static void RunFormatStage(Pipeline *pipeline) {
+  uint64_t start = ReadOSTimer();
+
+  bool is_last = false;
+  while (!is_last) {
+    InstructionBatch *batch =
+        &pipeline->batches[BeginRingRead(&pipeline->batch_ring)];
+    TextBlock *block = &pipeline->blocks[BeginRingWrite(&pipeline->text_ring)];
+
+    block->text.size = 0;
+    for (uint32_t instruction_idx = 0; instruction_idx < batch->count;
+         ++instruction_idx) {
+      PrintInstruction(&block->text, batch->instructions[instruction_idx]);
+      AppendChar(&block->text, '\n');
+    }
+    block->has_error = batch->has_error;
+    block->error_byte = batch->error_byte;
+    block->is_last = is_last = batch->is_last;
+
+    EndRingRead(&pipeline->batch_ring);
+    EndRingWrite(&pipeline->text_ring);
+  }
+
+  pipeline->format_time = ReadOSTimer() - start;
+}
+
+static void PrintRingStats(char const *name, RingIndices *ring) {
+  RingStats *stats = &ring->stats;
+  double occupancy =
+      stats->read_count ? (double)stats->occupancy_sum / stats->read_count : 0;
+  fprintf(stderr,
+          "%-12s occupancy %4.2f/%d, producer stalls %llu (%.4fs), "
+          "consumer stalls %llu (%.4fs)\n",
+          name, occupancy, PIPELINE_RING_SIZE,
+          (unsigned long long)stats->full_stalls,
+          SecondsElapsed(0, stats->full_stall_time),
+          (unsigned long long)stats->empty_stalls,
+          SecondsElapsed(0, stats->empty_stall_time));
+}
+
+static void PrintPipelineStats(Pipeline *pipeline) {
+  fprintf(stderr, "decode %.4fs, format %.4fs, write %.4fs\n",
+          SecondsElapsed(0, pipeline->decode_time),
+          SecondsElapsed(0, pipeline->format_time),
+          SecondsElapsed(0, pipeline->write_time));
+  PrintRingStats("instructions", &pipeline->batch_ring);
+  PrintRingStats("text", &pipeline->text_ring);
+}
+
+// The calling thread is the write stage. Stage timings and ring statistics
+// go to stderr.
+void DisassemblePipelined(Decoder const *decoder, uint8_t *image,
+                          uint64_t image_size, OutputBuffer *out) {
+  Pipeline *pipeline = new Pipeline();
+  pipeline->decoder = decoder;
+  pipeline->image = image;
+  pipeline->image_size = image_size;
+  pipeline->batches = (InstructionBatch *)malloc(PIPELINE_RING_SIZE *
+                                                 sizeof(InstructionBatch));
+  pipeline->blocks = (TextBlock *)malloc(PIPELINE_RING_SIZE * sizeof(TextBlock));
+  for (uint32_t block_idx = 0; block_idx < PIPELINE_RING_SIZE; ++block_idx) {
+    pipeline->blocks[block_idx].text =
+        CreateOutputBuffer(0, PIPELINE_BATCH_SIZE * OUTPUT_MAX_RESERVE);
+  }
+
+  std::thread decode_thread(RunDecodeStage, pipeline);
+  std::thread format_thread(RunFormatStage, pipeline);
+
+  uint64_t start = ReadOSTimer();
+  bool is_last = false;
+  bool has_error = false;
+  uint8_t error_byte = 0;
+  while (!is_last) {
+    TextBlock *block = &pipeline->blocks[BeginRingRead(&pipeline->text_ring)];
+    WriteOutput(out, block->text.data, block->text.size);
+    is_last = block->is_last;
+    has_error = block->has_error;
+    error_byte = block->error_byte;
+    EndRingRead(&pipeline->text_ring);
+  }
+  FlushOutput(out);
+  pipeline->write_time = ReadOSTimer() - start;
+
+  decode_thread.join();
+  format_thread.join();
+  PrintPipelineStats(pipeline);
+
+  for (uint32_t block_idx = 0; block_idx < PIPELINE_RING_SIZE; ++block_idx) {
+    DestroyOutputBuffer(&pipeline->blocks[block_idx].text);
+  }
+  free(pipeline->blocks);
+  free(pipeline->batches);
+  delete pipeline;
+
+  if (has_error) {
+    INSTRUCTION_NOT_IMPLEMENTED(error_byte);
+  }
+}
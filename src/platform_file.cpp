@@ -0,0 +1,175 @@
+#include "stdint.h"
+#include "stdio.h"
+
+// Read-only view of a whole file. data is null for empty files.
+struct MappedFile {
+  uint8_t *data;
+  uint64_t size;
+#if _WIN32
+  void *mapping;
+#endif
+};
+
+#if _WIN32
+
+#include <windows.h>
+
+static bool MapFile(char const *filename, MappedFile *result) {
+  *result = {};
+
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  bool success = false;
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(file, &size)) {
+    result->size = size.QuadPart;
+    success = result->size == 0;
+    if (!success) {
+      result->mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+      if (result->mapping) {
+        result->data =
+            (uint8_t *)MapViewOfFile(result->mapping, FILE_MAP_READ, 0, 0, 0);
+        success = result->data != 0;
+      }
+    }
+  }
+  CloseHandle(file);
+
+  return success;
+}
+
+static void UnmapFile(MappedFile *file) {
+  if (file->data) {
+    UnmapViewOfFile(file->data);
+  }
+  if (file->mapping) {
+    CloseHandle(file->mapping);
+  }
+  *file = {};
+}
+
+static bool IsDirectory(char const *path) {
+  DWORD attributes = GetFileAttributesA(path);
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+         (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+// Size of the file at `path` without opening it, 0 if it cannot be read.
+static uint64_t GetPathSize(char const *path) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+    return 0;
+  }
+  return (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+}
+
+// Calls `callback` with the path and size of every regular file directly in
+// `directory`.
+template <typename Callback>
+static bool ListDirectory(char const *directory, Callback callback) {
+  char pattern[MAX_PATH];
+  snprintf(pattern, sizeof(pattern), "%s\\*", directory);
+
+  WIN32_FIND_DATAA find_data;
+  HANDLE find = FindFirstFileA(pattern, &find_data);
+  if (find == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  do {
+    if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      char path[MAX_PATH];
+      snprintf(path, sizeof(path), "%s\\%s", directory, find_data.cFileName);
+      callback(path, (uint64_t)find_data.nFileSizeHigh << 32 |
+                         find_data.nFileSizeLow);
+    }
+  } while (FindNextFileA(find, &find_data));
+  FindClose(find);
+
+  return true;
+}
+
+#else
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool MapFile(char const *filename, MappedFile *result) {
+  *result = {};
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool success = false;
+  struct stat stat_buffer;
+  if (fstat(fd, &stat_buffer) == 0) {
+    result->size = stat_buffer.st_size;
+    success = result->size == 0;
+    if (!success) {
+      // The decoder walks the image once front to back: ask for aggressive
+      // read-ahead and early eviction of pages already decoded.
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      void *data = mmap(0, result->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, result->size, MADV_SEQUENTIAL);
+        result->data = (uint8_t *)data;
+        success = true;
+      }
+    }
+  }
+  close(fd);
+
+  return success;
+}
+
+static void UnmapFile(MappedFile *file) {
+  if (file->data) {
+    munmap(file->data, file->size);
+  }
+  *file = {};
+}
+
+static bool IsDirectory(char const *path) {
+  struct stat stat_buffer;
+  return stat(path, &stat_buffer) == 0 && S_ISDIR(stat_buffer.st_mode);
+}
+
+// Size of the file at `path` without opening it, 0 if it cannot be read.
+static uint64_t GetPathSize(char const *path) {
+  struct stat stat_buffer;
+  if (stat(path, &stat_buffer) != 0) {
+    return 0;
+  }
+  return stat_buffer.st_size;
+}
+
+// Calls `callback` with the path and size of every regular file directly in
+// `directory`.
+template <typename Callback>
+static bool ListDirectory(char const *directory, Callback callback) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    return false;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    struct stat stat_buffer;
+    if (stat(path, &stat_buffer) == 0 && S_ISREG(stat_buffer.st_mode)) {
+      callback(path, (uint64_t)stat_buffer.st_size);
+    }
+  }
+  closedir(dir);
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#include "stdint.h"
+
+#if _WIN32
+
+#include <intrin.h>
+#include <windows.h>
+
+static uint64_t GetOSTimerFreq(void) {
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  return freq.QuadPart;
+}
+
+static uint64_t ReadOSTimer(void) {
+  LARGE_INTEGER value;
+  QueryPerformanceCounter(&value);
+  return value.QuadPart;
+}
+
+#else
+
+#include <time.h>
+#include <x86intrin.h>
+
+static uint64_t GetOSTimerFreq(void) { return 1000000000; }
+
+static uint64_t ReadOSTimer(void) {
+  struct timespec value;
+  clock_gettime(CLOCK_MONOTONIC, &value);
+  return GetOSTimerFreq() * (uint64_t)value.tv_sec + (uint64_t)value.tv_nsec;
+}
+
+#endif
+
+static uint64_t ReadCPUTimer(void) { return __rdtsc(); }
+
+static double SecondsElapsed(uint64_t start, uint64_t end) {
+  return (double)(end - start) / (double)GetOSTimerFreq();
+}
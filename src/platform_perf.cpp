@@ -0,0 +1,116 @@
+#include "stdint.h"
+
+// Hardware performance counters of the calling thread, user mode only.
+// Counters the OS or the machine does not provide read as PERF_UNAVAILABLE.
+
+#define PERF_UNAVAILABLE ~0ull
+
+enum PerfCounter {
+  Perf_Cycles,
+  Perf_Instructions,
+  Perf_BranchMisses,
+  Perf_CacheMisses,
+
+  Perf_Count
+};
+
+struct PerfCounts {
+  uint64_t values[Perf_Count];
+};
+
+#if __linux__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct PerfCounters {
+  int fds[Perf_Count];
+};
+
+void InitPerfCounters(PerfCounters *counters) {
+  static uint64_t const configs[Perf_Count] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES,
+      PERF_COUNT_HW_CACHE_MISSES,
+  };
+
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters->fds[counter] =
+        (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+void DestroyPerfCounters(PerfCounters *counters) {
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    if (counters->fds[counter] >= 0) {
+      close(counters->fds[counter]);
+    }
+  }
+}
+
+bool HasPerfCounters(PerfCounters *counters) {
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    if (counters->fds[counter] >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Zeroes and starts the counters.
+void StartPerfCounters(PerfCounters *counters) {
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    int fd = counters->fds[counter];
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+PerfCounts StopPerfCounters(PerfCounters *counters) {
+  PerfCounts result;
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    int fd = counters->fds[counter];
+    uint64_t value = PERF_UNAVAILABLE;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        value = PERF_UNAVAILABLE;
+      }
+    }
+    result.values[counter] = value;
+  }
+  return result;
+}
+
+#else
+
+struct PerfCounters {
+  int unused;
+};
+
+void InitPerfCounters(PerfCounters *counters) {}
+void DestroyPerfCounters(PerfCounters *counters) {}
+bool HasPerfCounters(PerfCounters *counters) { return false; }
+void StartPerfCounters(PerfCounters *counters) {}
+
+PerfCounts StopPerfCounters(PerfCounters *counters) {
+  PerfCounts result;
+  for (uint32_t counter = 0; counter < Perf_Count; ++counter) {
+    result.values[counter] = PERF_UNAVAILABLE;
+  }
+  return result;
+}
+
+#endif
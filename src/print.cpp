@@ -0,0 +1,205 @@
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+
+#include "decoder.h"
+#include "output.cpp"
+
+// https://stackoverflow.com/a/3208376
+#define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
+#define BYTE_TO_BINARY(byte)                                                   \
+  ((byte) & 0x80 ? '1' : '0'), ((byte) & 0x40 ? '1' : '0'),                    \
+      ((byte) & 0x20 ? '1' : '0'), ((byte) & 0x10 ? '1' : '0'),                \
+      ((byte) & 0x08 ? '1' : '0'), ((byte) & 0x04 ? '1' : '0'),                \
+      ((byte) & 0x02 ? '1' : '0'), ((byte) & 0x01 ? '1' : '0')
+
+#define INSTRUCTION_NOT_IMPLEMENTED(byte)                                      \
+  printf("\n" BYTE_TO_BINARY_PATTERN, BYTE_TO_BINARY(byte));                   \
+  printf(" - INSTRUCTION NOT IMPLEMENTED\n");                                  \
+  exit(-1);
+
+static char const *GetMnemonicName(OpMnemonic op) {
+  static char const *const mnemonic_table[] = {
+      "",     "mov", "add", "sub", "cmp", "je",   "jl",    "jle",
+      "jb",   "jbe", "jp",  "jo",  "js",  "jne",  "jnl",   "jg",
+      "jnb",  "ja",  "jnp", "jno", "jns", "loop", "loopz", "loopnz",
+      "jcxz", "db",
+  };
+
+  return mnemonic_table[op];
+}
+
+static char const *GetRegisterName(RegisterInfo reg) {
+  static char const *const register_table[][3] = {
+      {"al", "ah", "ax"}, {"cl", "ch", "cx"}, {"dl", "dh", "dx"},
+      {"bl", "bh", "bx"}, {"sp", "sp", "sp"}, {"bp", "bp", "bp"},
+      {"si", "si", "si"}, {"di", "di", "di"}, {"es", "es", "es"},
+      {"cs", "cs", "cs"}, {"ss", "ss", "ss"}, {"ds", "ds", "ds"},
+      {"ip", "ip", "ip"},
+  };
+
+  uint32_t name_idx = reg.size == 2 ? 2 : reg.offset;
+  return register_table[reg.name][name_idx];
+}
+
+static char const *GetEffectiveAddressBase(EffectiveAddress effective_address) {
+  static char const *const address_base_table[] = {
+      "bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx", "",
+  };
+
+  return address_base_table[effective_address.base];
+}
+
+void PrintEffectiveAddress(OutputBuffer *out,
+                           EffectiveAddress effective_address) {
+  AppendChar(out, '[');
+
+  if (effective_address.base != EffectiveAddress_direct) {
+    AppendString(out, GetEffectiveAddressBase(effective_address));
+    if (effective_address.displacement != 0) {
+      AppendChar(out, '+');
+      AppendS32(out, (int16_t)effective_address.displacement);
+    }
+  } else {
+    AppendU32(out, effective_address.displacement);
+  }
+
+  AppendChar(out, ']');
+}
+
+void PrintOperand(OutputBuffer *out, Instruction instruction,
+                  Operand operand) {
+  switch (operand.type) {
+  case Operand_Register: {
+    AppendString(out, GetRegisterName(operand.reg));
+  } break;
+  case Operand_Memory: {
+    PrintEffectiveAddress(out, operand.address);
+  } break;
+  case Operand_Immediate: {
+    AppendS32(out, operand.immediate_s32);
+  } break;
+  case Operand_RelativeImmediate: {
+    // nasm's $ is the start of the instruction, the jump is relative to its
+    // end.
+    int32_t value = operand.immediate_s32 + instruction.size;
+    AppendString(out, value >= 0 ? "$+0+" : "$+0");
+    AppendS32(out, value);
+  } break;
+  default:
+    break;
+  }
+}
+
+// Writes one line of disassembly, without the trailing newline.
+void PrintInstruction(OutputBuffer *out, Instruction instruction) {
+  ReserveOutput(out);
+
+  if (instruction.op == Op_db && instruction.size > 1) {
+    AppendString(out, "times ");
+    AppendU32(out, instruction.size);
+    AppendChar(out, ' ');
+  }
+  AppendString(out, GetMnemonicName(instruction.op));
+  AppendChar(out, ' ');
+
+  Operand *operands = instruction.operands;
+  bool needs_size = (operands[0].type == Operand_Memory &&
+                     operands[1].type == Operand_Immediate);
+  if (needs_size) {
+    AppendString(out, instruction.flags & Inst_Wide ? "word " : "byte ");
+  }
+
+  char const *separator = "";
+  for (uint32_t operand_idx = 0; operand_idx < 2; ++operand_idx) {
+    if (operands[operand_idx].type != Operand_None) {
+      AppendString(out, separator);
+      separator = ", ";
+      PrintOperand(out, instruction, operands[operand_idx]);
+    }
+  }
+}
+
+// Writes the clocks of one instruction as a comment and adds them to
+// *total_clocks, e.g. " ; Clocks: +17 = 31 (9 + 8ea)". Jumps count as not
+// taken. The odd address penalty is only known for direct addresses.
+void PrintClocks(OutputBuffer *out, Instruction instruction,
+                 uint64_t *total_clocks) {
+  uint32_t penalty = 0;
+  Operand *operands = instruction.operands;
+  Operand memory =
+      operands[0].type == Operand_Memory ? operands[0] : operands[1];
+  if ((instruction.flags & Inst_Wide) &&
+      memory.address.base == EffectiveAddress_direct &&
+      (memory.address.displacement & 1)) {
+    penalty = 4 * instruction.transfer_count;
+  }
+  uint32_t clocks = instruction.clocks + penalty;
+  *total_clocks += clocks;
+
+  ReserveOutput(out);
+  AppendString(out, " ; Clocks: +");
+  AppendU32(out, clocks);
+  AppendString(out, " = ");
+  AppendU64(out, *total_clocks);
+  if (instruction.ea_clocks || penalty) {
+    AppendString(out, " (");
+    AppendU32(out, instruction.clocks - instruction.ea_clocks);
+    if (instruction.ea_clocks) {
+      AppendString(out, " + ");
+      AppendU32(out, instruction.ea_clocks);
+      AppendString(out, "ea");
+    }
+    if (penalty) {
+      AppendString(out, " + ");
+      AppendU32(out, penalty);
+      AppendChar(out, 'p');
+    }
+    AppendChar(out, ')');
+  }
+  if (instruction.taken_clocks) {
+    AppendString(out, " (");
+    AppendU32(out, clocks + instruction.taken_clocks);
+    AppendString(out, " if taken)");
+  }
+}
+
+void PrintHeader(OutputBuffer *out, char const *filename) {
+  ReserveOutput(out);
+  AppendString(out, "; ");
+  WriteOutput(out, (uint8_t const *)filename, strlen(filename));
+  AppendString(out, "\nbits 16\n");
+}
+
+#define DISASSEMBLE_BATCH_SIZE 256
+
+// Disassembles a whole image in order. Returns false if it stopped at an
+// unknown or truncated instruction, whose address is put in error_address.
+// With total_clocks, each line gets its clocks (see PrintClocks), summed
+// into *total_clocks.
+bool DisassembleImage(Decoder const *decoder, uint8_t const *image,
+                      uint64_t image_size, OutputBuffer *out,
+                      uint64_t *error_address, uint64_t *total_clocks = 0) {
+  Instruction instructions[DISASSEMBLE_BATCH_SIZE];
+  uint64_t address = 0;
+  DecodeStatus status = Decode_Ok;
+  while (status == Decode_Ok && address < image_size) {
+    uint32_t count;
+    uint64_t consumed;
+    status = DecodeInstructions(decoder, image + address, image_size - address,
+                                address, instructions, DISASSEMBLE_BATCH_SIZE,
+                                &count, &consumed);
+    for (uint32_t instruction_idx = 0; instruction_idx < count;
+         ++instruction_idx) {
+      PrintInstruction(out, instructions[instruction_idx]);
+      if (total_clocks) {
+        PrintClocks(out, instructions[instruction_idx], total_clocks);
+      }
+      AppendChar(out, '\n');
+    }
+    address += consumed;
+  }
+
+  *error_address = address;
+  return status == Decode_Ok;
+}
@@ -0,0 +1,411 @@
+#include "assert.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "decode.cpp"
+#include "platform_metrics.cpp"
+#include "simulate.cpp"
+#include "block.cpp"
+#include "snapshot.cpp"
+#include "history.cpp"
+#include "lanes.cpp"
+
+// Compares the fetch loop (RunSimulator) with block execution
+// (RunSimulatorBlocks) on built-in loops and on programs given on the
+// command line. Programs that do not halt are cut at SIM_BENCH_LIMIT
+// instructions.
+//
+// Then measures the reset between repeated runs of one program: a snapshot
+// restore against a fresh simulator with the program loaded again, and the
+// cost of recording history on blocks and on the fetch loop. Stepping back
+// is checked against a run that stopped there.
+//
+// Last, runs each program over SIM_BENCH_SEED_COUNT register seeds, once per
+// seed on the scalar engines and LANE_COUNT seeds at a time on the lane
+// simulator, and compares the final states.
+//
+// Returns -1 if any of the comparisons found a mismatch.
+
+#define SIM_BENCH_REPETITIONS 4
+#define SIM_BENCH_LIMIT 20000000
+#define SIM_BENCH_RESET_RUNS 100
+#define SIM_BENCH_HISTORY_INTERVAL 10000
+#define SIM_BENCH_SEED_COUNT (4 * LANE_COUNT)
+#define SIM_BENCH_SEED_LIMIT 1000000
+
+struct SimBenchProgram {
+  char const *name;
+  uint8_t const *code;
+  uint64_t size;
+};
+
+// mov dx, 100 / outer: mov cx, 60000 / inner: add ax, 1 / sub bx, 2 /
+// cmp ax, bx / loop inner / sub dx, 1 / jnz outer
+static uint8_t const register_loop[] = {
+    0xba, 0x64, 0x00, 0xb9, 0x60, 0xea, 0x83, 0xc0, 0x01, 0x83, 0xeb,
+    0x02, 0x39, 0xd8, 0xe2, 0xf6, 0x83, 0xea, 0x01, 0x75, 0xee,
+};
+
+// mov bp, 2000 / mov dx, 200 / outer: mov si, 0 / inner: mov [bp+si], si /
+// add [bp+si], dx / mov ax, [bp+si] / add bx, ax / add si, 2 /
+// cmp si, 1000 / jnz inner / sub dx, 1 / jnz outer
+static uint8_t const memory_loop[] = {
+    0xbd, 0xd0, 0x07, 0xba, 0xc8, 0x00, 0xbe, 0x00, 0x00, 0x89, 0x32,
+    0x01, 0x12, 0x8b, 0x02, 0x01, 0xc3, 0x83, 0xc6, 0x02, 0x81, 0xfe,
+    0xe8, 0x03, 0x75, 0xef, 0x83, 0xea, 0x01, 0x75, 0xe7,
+};
+
+// top: add ax, bx / cmp ax, 30000 / jb skip / sub ax, 29999 / add dl, 1 /
+// mov [si+100], ax / skip: add bx, 7 / loop top
+static uint8_t const branch_loop[] = {
+    0x01, 0xd8, 0x3d, 0x30, 0x75, 0x72, 0x09, 0x2d, 0x2f, 0x75, 0x80,
+    0xc2, 0x01, 0x89, 0x44, 0x64, 0x83, 0xc3, 0x07, 0xe2, 0xeb,
+};
+
+// Runs the program from a fresh state with blocks, history or the plain
+// fetch loop, keeping the fastest of
+// SIM_BENCH_REPETITIONS runs. Returns the final state of the last run in
+// `result`.
+static double RunSimBench(SimBenchProgram *program, Decoder const *decoder,
+                          bool use_blocks, bool use_history,
+                          Simulator *result) {
+  double best_seconds = 0;
+  for (uint32_t repetition = 0; repetition < SIM_BENCH_REPETITIONS;
+       ++repetition) {
+    DestroySimulator(result);
+    InitSimulator(result);
+    LoadProgram(result, program->code, program->size);
+    result->instruction_limit = SIM_BENCH_LIMIT;
+
+    BlockCache blocks;
+    InitBlockCache(&blocks);
+    History history = {};
+    if (use_history) {
+      InitHistory(&history, result, 0);
+    }
+    uint64_t start = ReadOSTimer();
+    if (use_history) {
+      RunSimulatorRecorded(result, &history, use_blocks ? &blocks : 0,
+                           decoder);
+    } else if (use_blocks) {
+      RunSimulatorBlocks(result, &blocks, decoder);
+    } else {
+      RunSimulator(result, decoder);
+    }
+    double seconds = SecondsElapsed(start, ReadOSTimer());
+    DestroyBlockCache(&blocks);
+    DestroyHistory(&history);
+
+    if (repetition == 0 || seconds < best_seconds) {
+      best_seconds = seconds;
+    }
+  }
+
+  return best_seconds;
+}
+
+static bool IsStateEqual(Simulator *a, Simulator *b) {
+  return GetFlags(a) == GetFlags(b) && a->clocks == b->clocks &&
+         memcmp(a->registers, b->registers, sizeof(a->registers)) == 0 &&
+         IsMemoryEqual(a, b);
+}
+
+static bool BenchProgram(SimBenchProgram *program, Decoder const *decoder) {
+  Simulator fetch = {};
+  Simulator blocks = {};
+  double fetch_seconds = RunSimBench(program, decoder, false, false, &fetch);
+  double block_seconds = RunSimBench(program, decoder, true, false, &blocks);
+
+  // Blocks may run past the limit by up to one block, so only compare
+  // programs that halted.
+  bool is_match = fetch.instruction_count >= SIM_BENCH_LIMIT ||
+                  IsStateEqual(&fetch, &blocks);
+
+  printf("%-40s %10llu instructions: fetch %8.2f, blocks %8.2f M "
+         "instructions/s (%.2fx)%s\n",
+         program->name, (unsigned long long)fetch.instruction_count,
+         fetch.instruction_count / fetch_seconds / 1000000.0,
+         blocks.instruction_count / block_seconds / 1000000.0,
+         fetch_seconds / block_seconds, is_match ? "" : " MISMATCH");
+
+  DestroySimulator(&fetch);
+  DestroySimulator(&blocks);
+  return is_match;
+}
+
+// Runs the program SIM_BENCH_RESET_RUNS times, each with a different bx,
+// and returns the time spent resetting between runs.
+static double RunResetBench(SimBenchProgram *program, Decoder const *decoder,
+                            bool use_snapshot, uint16_t *checksum) {
+  Simulator simulator = {};
+  SimulatorSnapshot snapshot = {};
+  BlockCache blocks;
+  InitBlockCache(&blocks);
+  InitSimulator(&simulator);
+  LoadProgram(&simulator, program->code, program->size);
+  TakeSnapshot(&simulator, &snapshot);
+
+  uint64_t reset_time = 0;
+  *checksum = 0;
+  for (uint32_t run_idx = 0; run_idx < SIM_BENCH_RESET_RUNS; ++run_idx) {
+    uint64_t start = ReadOSTimer();
+    if (use_snapshot) {
+      RestoreSnapshot(&simulator, &snapshot);
+    } else {
+      // Blocks point into the decode cache, so they go with it.
+      DestroyBlockCache(&blocks);
+      DestroySimulator(&simulator);
+      InitBlockCache(&blocks);
+      InitSimulator(&simulator);
+      LoadProgram(&simulator, program->code, program->size);
+    }
+    reset_time += ReadOSTimer() - start;
+
+    simulator.registers[Register_b] = (uint16_t)run_idx;
+    simulator.instruction_limit = SIM_BENCH_LIMIT;
+    RunSimulatorBlocks(&simulator, &blocks, decoder);
+    *checksum += simulator.registers[Register_b];
+  }
+
+  DestroySnapshot(&snapshot);
+  DestroyBlockCache(&blocks);
+  DestroySimulator(&simulator);
+  return SecondsElapsed(0, reset_time);
+}
+
+static bool BenchReset(SimBenchProgram *program, Decoder const *decoder) {
+  uint16_t reload_checksum;
+  uint16_t restore_checksum;
+  double reload_seconds =
+      RunResetBench(program, decoder, false, &reload_checksum);
+  double restore_seconds =
+      RunResetBench(program, decoder, true, &restore_checksum);
+
+  bool is_match = reload_checksum == restore_checksum;
+  printf("%-40s reset: reload %8.2f us, restore %8.2f us%s\n", program->name,
+         reload_seconds * 1e6 / SIM_BENCH_RESET_RUNS,
+         restore_seconds * 1e6 / SIM_BENCH_RESET_RUNS,
+         is_match ? "" : " MISMATCH");
+  return is_match;
+}
+
+static bool BenchHistory(SimBenchProgram *program, Decoder const *decoder) {
+  Simulator plain = {};
+  Simulator recorded = {};
+  double fetch_seconds = RunSimBench(program, decoder, false, false, &plain);
+  double fetch_recorded_seconds =
+      RunSimBench(program, decoder, false, true, &recorded);
+  double block_seconds = RunSimBench(program, decoder, true, false, &plain);
+  double block_recorded_seconds =
+      RunSimBench(program, decoder, true, true, &recorded);
+
+  // Step back to half way, through several checkpoints, and compare with a
+  // run that stopped there.
+  DestroySimulator(&recorded);
+  InitSimulator(&recorded);
+  LoadProgram(&recorded, program->code, program->size);
+  recorded.instruction_limit = SIM_BENCH_LIMIT;
+  BlockCache blocks;
+  InitBlockCache(&blocks);
+  History history;
+  InitHistory(&history, &recorded, SIM_BENCH_HISTORY_INTERVAL);
+  RunSimulatorRecorded(&recorded, &history, &blocks, decoder);
+
+  uint64_t total = recorded.instruction_count;
+  uint64_t back_count = total - total / 2;
+  Simulator stopped = {};
+  InitSimulator(&stopped);
+  LoadProgram(&stopped, program->code, program->size);
+  stopped.instruction_limit = total / 2;
+  if (stopped.instruction_limit) {
+    // A limit of 0 is no limit: with nothing to run, the initial state is
+    // the reference.
+    RunSimulator(&stopped, decoder);
+  }
+
+  uint64_t start = ReadOSTimer();
+  for (uint64_t step_idx = 0; step_idx < back_count; ++step_idx) {
+    StepBack(&history, &recorded, decoder);
+  }
+  double back_seconds = SecondsElapsed(start, ReadOSTimer());
+
+  bool is_match = IsStateEqual(&recorded, &stopped);
+  printf("%-40s history: fetch %+.1f%%, blocks %+.1f%%, step back %.3f us"
+         "%s\n",
+         program->name, (fetch_recorded_seconds / fetch_seconds - 1) * 100,
+         (block_recorded_seconds / block_seconds - 1) * 100,
+         back_count ? back_seconds * 1e6 / back_count : 0,
+         is_match ? "" : " MISMATCH");
+
+  DestroyHistory(&history);
+  DestroyBlockCache(&blocks);
+  DestroySimulator(&stopped);
+  DestroySimulator(&recorded);
+  DestroySimulator(&plain);
+  return is_match;
+}
+
+// The general registers of run `seed`. cx sets the iteration count of
+// programs that loop on it without setting it.
+static void GetSeedRegisters(uint32_t seed, uint16_t *registers) {
+  registers[Register_a] = (uint16_t)(seed * 7919);
+  registers[Register_b] = (uint16_t)(seed * 104729);
+  registers[Register_c] = (uint16_t)(1000 + seed * 37 % 1000);
+  registers[Register_d] = (uint16_t)seed;
+  registers[Register_si] = (uint16_t)(2 * seed);
+}
+
+static bool BenchLanes(SimBenchProgram *program, Decoder const *decoder) {
+  static RegisterName const seeded[] = {Register_a, Register_b, Register_c,
+                                        Register_d, Register_si};
+  Simulator *scalar =
+      (Simulator *)calloc(SIM_BENCH_SEED_COUNT, sizeof(Simulator));
+
+  // Each seed runs on blocks, then on the fetch loop. The fetch loop stops
+  // exactly at the limit, like the lanes, so its states are the reference.
+  uint64_t fetch_time = 0;
+  uint64_t block_time = 0;
+  uint64_t scalar_count = 0;
+  for (uint32_t seed = 0; seed < SIM_BENCH_SEED_COUNT; ++seed) {
+    Simulator *simulator = &scalar[seed];
+    InitSimulator(simulator);
+    LoadProgram(simulator, program->code, program->size);
+    GetSeedRegisters(seed, simulator->registers);
+    simulator->instruction_limit = SIM_BENCH_SEED_LIMIT;
+    BlockCache blocks;
+    InitBlockCache(&blocks);
+    uint64_t start = ReadOSTimer();
+    RunSimulatorBlocks(simulator, &blocks, decoder);
+    block_time += ReadOSTimer() - start;
+    DestroyBlockCache(&blocks);
+    DestroySimulator(simulator);
+
+    InitSimulator(simulator);
+    LoadProgram(simulator, program->code, program->size);
+    GetSeedRegisters(seed, simulator->registers);
+    simulator->instruction_limit = SIM_BENCH_SEED_LIMIT;
+    start = ReadOSTimer();
+    RunSimulator(simulator, decoder);
+    fetch_time += ReadOSTimer() - start;
+    scalar_count += simulator->instruction_count;
+  }
+
+  LaneSimulator *lanes = new LaneSimulator;
+  uint64_t lane_time = 0;
+  uint64_t lane_count = 0;
+  uint64_t step_count = 0;
+  uint32_t modified_count = 0;
+  bool is_match = true;
+  for (uint32_t first_seed = 0; first_seed < SIM_BENCH_SEED_COUNT;
+       first_seed += LANE_COUNT) {
+    InitLaneSimulator(lanes);
+    LoadLaneProgram(lanes, program->code, program->size);
+    for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+      uint16_t registers[Register_count] = {};
+      GetSeedRegisters(first_seed + lane, registers);
+      for (uint32_t reg_idx = 0; reg_idx < ARRAY_SIZE(seeded); ++reg_idx) {
+        lanes->registers[seeded[reg_idx]][lane] = registers[seeded[reg_idx]];
+      }
+    }
+    lanes->instruction_limit = SIM_BENCH_SEED_LIMIT;
+
+    uint64_t start = ReadOSTimer();
+    RunLaneSimulator(lanes, decoder);
+    lane_time += ReadOSTimer() - start;
+    lane_count += lanes->instruction_count;
+    step_count += lanes->step_count;
+
+    // Lanes that modified the program stopped there; the scalar engine
+    // kept going.
+    for (uint32_t lane = 0; lane < LANE_COUNT; ++lane) {
+      Simulator *simulator = &scalar[first_seed + lane];
+      if (lanes->status[lane] == Simulate_CodeModified) {
+        ++modified_count;
+        continue;
+      }
+      is_match &=
+          lanes->instruction_counts[lane] == simulator->instruction_count;
+      for (uint32_t reg_idx = 0; reg_idx < Register_count; ++reg_idx) {
+        is_match &= lanes->registers[reg_idx][lane] ==
+                    simulator->registers[reg_idx];
+      }
+      is_match &= lanes->flags[lane] == GetFlags(simulator);
+      is_match &= memcmp(GetLaneMemory(lanes, lane), simulator->memory,
+                         SIMULATOR_MEMORY_SIZE) == 0;
+    }
+    DestroyLaneSimulator(lanes);
+  }
+
+  double fetch_seconds = SecondsElapsed(0, fetch_time);
+  double block_seconds = SecondsElapsed(0, block_time);
+  double lane_seconds = SecondsElapsed(0, lane_time);
+  double best_scalar = block_seconds < fetch_seconds ? block_seconds
+                                                     : fetch_seconds;
+  printf("%-40s seeds: fetch %8.2f, blocks %8.2f, lanes %8.2f M "
+         "instructions/s (%.2fx, %.0f%% of lanes active)%s%s\n",
+         program->name, scalar_count / fetch_seconds / 1000000.0,
+         scalar_count / block_seconds / 1000000.0,
+         lane_count / lane_seconds / 1000000.0,
+         best_scalar / lane_seconds,
+         100.0 * lane_count / (step_count * LANE_COUNT),
+         modified_count ? ", code modified" : "",
+         is_match ? "" : " MISMATCH");
+
+  delete lanes;
+  for (uint32_t seed = 0; seed < SIM_BENCH_SEED_COUNT; ++seed) {
+    DestroySimulator(&scalar[seed]);
+  }
+  free(scalar);
+  return is_match;
+}
+
+int main(int argc, char *argv[]) {
+  Decoder decoder;
+  InitDecoder(&decoder, 0);
+
+  SimBenchProgram builtins[] = {
+      {"register loop", register_loop, sizeof(register_loop)},
+      {"memory loop", memory_loop, sizeof(memory_loop)},
+      {"branch loop", branch_loop, sizeof(branch_loop)},
+  };
+  bool is_match = true;
+  for (uint32_t program_idx = 0; program_idx < ARRAY_SIZE(builtins);
+       ++program_idx) {
+    is_match &= BenchProgram(&builtins[program_idx], &decoder);
+  }
+  is_match &= BenchReset(&builtins[1], &decoder);
+  for (uint32_t program_idx = 0; program_idx < ARRAY_SIZE(builtins);
+       ++program_idx) {
+    is_match &= BenchHistory(&builtins[program_idx], &decoder);
+  }
+  for (uint32_t program_idx = 0; program_idx < ARRAY_SIZE(builtins);
+       ++program_idx) {
+    is_match &= BenchLanes(&builtins[program_idx], &decoder);
+  }
+
+  for (int arg_idx = 1; arg_idx < argc; ++arg_idx) {
+    FILE *file = fopen(argv[arg_idx], "rb");
+    if (!file) {
+      fprintf(stderr, "ERROR: Unable to open %s.\n", argv[arg_idx]);
+      return -1;
+    }
+    uint8_t *code = (uint8_t *)malloc(SIMULATOR_MAX_CODE_SIZE);
+    uint64_t size = fread(code, 1, SIMULATOR_MAX_CODE_SIZE, file);
+    fclose(file);
+
+    SimBenchProgram program = {argv[arg_idx], code, size};
+    is_match &= BenchProgram(&program, &decoder);
+    is_match &= BenchReset(&program, &decoder);
+    is_match &= BenchHistory(&program, &decoder);
+    is_match &= BenchLanes(&program, &decoder);
+    free(code);
+  }
+
+  if (!is_match) {
+    fprintf(stderr, "ERROR: The engines disagree, see MISMATCH above.\n");
+    return -1;
+  }
+  return 0;
+}
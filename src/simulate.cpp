@@ -4,171 +4,605 @@
 #include "stdlib.h"
 #include "string.h"
 
-#include "opcode.h"
-
-uint32_t SimulateInstruction(uint8_t *instruction, char *data_buf) {
-  uint32_t instruction_byte_count = 0;
-  if ((instruction[0] & 0b11111100) == OPCODE_MOV_RM2REG) {
-    printf("mov ");
-    instruction_byte_count = 2;
-    instruction_byte_count +=
-        RegisterOrMemoryWithRegisterToEither(instruction, data_buf);
-  } else if ((instruction[0] & 0b11110000) == OPCODE_MOV_IMM2REG) {
-    printf("mov ");
-    instruction_byte_count = 2;
-    uint8_t is_wide = instruction[0] & 0b00001000;
-    uint8_t reg = instruction[0] & 0b00000111;
-    instruction_byte_count +=
-        ImmediateToRegister(instruction, data_buf, is_wide, reg);
-  } else if ((instruction[0] & 0b11111110) == OPCODE_MOV_IMM2RM) {
-    printf("mov ");
-    instruction_byte_count = 3;
-    instruction_byte_count +=
-        ImmediateToRegisterOrMemory(instruction, data_buf, false);
-  } else if ((instruction[0] & 0b11111100) ==
-             ((OPCODE_MOV_MEM2ACC | OPCODE_MOV_ACC2MEM) & 0b11111100)) {
-    printf("mov ");
-    instruction_byte_count = 2;
-    instruction_byte_count +=
-        AddressWithAccumulatorToEither(instruction, data_buf);
-  } else if ((instruction[0] & 0b11111100) == OPCODE_ADD_RM2REG ||
-             (instruction[0] & 0b11111100) == OPCODE_SUB_RM2REG ||
-             (instruction[0] & 0b11111100) == OPCODE_CMP_RM2REG) {
-    switch (instruction[0] & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
+#include "decoder.h"
+
+// Executes decoded instructions against a register file and the 1 MiB
+// 8086 memory. The program is loaded at cs:0 and runs until ip leaves it.
+//
+// Registers are stored as 16-bit words indexed by RegisterName, with
+// Register_is holding ip. The 8-bit registers alias the low (offset 0) and
+// high (offset 1) byte of their word, as described by RegisterInfo.
+//
+// Memory operands are segment:offset pairs: the effective address is the
+// offset, wrapping at 64 KiB, in ds, or in ss when it is based on bp. The
+// physical address is segment * 16 + offset, wrapping at 1 MiB. Stores mark
+// the 4 KiB pages they touch as dirty, so dumps and comparisons only look
+// at memory the program loaded or wrote.
+//
+// Decoded instructions are cached by ip, so a loop is decoded once. Every
+// memory store invalidates the entries whose bytes it overwrites, which
+// keeps self-modifying code correct. Code runs in the cs it was loaded in:
+// writing cs is not supported.
+
+#define SIMULATOR_MEMORY_SIZE 0x100000
+#define SIMULATOR_PAGE_SIZE 0x1000
+#define SIMULATOR_PAGE_COUNT (SIMULATOR_MEMORY_SIZE / SIMULATOR_PAGE_SIZE)
+// Largest program, the most one code segment can address.
+#define SIMULATOR_MAX_CODE_SIZE 0x10000
+
+// Bit positions of the 8086 flags register.
+enum FlagBit {
+  Flag_CF = 0x1,
+  Flag_PF = 0x4,
+  Flag_AF = 0x10,
+  Flag_ZF = 0x40,
+  Flag_SF = 0x80,
+  Flag_OF = 0x800,
+};
+
+enum SimulateStatus {
+  Simulate_Halted,
+  // ip is at bytes that do not decode to an instruction, or to one the
+  // simulator does not support (writing cs).
+  Simulate_UnknownInstruction,
+  // instruction_limit instructions were executed.
+  Simulate_LimitReached,
+  // A lane of the lane simulator stored into the program it shares with the
+  // other lanes.
+  Simulate_CodeModified,
+};
+
+// The operation that last set the arithmetic flags, kept instead of the
+// flags themselves: most flag results are overwritten before anything reads
+// them.
+struct PendingFlags {
+  uint32_t a;
+  uint32_t b;
+  uint32_t result;
+  uint8_t op;
+  uint8_t is_wide;
+};
+
+struct Simulator {
+  uint16_t registers[Register_count];
+  // Only valid while has_pending_flags is clear; use GetFlags.
+  uint16_t flags;
+  PendingFlags pending_flags;
+  bool has_pending_flags;
+
+  uint8_t *memory;
+  // Pages that are not all zero, and the pages stored to since the last
+  // snapshot was taken or restored.
+  uint64_t dirty_pages[SIMULATOR_PAGE_COUNT / 64];
+  uint64_t written_pages[SIMULATOR_PAGE_COUNT / 64];
+  // Physical address of cs:0, and the program size starting there.
+  uint32_t code_base;
+  uint32_t code_size;
+
+  // One entry per ip; size 0 marks an entry that is not decoded.
+  Instruction *decode_cache;
+  // Set when a store drops a decode cache entry, for callers that keep their
+  // own translations of the code.
+  bool is_code_modified;
+
+  // 0 for no limit.
+  uint64_t instruction_limit;
+  uint64_t instruction_count;
+  uint64_t decode_count;
+  // 8086 clocks of the instructions executed, see Instruction::clocks.
+  uint64_t clocks;
+};
+
+void InitSimulator(Simulator *simulator) {
+  *simulator = {};
+  simulator->memory = (uint8_t *)calloc(SIMULATOR_MEMORY_SIZE, 1);
+  simulator->decode_cache =
+      (Instruction *)calloc(SIMULATOR_MAX_CODE_SIZE, sizeof(Instruction));
+}
+
+void DestroySimulator(Simulator *simulator) {
+  free(simulator->decode_cache);
+  free(simulator->memory);
+  *simulator = {};
+}
+
+inline uint32_t GetPhysicalAddress(uint16_t segment, uint16_t offset) {
+  return ((uint32_t)segment * 16 + offset) & (SIMULATOR_MEMORY_SIZE - 1);
+}
+
+inline void MarkPageDirty(Simulator *simulator, uint32_t address) {
+  uint32_t page = address / SIMULATOR_PAGE_SIZE;
+  simulator->dirty_pages[page / 64] |= 1ull << (page % 64);
+  simulator->written_pages[page / 64] |= 1ull << (page % 64);
+}
+
+inline bool IsPageDirty(Simulator *simulator, uint32_t page) {
+  return (simulator->dirty_pages[page / 64] >> (page % 64)) & 1;
+}
+
+// Copies the program to cs:0. Returns false if it does not fit in the code
+// segment or would wrap past the end of memory.
+bool LoadProgram(Simulator *simulator, uint8_t const *code, uint64_t size) {
+  uint32_t base = GetPhysicalAddress(simulator->registers[Register_cs], 0);
+  if (size > SIMULATOR_MAX_CODE_SIZE || base + size > SIMULATOR_MEMORY_SIZE) {
+    return false;
+  }
+
+  memcpy(simulator->memory + base, code, size);
+  for (uint64_t offset = 0; offset < size; offset += SIMULATOR_PAGE_SIZE) {
+    MarkPageDirty(simulator, (uint32_t)(base + offset));
+  }
+  if (size) {
+    MarkPageDirty(simulator, (uint32_t)(base + size - 1));
+  }
+
+  memset(simulator->decode_cache, 0,
+         SIMULATOR_MAX_CODE_SIZE * sizeof(Instruction));
+  simulator->code_base = base;
+  simulator->code_size = (uint32_t)size;
+  return true;
+}
+
+inline uint16_t ReadRegister(Simulator *simulator, RegisterInfo reg) {
+  uint16_t word = simulator->registers[reg.name];
+  return reg.size == 2 ? word : (uint8_t)(word >> (8 * reg.offset));
+}
+
+inline void WriteRegister(Simulator *simulator, RegisterInfo reg,
+                          uint16_t value) {
+  uint16_t *word = &simulator->registers[reg.name];
+  if (reg.size == 2) {
+    *word = value;
+  } else {
+    uint32_t shift = 8 * reg.offset;
+    *word = (uint16_t)((*word & ~(0xff << shift)) | (uint8_t)value << shift);
+  }
+}
+
+struct SegmentedAddress {
+  uint16_t segment;
+  uint16_t offset;
+};
+
+static SegmentedAddress GetEffectiveAddress(Simulator *simulator,
+                                            EffectiveAddress address) {
+  uint16_t *registers = simulator->registers;
+  uint16_t base = 0;
+  RegisterName segment = Register_ds;
+  switch (address.base) {
+  case EffectiveAddress_bx_si: {
+    base = registers[Register_b] + registers[Register_si];
+  } break;
+  case EffectiveAddress_bx_di: {
+    base = registers[Register_b] + registers[Register_di];
+  } break;
+  case EffectiveAddress_bp_si: {
+    base = registers[Register_bp] + registers[Register_si];
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_bp_di: {
+    base = registers[Register_bp] + registers[Register_di];
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_si: {
+    base = registers[Register_si];
+  } break;
+  case EffectiveAddress_di: {
+    base = registers[Register_di];
+  } break;
+  case EffectiveAddress_bp: {
+    base = registers[Register_bp];
+    segment = Register_ss;
+  } break;
+  case EffectiveAddress_bx: {
+    base = registers[Register_b];
+  } break;
+  default:
+    break;
+  }
+
+  SegmentedAddress result = {registers[segment],
+                             (uint16_t)(base + address.displacement)};
+  return result;
+}
+
+// The high byte of a word at offset 0xffff is at offset 0 of the same
+// segment.
+inline uint16_t LoadMemory(Simulator *simulator, SegmentedAddress address,
+                           bool is_wide) {
+  uint8_t *memory = simulator->memory;
+  uint16_t result = memory[GetPhysicalAddress(address.segment, address.offset)];
+  if (is_wide) {
+    uint16_t high_offset = (uint16_t)(address.offset + 1);
+    result |= memory[GetPhysicalAddress(address.segment, high_offset)] << 8;
+  }
+
+  return result;
+}
+
+// Drops the cached instructions that overlap the `size` bytes at physical
+// `address`.
+static void InvalidateDecodeCache(Simulator *simulator, uint32_t physical,
+                                  uint32_t size) {
+  // ip of the first byte; wraps to a large value below the code base.
+  uint32_t address = (physical - simulator->code_base) &
+                     (SIMULATOR_MEMORY_SIZE - 1);
+  if (address >= simulator->code_size) {
+    return;
+  }
+
+  uint32_t first = address >= MAX_INSTRUCTION_SIZE - 1
+                       ? address - (MAX_INSTRUCTION_SIZE - 1)
+                       : 0;
+  for (uint32_t start = first; start < (uint32_t)address + size; ++start) {
+    Instruction *entry = &simulator->decode_cache[start];
+    if (start + entry->size > address) {
+      entry->size = 0;
+      simulator->is_code_modified = true;
+    }
+  }
+}
+
+static void StoreByte(Simulator *simulator, uint32_t physical,
+                      uint8_t value) {
+  InvalidateDecodeCache(simulator, physical, 1);
+  MarkPageDirty(simulator, physical);
+  simulator->memory[physical] = value;
+}
+
+inline void StoreMemory(Simulator *simulator, SegmentedAddress address,
+                        uint16_t value, bool is_wide) {
+  StoreByte(simulator, GetPhysicalAddress(address.segment, address.offset),
+            (uint8_t)value);
+  if (is_wide) {
+    uint16_t high_offset = (uint16_t)(address.offset + 1);
+    StoreByte(simulator, GetPhysicalAddress(address.segment, high_offset),
+              (uint8_t)(value >> 8));
+  }
+}
+
+static uint16_t ReadOperand(Simulator *simulator, Operand operand,
+                            bool is_wide) {
+  switch (operand.type) {
+  case Operand_Register: {
+    return ReadRegister(simulator, operand.reg);
+  }
+  case Operand_Memory: {
+    return LoadMemory(simulator,
+                      GetEffectiveAddress(simulator, operand.address), is_wide);
+  }
+  case Operand_Immediate:
+  case Operand_RelativeImmediate: {
+    return (uint16_t)operand.immediate_s32;
+  }
+  default:
+    return 0;
+  }
+}
+
+static void WriteOperand(Simulator *simulator, Operand operand, uint16_t value,
+                         bool is_wide) {
+  if (operand.type == Operand_Register) {
+    WriteRegister(simulator, operand.reg, value);
+  } else if (operand.type == Operand_Memory) {
+    StoreMemory(simulator, GetEffectiveAddress(simulator, operand.address),
+                value, is_wide);
+  }
+}
+
+static bool IsParityEven(uint8_t value) {
+  value ^= value >> 4;
+  value ^= value >> 2;
+  value ^= value >> 1;
+  return !(value & 1);
+}
+
+// One flag of `a op b` for add, and for sub and cmp, with result = a op b
+// computed in 32 bits.
+inline bool GetArithmeticFlag(PendingFlags operation, FlagBit flag) {
+  uint32_t a = operation.a;
+  uint32_t b = operation.b;
+  uint32_t result = operation.result;
+  uint32_t mask = operation.is_wide ? 0xffff : 0xff;
+  uint32_t sign = operation.is_wide ? 0x8000 : 0x80;
+  bool is_add = operation.op == Op_add;
+
+  switch (flag) {
+  case Flag_CF:
+    return is_add ? result > mask : b > a;
+  case Flag_PF:
+    return IsParityEven((uint8_t)result);
+  case Flag_AF:
+    return (a ^ b ^ result) & 0x10;
+  case Flag_ZF:
+    return (result & mask) == 0;
+  case Flag_SF:
+    return result & sign;
+  case Flag_OF:
+    return (is_add ? ~(a ^ b) : a ^ b) & (a ^ result) & sign;
+  }
+
+  return false;
+}
+
+static uint16_t GetArithmeticFlags(PendingFlags operation) {
+  uint16_t result = 0;
+  result |= GetArithmeticFlag(operation, Flag_CF) ? Flag_CF : 0;
+  result |= GetArithmeticFlag(operation, Flag_PF) ? Flag_PF : 0;
+  result |= GetArithmeticFlag(operation, Flag_AF) ? Flag_AF : 0;
+  result |= GetArithmeticFlag(operation, Flag_ZF) ? Flag_ZF : 0;
+  result |= GetArithmeticFlag(operation, Flag_SF) ? Flag_SF : 0;
+  result |= GetArithmeticFlag(operation, Flag_OF) ? Flag_OF : 0;
+
+  return result;
+}
+
+// Define SIMULATOR_EAGER_FLAGS to compute every flag at every add/sub/cmp,
+// the reference the lazy path has to match.
+inline void SetArithmeticFlags(Simulator *simulator, OpMnemonic op, uint32_t a,
+                               uint32_t b, uint32_t result, bool is_wide) {
+  PendingFlags operation = {a, b, result, (uint8_t)op, (uint8_t)is_wide};
+#ifdef SIMULATOR_EAGER_FLAGS
+  simulator->flags = GetArithmeticFlags(operation);
+#else
+  simulator->pending_flags = operation;
+  simulator->has_pending_flags = true;
+#endif
+}
+
+inline bool GetFlag(Simulator *simulator, FlagBit flag) {
+  if (simulator->has_pending_flags) {
+    return GetArithmeticFlag(simulator->pending_flags, flag);
+  }
+
+  return simulator->flags & flag;
+}
+
+uint16_t GetFlags(Simulator *simulator) {
+  if (simulator->has_pending_flags) {
+    simulator->flags = GetArithmeticFlags(simulator->pending_flags);
+    simulator->has_pending_flags = false;
+  }
+
+  return simulator->flags;
+}
+
+// Only the flags a condition reads are computed.
+static bool IsJumpTaken(Simulator *simulator, OpMnemonic op) {
+  switch (op) {
+  case Op_je:
+    return GetFlag(simulator, Flag_ZF);
+  case Op_jl:
+    return GetFlag(simulator, Flag_SF) != GetFlag(simulator, Flag_OF);
+  case Op_jle:
+    return GetFlag(simulator, Flag_ZF) ||
+           GetFlag(simulator, Flag_SF) != GetFlag(simulator, Flag_OF);
+  case Op_jb:
+    return GetFlag(simulator, Flag_CF);
+  case Op_jbe:
+    return GetFlag(simulator, Flag_CF) || GetFlag(simulator, Flag_ZF);
+  case Op_jp:
+    return GetFlag(simulator, Flag_PF);
+  case Op_jo:
+    return GetFlag(simulator, Flag_OF);
+  case Op_js:
+    return GetFlag(simulator, Flag_SF);
+  case Op_jne:
+    return !GetFlag(simulator, Flag_ZF);
+  case Op_jnl:
+    return GetFlag(simulator, Flag_SF) == GetFlag(simulator, Flag_OF);
+  case Op_jg:
+    return !GetFlag(simulator, Flag_ZF) &&
+           GetFlag(simulator, Flag_SF) == GetFlag(simulator, Flag_OF);
+  case Op_jnb:
+    return !GetFlag(simulator, Flag_CF);
+  case Op_ja:
+    return !GetFlag(simulator, Flag_CF) && !GetFlag(simulator, Flag_ZF);
+  case Op_jnp:
+    return !GetFlag(simulator, Flag_PF);
+  case Op_jno:
+    return !GetFlag(simulator, Flag_OF);
+  case Op_jns:
+    return !GetFlag(simulator, Flag_SF);
+  default:
+    break;
+  }
+
+  // loop, loopz and loopnz decrement cx without touching the flags.
+  uint16_t *cx = &simulator->registers[Register_c];
+  switch (op) {
+  case Op_loop:
+    return --*cx != 0;
+  case Op_loopz:
+    return --*cx != 0 && GetFlag(simulator, Flag_ZF);
+  case Op_loopnz:
+    return --*cx != 0 && !GetFlag(simulator, Flag_ZF);
+  case Op_jcxz:
+    return *cx == 0;
+  default:
+    return false;
+  }
+}
+
+// Executes one instruction, including its update of ip. Returns whether it
+// was a jump that was taken, which a jump to the next instruction is too.
+bool SimulateInstruction(Simulator *simulator, Instruction instruction) {
+  bool is_taken = false;
+  uint16_t *ip = &simulator->registers[Register_is];
+  *ip = (uint16_t)(instruction.address + instruction.size);
+
+  bool is_wide = instruction.flags & Inst_Wide;
+  Operand destination = instruction.operands[0];
+  Operand source = instruction.operands[1];
+
+  simulator->clocks += instruction.clocks;
+  if (instruction.transfer_count && is_wide) {
+    // Before executing: the instruction may write a register of its own
+    // address.
+    Operand memory =
+        destination.type == Operand_Memory ? destination : source;
+    if (GetEffectiveAddress(simulator, memory.address).offset & 1) {
+      simulator->clocks += 4 * instruction.transfer_count;
     }
-    instruction_byte_count = 2;
-    instruction_byte_count +=
-        RegisterOrMemoryWithRegisterToEither(instruction, data_buf);
-  } else if ((instruction[0] & 0b11111100) ==
-             (OPCODE_ADD_IMM2RM | OPCODE_SUB_IMM2RM | OPCODE_CMP_IMM2RM)) {
-    switch (instruction[1] & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
+  }
+
+  switch (instruction.op) {
+  case Op_mov: {
+    WriteOperand(simulator, destination,
+                 ReadOperand(simulator, source, is_wide), is_wide);
+  } break;
+  case Op_add:
+  case Op_sub:
+  case Op_cmp: {
+    uint32_t mask = is_wide ? 0xffff : 0xff;
+    uint32_t a = ReadOperand(simulator, destination, is_wide) & mask;
+    uint32_t b = ReadOperand(simulator, source, is_wide) & mask;
+    uint32_t result = instruction.op == Op_add ? a + b : a - b;
+
+    SetArithmeticFlags(simulator, instruction.op, a, b, result, is_wide);
+    if (instruction.op != Op_cmp) {
+      WriteOperand(simulator, destination, (uint16_t)result, is_wide);
     }
-    instruction_byte_count = 3;
-    instruction_byte_count +=
-        ImmediateToRegisterOrMemory(instruction, data_buf, true);
-  } else if ((instruction[0] & 0b11111110) == OPCODE_ADD_IMM2ACC ||
-             (instruction[0] & 0b11111110) == OPCODE_SUB_IMM2ACC ||
-             (instruction[0] & 0b11111110) == OPCODE_CMP_IMM2ACC) {
-    switch (instruction[0] & 0b00111000) {
-    case 0b00000000: {
-      printf("add ");
-    } break;
-    case 0b00101000: {
-      printf("sub ");
-    } break;
-    case 0b00111000: {
-      printf("cmp ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
+  } break;
+  default: {
+    is_taken = IsJumpTaken(simulator, instruction.op);
+    if (is_taken) {
+      *ip = (uint16_t)(*ip + destination.immediate_s32);
+      simulator->clocks += instruction.taken_clocks;
     }
-    instruction_byte_count = 2;
-    instruction_byte_count += ImmediateToAccumulator(instruction, data_buf);
-  } else if (instruction[0] == OPCODE_JE || instruction[0] == OPCODE_JL ||
-             instruction[0] == OPCODE_JLE || instruction[0] == OPCODE_JB ||
-             instruction[0] == OPCODE_JBE || instruction[0] == OPCODE_JP ||
-             instruction[0] == OPCODE_JO || instruction[0] == OPCODE_JS ||
-             instruction[0] == OPCODE_JNE || instruction[0] == OPCODE_JNL ||
-             instruction[0] == OPCODE_JG || instruction[0] == OPCODE_JNB ||
-             instruction[0] == OPCODE_JA || instruction[0] == OPCODE_JNP ||
-             instruction[0] == OPCODE_JNO || instruction[0] == OPCODE_JNS ||
-             instruction[0] == OPCODE_LOOP || instruction[0] == OPCODE_LOOPZ ||
-             instruction[0] == OPCODE_LOOPNZ || instruction[0] == OPCODE_JCXZ) {
-    switch (instruction[0]) {
-    case OPCODE_JE: {
-      printf("je ");
-    } break;
-    case OPCODE_JL: {
-      printf("jl ");
-    } break;
-    case OPCODE_JLE: {
-      printf("jle ");
-    } break;
-    case OPCODE_JB: {
-      printf("jb ");
-    } break;
-    case OPCODE_JBE: {
-      printf("jbe ");
-    } break;
-    case OPCODE_JP: {
-      printf("jp ");
-    } break;
-    case OPCODE_JO: {
-      printf("jo ");
-    } break;
-    case OPCODE_JS: {
-      printf("js ");
-    } break;
-    case OPCODE_JNE: {
-      printf("jne ");
-    } break;
-    case OPCODE_JNL: {
-      printf("jnl ");
-    } break;
-    case OPCODE_JG: {
-      printf("jg ");
-    } break;
-    case OPCODE_JNB: {
-      printf("jnb ");
-    } break;
-    case OPCODE_JA: {
-      printf("ja ");
-    } break;
-    case OPCODE_JNP: {
-      printf("jnp ");
-    } break;
-    case OPCODE_JNO: {
-      printf("jno ");
-    } break;
-    case OPCODE_JNS: {
-      printf("jns ");
-    } break;
-    case OPCODE_LOOP: {
-      printf("loop ");
-    } break;
-    case OPCODE_LOOPZ: {
-      printf("loopz ");
-    } break;
-    case OPCODE_LOOPNZ: {
-      printf("loopnz ");
-    } break;
-    case OPCODE_JCXZ: {
-      printf("jcxz ");
-    } break;
-    default:
-      INSTRUCTION_NOT_IMPLEMENTED();
+  } break;
+  }
+
+  return is_taken;
+}
+
+// Returns the decoded instruction at ip `address`, or 0 if the bytes there
+// do not decode or it writes cs. `address` must be inside the program.
+Instruction *FetchInstruction(Simulator *simulator, Decoder const *decoder,
+                              uint16_t address) {
+  Instruction *result = &simulator->decode_cache[address];
+  if (!result->size) {
+    DecodeStatus status = DecodeInstruction(
+        decoder, simulator->memory + simulator->code_base + address,
+        simulator->code_size - address, address, result);
+    ++simulator->decode_count;
+    Operand destination = result->operands[0];
+    bool writes_cs = destination.type == Operand_Register &&
+                     destination.reg.name == Register_cs;
+    if (status != Decode_Ok || result->op == Op_db || writes_cs) {
+      result->size = 0;
+      return 0;
+    }
+  }
+
+  return result;
+}
+
+// Fetch-decode-execute until ip leaves the program, reaches bytes that do
+// not decode or the instruction limit is reached.
+SimulateStatus RunSimulator(Simulator *simulator, Decoder const *decoder) {
+  uint16_t *ip = &simulator->registers[Register_is];
+  uint64_t limit = simulator->instruction_limit;
+  while (*ip < simulator->code_size) {
+    if (limit && simulator->instruction_count >= limit) {
+      return Simulate_LimitReached;
     }
-    instruction_byte_count = 2;
-    int8_t value = instruction[1] + 2;
-    if (value < 0) {
-      printf("$+0%hhd", value);
-    } else {
-      printf("$+0+%hhd", value);
+
+    Instruction *instruction = FetchInstruction(simulator, decoder, *ip);
+    if (!instruction) {
+      return Simulate_UnknownInstruction;
     }
-  } else {
-    INSTRUCTION_NOT_IMPLEMENTED();
+    SimulateInstruction(simulator, *instruction);
+    ++simulator->instruction_count;
+  }
+
+  return Simulate_Halted;
+}
+
+// Returns whether the memory of two simulators that loaded the same program
+// is identical. Only pages dirty in either one are compared.
+bool IsMemoryEqual(Simulator *a, Simulator *b) {
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    if (IsPageDirty(a, page) || IsPageDirty(b, page)) {
+      uint32_t offset = page * SIMULATOR_PAGE_SIZE;
+      if (memcmp(a->memory + offset, b->memory + offset, SIMULATOR_PAGE_SIZE)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+uint32_t GetDirtyPageCount(Simulator *simulator) {
+  uint32_t result = 0;
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    result += IsPageDirty(simulator, page);
+  }
+
+  return result;
+}
+
+// Writes the full 1 MiB memory image. Only dirty pages are written; the
+// clean ones are zero and are left as holes in the file.
+bool WriteMemoryDump(FILE *file, Simulator *simulator) {
+  bool success = true;
+  for (uint32_t page = 0; success && page < SIMULATOR_PAGE_COUNT; ++page) {
+    if (IsPageDirty(simulator, page)) {
+      uint32_t offset = page * SIMULATOR_PAGE_SIZE;
+      success = fseek(file, offset, SEEK_SET) == 0 &&
+                fwrite(simulator->memory + offset, SIMULATOR_PAGE_SIZE, 1,
+                       file) == 1;
+    }
+  }
+
+  // Extend the file to the full size if the last page is clean.
+  uint8_t last_byte = simulator->memory[SIMULATOR_MEMORY_SIZE - 1];
+  success = success &&
+            fseek(file, SIMULATOR_MEMORY_SIZE - 1, SEEK_SET) == 0 &&
+            fwrite(&last_byte, 1, 1, file) == 1;
+  return success;
+}
+
+// Prints the registers that are not zero, then the flags that are set.
+void PrintRegisters(FILE *file, Simulator *simulator) {
+  static struct {
+    RegisterName name;
+    char const *text;
+  } const register_names[] = {
+      {Register_a, "ax"},  {Register_b, "bx"},  {Register_c, "cx"},
+      {Register_d, "dx"},  {Register_sp, "sp"}, {Register_bp, "bp"},
+      {Register_si, "si"}, {Register_di, "di"}, {Register_es, "es"},
+      {Register_cs, "cs"}, {Register_ss, "ss"}, {Register_ds, "ds"},
+      {Register_is, "ip"},
+  };
+  static_assert(ARRAY_SIZE(register_names) == Register_count,
+                "one name per register");
+
+  fprintf(file, "Final registers:\n");
+  for (uint32_t reg_idx = 0; reg_idx < ARRAY_SIZE(register_names); ++reg_idx) {
+    uint16_t value = simulator->registers[register_names[reg_idx].name];
+    if (value) {
+      fprintf(file, "      %s: 0x%04x (%u)\n", register_names[reg_idx].text,
+              value, value);
+    }
+  }
+
+  static struct {
+    FlagBit bit;
+    char name;
+  } const flag_names[] = {
+      {Flag_CF, 'C'}, {Flag_PF, 'P'}, {Flag_AF, 'A'},
+      {Flag_ZF, 'Z'}, {Flag_SF, 'S'}, {Flag_OF, 'O'},
+  };
+  uint16_t flags = GetFlags(simulator);
+  if (flags) {
+    fprintf(file, "   flags: ");
+    for (uint32_t flag_idx = 0; flag_idx < ARRAY_SIZE(flag_names); ++flag_idx) {
+      if (flags & flag_names[flag_idx].bit) {
+        fputc(flag_names[flag_idx].name, file);
+      }
+    }
+    fputc('\n', file);
   }
-  return instruction_byte_count;
 }
@@ -0,0 +1,139 @@
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Snapshot and restore of the simulator state, for running one program many
+// times from the same starting point.
+//
+// A snapshot keeps the registers, flags and a copy of each dirty page; clean
+// pages are zero and need no copy. Taking a snapshot clears the simulator's
+// written_pages, so a restore only has to copy back the pages the run
+// stored to since, and zero the ones that were clean in the snapshot. The
+// cost of a restore is proportional to what the run touched, not to the
+// 1 MiB of memory.
+//
+// A delta snapshot copies only the pages written since the snapshot before
+// it, so taking one also costs only what the run touched; the other pages
+// are in the snapshots before it, which is how the history keeps its
+// checkpoints.
+
+struct SimulatorSnapshot {
+  uint16_t registers[Register_count];
+  uint16_t flags;
+  uint64_t instruction_count;
+  uint64_t clocks;
+
+  uint64_t dirty_pages[SIMULATOR_PAGE_COUNT / 64];
+  // Pages copied into pages: the dirty ones, or for a delta the ones
+  // written since the snapshot before.
+  uint64_t stored_pages[SIMULATOR_PAGE_COUNT / 64];
+  // Index into pages of each stored page.
+  uint16_t page_slot[SIMULATOR_PAGE_COUNT];
+  uint8_t *pages;
+  uint32_t page_count;
+};
+
+static void TakeSnapshotPages(Simulator *simulator, SimulatorSnapshot *snapshot,
+                              uint64_t const *pages) {
+  memcpy(snapshot->registers, simulator->registers,
+         sizeof(snapshot->registers));
+  snapshot->flags = GetFlags(simulator);
+  snapshot->instruction_count = simulator->instruction_count;
+  snapshot->clocks = simulator->clocks;
+  memcpy(snapshot->dirty_pages, simulator->dirty_pages,
+         sizeof(snapshot->dirty_pages));
+  memcpy(snapshot->stored_pages, pages, sizeof(snapshot->stored_pages));
+
+  snapshot->page_count = 0;
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    snapshot->page_count += (pages[page / 64] >> (page % 64)) & 1;
+  }
+  snapshot->pages = (uint8_t *)realloc(
+      snapshot->pages, (snapshot->page_count + 1) * SIMULATOR_PAGE_SIZE);
+  uint32_t slot = 0;
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    if ((snapshot->stored_pages[page / 64] >> (page % 64)) & 1) {
+      snapshot->page_slot[page] = (uint16_t)slot;
+      memcpy(snapshot->pages + slot * SIMULATOR_PAGE_SIZE,
+             simulator->memory + page * SIMULATOR_PAGE_SIZE,
+             SIMULATOR_PAGE_SIZE);
+      ++slot;
+    }
+  }
+
+  memset(simulator->written_pages, 0, sizeof(simulator->written_pages));
+}
+
+void TakeSnapshot(Simulator *simulator, SimulatorSnapshot *snapshot) {
+  TakeSnapshotPages(simulator, snapshot, simulator->dirty_pages);
+}
+
+// Copies only the pages written since the last snapshot was taken. A delta
+// cannot be given to RestoreSnapshot.
+void TakeDeltaSnapshot(Simulator *simulator, SimulatorSnapshot *snapshot) {
+  TakeSnapshotPages(simulator, snapshot, simulator->written_pages);
+}
+
+void DestroySnapshot(SimulatorSnapshot *snapshot) {
+  free(snapshot->pages);
+  snapshot->pages = 0;
+  snapshot->page_count = 0;
+}
+
+// Restored bytes inside the program drop their decoded instructions when
+// they differ from the current ones.
+static void RestorePage(Simulator *simulator, uint32_t page,
+                        uint8_t const *data) {
+  uint32_t page_start = page * SIMULATOR_PAGE_SIZE;
+  uint8_t *memory = simulator->memory + page_start;
+
+  uint32_t code_start = simulator->code_base;
+  uint32_t code_end = code_start + simulator->code_size;
+  if (page_start < code_end && page_start + SIMULATOR_PAGE_SIZE > code_start) {
+    uint32_t first = page_start > code_start ? page_start : code_start;
+    uint32_t end = page_start + SIMULATOR_PAGE_SIZE < code_end
+                       ? page_start + SIMULATOR_PAGE_SIZE
+                       : code_end;
+    for (uint32_t address = first; address < end; ++address) {
+      uint8_t value = data ? data[address - page_start] : 0;
+      if (memory[address - page_start] != value) {
+        InvalidateDecodeCache(simulator, address, 1);
+      }
+    }
+  }
+
+  if (data) {
+    memcpy(memory, data, SIMULATOR_PAGE_SIZE);
+  } else {
+    memset(memory, 0, SIMULATOR_PAGE_SIZE);
+  }
+}
+
+// Everything but the memory contents.
+static void RestoreSnapshotState(Simulator *simulator,
+                                 SimulatorSnapshot const *snapshot) {
+  memcpy(simulator->dirty_pages, snapshot->dirty_pages,
+         sizeof(simulator->dirty_pages));
+  memset(simulator->written_pages, 0, sizeof(simulator->written_pages));
+
+  memcpy(simulator->registers, snapshot->registers,
+         sizeof(simulator->registers));
+  simulator->flags = snapshot->flags;
+  simulator->has_pending_flags = false;
+  simulator->instruction_count = snapshot->instruction_count;
+  simulator->clocks = snapshot->clocks;
+}
+
+// `snapshot` must be the last one taken on this simulator: written_pages
+// only covers the stores since then.
+void RestoreSnapshot(Simulator *simulator, SimulatorSnapshot *snapshot) {
+  for (uint32_t page = 0; page < SIMULATOR_PAGE_COUNT; ++page) {
+    if ((simulator->written_pages[page / 64] >> (page % 64)) & 1) {
+      bool was_dirty = (snapshot->dirty_pages[page / 64] >> (page % 64)) & 1;
+      uint8_t const *data =
+          snapshot->pages + snapshot->page_slot[page] * SIMULATOR_PAGE_SIZE;
+      RestorePage(simulator, page, was_dirty ? data : 0);
+    }
+  }
+  RestoreSnapshotState(simulator, snapshot);
+}
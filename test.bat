@@ -28,6 +28,50 @@ for %%f in (listings\*.asm) do (
     )
 
     git diff --no-index build\%%~nf build\output_%%~nf
+    if errorlevel 1 (
+        echo Error: output of %%f does not assemble to the same bytes
+        exit /b 1
+    )
+
+    rem main and fuzz return -1, which "if errorlevel 1" does not catch.
+    .\build\main.exe --verify build\%%~nf || (
+        echo Error during round trip verification of %%f
+        exit /b 1
+    )
+)
+
+.\build\fuzz.exe --encode --count 4000000 || (
+    echo Error: the fuzzer found mismatches
+    exit /b 1
+)
+
+rem Programs that do not halt stop at the limit. git diff ignores the CRs
+rem that main.exe writes at the end of each line.
+for %%f in (listings\exec\*.txt) do (
+    for %%m in (main main_eager) do (
+        for %%o in ("--exec --interpret" "--exec") do (
+            echo Executing %%~nf with %%m %%~o...
+            pushd build
+            .\%%m.exe %%~o --limit 1000000 %%~nf > exec_%%~nf.txt || (
+                popd
+                echo Error during execution of %%~nf
+                exit /b 1
+            )
+            popd
+
+            git diff --no-index --ignore-cr-at-eol build\exec_%%~nf.txt %%f
+            if errorlevel 1 (
+                echo Error: final state of %%~nf does not match %%f
+                exit /b 1
+            )
+        )
+    )
+)
+
+.\build\sim_bench.exe build\listing_0041_add_sub_cmp_jnz ^
+    build\sim_memory_segments || (
+    echo Error: the simulator engines disagree
+    exit /b 1
 )
 
 echo All files processed.
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Assembles each listing, disassembles it and checks that the output
+# assembles back to the same bytes and that main --verify encodes every
+# instruction back to them. Then fuzzes the decoder and the encoder for a
+# fixed number of executions.
+#
+# Executes the listings that have an expected final state in listings/exec
+# on the fetch loop and on blocks, with lazy flags and with the eager flags
+# build, which has to match exactly. Then sim_bench compares the engines on
+# them. Stops at the first failure.
+
+if [ ! -d listings ]; then
+    echo Error: listings/ directory not found.
+    exit 1
+fi
+
+./build.sh || exit 1
+
+for listing in listings/*.asm; do
+    name=$(basename "$listing" .asm)
+    echo Processing $listing...
+    nasm -o build/$name "$listing" || exit 1
+    ./build/main build/$name > build/output_$name.asm || exit 1
+    nasm -o build/output_$name build/output_$name.asm || exit 1
+    if ! cmp build/$name build/output_$name; then
+        echo Error: output of $listing does not assemble to the same bytes
+        exit 1
+    fi
+    ./build/main --verify build/$name || exit 1
+done
+
+./build/fuzz --encode --count 4000000 || exit 1
+
+# Programs that do not halt stop at the limit.
+for expected in listings/exec/*.txt; do
+    name=$(basename "$expected" .txt)
+    for run in "main --exec --interpret" "main --exec" \
+               "main_eager --exec --interpret" "main_eager --exec"; do
+        echo Executing $name with $run...
+        (cd build && ./$run --limit 1000000 $name) > build/exec_$name.txt ||
+            exit 1
+        if ! cmp build/exec_$name.txt "$expected"; then
+            echo Error: final state of $name does not match $expected
+            exit 1
+        fi
+    done
+done
+
+./build/sim_bench build/listing_0041_add_sub_cmp_jnz \
+    build/sim_memory_segments || exit 1
+
+echo All files processed.
+exit 0